@@ -0,0 +1,286 @@
+#include "synthetic_level.h"
+
+#include <bsp/read_file.h>
+#include <utils/memory_usage.h>
+#include <voxel/write_file.h>
+#include <wad/read_file.h>
+#include <wad/write_file.h>
+
+#define OGT_VOX_IMPLEMENTATION
+#include <ogt_vox.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Checks of the readers and writers against an independent implementation, run by ctest:
+//   voxlife_check [check names...]
+// Without arguments every check runs. Exits with 1 if any of them fails.
+
+namespace {
+
+    void expect(bool condition, std::string_view message) {
+        if (!condition)
+            throw std::runtime_error(std::string(message));
+    }
+
+    // Writes a few models of random voxels in several materials and reads the file back with ogt_vox
+    void check_vox_round_trip(const std::filesystem::path &directory) {
+        std::mt19937 rng(3);
+        const std::array materials = {MaterialType::CONCRETE, MaterialType::WOOD, MaterialType::GLASS};
+        const std::array sizes = {glm::u32vec3(1, 1, 1), glm::u32vec3(7, 12, 5), glm::u32vec3(40, 9, 33), glm::u32vec3(256, 3, 17)};
+
+        std::vector<SparseVolume> volumes;
+        volumes.reserve(sizes.size());
+        std::vector<VoxelModel> models;
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            auto &volume = volumes.emplace_back(sizes[i]);
+            for (uint32_t z = 0; z < sizes[i].z; ++z) {
+                for (uint32_t y = 0; y < sizes[i].y; ++y) {
+                    for (uint32_t x = 0; x < sizes[i].x; ++x) {
+                        if (rng() % 3 != 0 && sizes[i] != glm::u32vec3(1))
+                            continue;
+
+                        auto color = glm::u8vec3(rng(), rng(), rng());
+                        volume.set(glm::ivec3(x, y, z), Voxel{color, materials[rng() % materials.size()]});
+                    }
+                }
+            }
+            models.push_back({.volume = &volume, .pos = glm::i32vec3(i * 300, -static_cast<int32_t>(i) * 7, 11), .size = sizes[i]});
+        }
+
+        auto palette = generate_palette(models);
+        auto filename = (directory / "round_trip.vox").string();
+        write_magicavoxel_model(filename, models, palette);
+
+        std::ifstream file(filename, std::ios::binary);
+        std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        expect(buffer.size() >= 20, "the file was not written");
+
+        // ogt_vox reads on after MAIN whatever its sizes say, so they are checked separately
+        uint32_t main_sizes[2];
+        std::memcpy(main_sizes, buffer.data() + 12, sizeof(main_sizes));
+        expect(std::memcmp(buffer.data() + 8, "MAIN", 4) == 0, "the first chunk is not MAIN");
+        expect(main_sizes[0] == 0 && main_sizes[1] == buffer.size() - 20,
+               std::format("MAIN has {} bytes of content and {} of children, the file has {} after it",
+                           main_sizes[0], main_sizes[1], buffer.size() - 20));
+
+        auto *scene = ogt_vox_read_scene_with_flags(buffer.data(), static_cast<uint32_t>(buffer.size()),
+                                                    k_read_scene_flags_keep_empty_models_instances | k_read_scene_flags_keep_duplicate_models);
+        expect(scene != nullptr, "ogt_vox could not read the file");
+
+        try {
+            expect(scene->num_models == models.size(), std::format("{} models were read, {} written", scene->num_models, models.size()));
+            expect(scene->num_instances == models.size(), std::format("{} instances were read, {} written", scene->num_instances, models.size()));
+
+            for (size_t i = 0; i < models.size(); ++i) {
+                auto &model = models[i];
+                auto *read_model = scene->models[i];
+                expect(glm::u32vec3(read_model->size_x, read_model->size_y, read_model->size_z) == model.size,
+                       std::format("model {} has the wrong size", i));
+
+                std::vector<uint8_t> expected(static_cast<size_t>(model.size.x) * model.size.y * model.size.z);
+                model.volume->for_each_voxel([&](glm::ivec3 pos, const Voxel &voxel) {
+                    expected[pos.x + pos.y * model.size.x + static_cast<size_t>(pos.z) * model.size.x * model.size.y] = palette.get_index(voxel);
+                });
+                expect(std::equal(expected.begin(), expected.end(), read_model->voxel_data),
+                       std::format("model {} has different voxels", i));
+
+                auto &instance = scene->instances[i];
+                expect(instance.model_index == i, std::format("instance {} uses model {}", i, instance.model_index));
+                expect(glm::vec3(instance.transform.m30, instance.transform.m31, instance.transform.m32) == glm::vec3(model.pos),
+                       std::format("instance {} has the wrong position", i));
+            }
+
+            // ogt_vox rotates the palette back on read and clears the alpha of index zero
+            for (uint32_t i = 1; i < 256; ++i) {
+                auto color = scene->palette.color[i];
+                expect(glm::u8vec4(color.r, color.g, color.b, color.a) == palette.colors[i], std::format("palette entry {} differs", i));
+            }
+        } catch (...) {
+            ogt_vox_destroy_scene(scene);
+            throw;
+        }
+        ogt_vox_destroy_scene(scene);
+    }
+
+    // A node referencing one of its ancestors would make every tree walk loop forever, open_file has to reject it
+    // and close the file again
+    void check_bsp_node_cycle(const std::filesystem::path &directory) {
+        auto level = generate_synthetic_level({.room_count = 8, .texture_count = 4}, "node_cycle.wad");
+        expect(level.lumps.nodes.size() >= 2, "the level has no inner nodes");
+
+        auto filename = (directory / "node_cycle.bsp").string();
+        voxlife::bsp::write_file(filename, level.lumps);
+
+        voxlife::bsp::bsp_handle handle = nullptr;
+        voxlife::bsp::open_file(filename, &handle);
+        voxlife::bsp::release(handle);
+
+        auto &node = level.lumps.nodes.back();
+        node.children[node.children[0] >= 0 ? 0 : 1] = 0;
+        voxlife::bsp::write_file(filename, level.lumps);
+
+        auto mapped_bytes = voxlife::memory::get_mapped_bytes();
+        bool rejected = false;
+        try {
+            voxlife::bsp::open_file(filename, &handle);
+            voxlife::bsp::release(handle);
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        expect(rejected, "a level whose last node references the root was opened");
+        expect(handle == nullptr, "the handle of the rejected level was set");
+        expect(voxlife::memory::get_mapped_bytes() == mapped_bytes, "the rejected level is still mapped");
+    }
+
+    // The header of an external texture in the level can disagree with the texture in the wad, the texels handed out
+    // have to come with the size of the wad texture
+    void check_bsp_wad_texture_size(const std::filesystem::path &directory) {
+        auto level = generate_synthetic_level({.room_count = 2, .texture_count = 2}, "texture_size.wad");
+        level.lumps.textures[0].width *= 2;
+        level.lumps.textures[0].height *= 4;
+
+        auto filename = (directory / "texture_size.bsp").string();
+        auto wad_filename = (directory / "texture_size.wad").string();
+        voxlife::bsp::write_file(filename, level.lumps);
+        voxlife::wad::write_file(wad_filename, level.textures);
+
+        voxlife::bsp::bsp_handle handle = nullptr;
+        voxlife::bsp::open_file(filename, &handle);
+        voxlife::wad::wad_handle wad_handle = nullptr;
+        try {
+            voxlife::wad::open_file(wad_filename, &wad_handle);
+            voxlife::bsp::load_textures(handle, std::span(&wad_handle, 1));
+
+            auto texture = voxlife::bsp::get_texture_data(handle, 0);
+            expect(texture.size == level.textures[0].size,
+                   std::format("the texture is {}x{}, the wad has {}x{}", texture.size.x, texture.size.y,
+                               level.textures[0].size.x, level.textures[0].size.y));
+            expect(texture.data.size() == static_cast<size_t>(texture.size.x) * texture.size.y,
+                   std::format("{} texels were handed out for a {}x{} texture", texture.data.size(), texture.size.x, texture.size.y));
+        } catch (...) {
+            if (wad_handle != nullptr)
+                voxlife::wad::release(wad_handle);
+            voxlife::bsp::release(handle);
+            throw;
+        }
+        voxlife::wad::release(wad_handle);
+        voxlife::bsp::release(handle);
+    }
+
+    // The face hierarchy has to find exactly the faces a linear scan over their bounds finds
+    void check_bsp_face_query(const std::filesystem::path &directory) {
+        auto level = generate_synthetic_level({.room_count = 32, .texture_count = 8}, "face_query.wad");
+        auto filename = (directory / "face_query.bsp").string();
+        voxlife::bsp::write_file(filename, level.lumps);
+
+        voxlife::bsp::bsp_handle handle = nullptr;
+        voxlife::bsp::open_file(filename, &handle);
+
+        std::mt19937 rng(9);
+        std::vector<uint32_t> face_ids;
+        std::vector<uint32_t> expected;
+        try {
+            for (uint32_t model_id = 0; model_id < level.lumps.models.size(); ++model_id) {
+                auto faces = voxlife::bsp::get_model_faces(handle, model_id);
+                auto model_bounds = voxlife::bsp::get_model_aabb(handle, model_id);
+
+                std::vector<voxlife::bsp::aabb> face_bounds(faces.size());
+                for (uint32_t face_id = 0; face_id < faces.size(); ++face_id) {
+                    auto vertices = faces.get_vertices(face_id);
+                    face_bounds[face_id] = {vertices[0], vertices[0]};
+                    for (auto &vertex : vertices) {
+                        face_bounds[face_id].min = glm::min(face_bounds[face_id].min, vertex);
+                        face_bounds[face_id].max = glm::max(face_bounds[face_id].max, vertex);
+                    }
+                }
+
+                // Random boxes of every size around the model, the whole model and a box next to it
+                std::vector<voxlife::bsp::aabb> queries = {
+                    model_bounds,
+                    {model_bounds.max + 1.0f, model_bounds.max + 2.0f},
+                };
+                auto extent = model_bounds.max - model_bounds.min;
+                for (uint32_t i = 0; i < 200; ++i) {
+                    std::uniform_real_distribution<float> position(-0.1f, 1.1f);
+                    std::uniform_real_distribution<float> size(0.0f, i % 2 == 0 ? 0.05f : 0.5f);
+                    auto min = model_bounds.min + glm::vec3(position(rng), position(rng), position(rng)) * extent;
+                    queries.push_back({min, min + glm::vec3(size(rng), size(rng), size(rng)) * extent});
+                }
+
+                for (auto &bounds : queries) {
+                    expected.clear();
+                    for (uint32_t face_id = 0; face_id < faces.size(); ++face_id) {
+                        if (glm::all(glm::lessThanEqual(face_bounds[face_id].min, bounds.max)) &&
+                            glm::all(glm::greaterThanEqual(face_bounds[face_id].max, bounds.min)))
+                            expected.push_back(face_id);
+                    }
+
+                    voxlife::bsp::get_model_faces_in_aabb(handle, model_id, bounds, face_ids);
+                    expect(face_ids == expected, std::format("model {} query found {} faces, a linear scan {}",
+                                                             model_id, face_ids.size(), expected.size()));
+                }
+
+                voxlife::bsp::get_model_faces_in_aabb(handle, model_id, model_bounds, face_ids);
+                expect(face_ids.size() == faces.size(), std::format("the bounds of model {} miss some of its faces", model_id));
+            }
+        } catch (...) {
+            voxlife::bsp::release(handle);
+            throw;
+        }
+        voxlife::bsp::release(handle);
+    }
+
+    struct named_check {
+        std::string_view name;
+        std::function<void(const std::filesystem::path &directory)> run;
+    };
+
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string_view> check_names(argv + 1, argv + argc);
+    auto selected = [&](std::string_view name) {
+        return check_names.empty() || std::find(check_names.begin(), check_names.end(), name) != check_names.end();
+    };
+
+    auto directory = std::filesystem::temp_directory_path() / "voxlife_check";
+    std::filesystem::create_directories(directory);
+
+    const std::array checks = {
+        named_check{"vox_round_trip", check_vox_round_trip},
+        named_check{"bsp_node_cycle", check_bsp_node_cycle},
+        named_check{"bsp_face_query", check_bsp_face_query},
+        named_check{"bsp_wad_texture_size", check_bsp_wad_texture_size},
+    };
+
+    int failed = 0;
+    for (auto &check : checks) {
+        if (!selected(check.name))
+            continue;
+
+        try {
+            check.run(directory);
+            std::cout << std::format("{:<22} passed", check.name) << std::endl;
+        } catch (std::exception &e) {
+            std::cout << std::format("{:<22} FAILED: {}", check.name, e.what()) << std::endl;
+            ++failed;
+        }
+    }
+
+    std::filesystem::remove_all(directory);
+    return failed == 0 ? 0 : 1;
+}
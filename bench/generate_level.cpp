@@ -0,0 +1,58 @@
+#include "synthetic_level.h"
+
+#include <charconv>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <string_view>
+
+// Writes a synthetic level and its wad into a game directory, the converter then runs on it like on a game level:
+//   voxlife_generate_level <game path> <level name> <room count> [texture count] [seed]
+//   voxlife_headless <game path> <level name>
+
+namespace {
+
+    bool parse_count(std::string_view text, uint32_t &value) {
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
+    }
+
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || argc > 6) {
+        std::cerr << "Usage: " << argv[0] << " <game path> <level name> <room count> [texture count] [seed]" << std::endl;
+        return 1;
+    }
+
+    std::filesystem::path game_path(argv[1]);
+    std::string_view level_name = argv[2];
+
+    synthetic_level_settings settings;
+    if (!parse_count(argv[3], settings.room_count) ||
+        (argc > 4 && !parse_count(argv[4], settings.texture_count)) ||
+        (argc > 5 && !parse_count(argv[5], settings.seed))) {
+        std::cerr << "Room count, texture count and seed must be unsigned integers" << std::endl;
+        return 1;
+    }
+
+    try {
+        auto wad_name = std::format("{}.wad", level_name);
+        auto level = generate_synthetic_level(settings, wad_name);
+
+        auto maps_path = game_path / "valve" / "maps";
+        std::filesystem::create_directories(maps_path);
+        voxlife::bsp::write_file((maps_path / std::format("{}.bsp", level_name)).string(), level.lumps);
+        voxlife::wad::write_file((game_path / "valve" / wad_name).string(), level.textures);
+
+        std::cout << std::format("{}: {} rooms, {} faces, {} nodes, {} leafs, {} textures",
+                                 level_name, settings.room_count, level.lumps.faces.size(), level.lumps.nodes.size(),
+                                 level.lumps.leafs.size(), level.textures.size()) << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << std::format("Could not generate {}: {}", level_name, e.what()) << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
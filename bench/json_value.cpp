@@ -0,0 +1,205 @@
+#include "json_value.h"
+
+#include <charconv>
+#include <format>
+#include <stdexcept>
+
+namespace {
+
+    class json_parser {
+    public:
+        explicit json_parser(std::string_view text) : text(text) {}
+
+        json_value parse_document() {
+            auto value = parse_value();
+            skip_whitespace();
+            if (position != text.size())
+                fail();
+
+            return value;
+        }
+
+    private:
+        std::string_view text;
+        size_t position = 0;
+
+        [[noreturn]] void fail() const {
+            throw std::runtime_error(std::format("Invalid JSON at offset {}", position));
+        }
+
+        void skip_whitespace() {
+            while (position < text.size() && (text[position] == ' ' || text[position] == '\t' ||
+                                              text[position] == '\n' || text[position] == '\r'))
+                ++position;
+        }
+
+        bool consume(char c) {
+            skip_whitespace();
+            if (position < text.size() && text[position] == c) {
+                ++position;
+                return true;
+            }
+            return false;
+        }
+
+        void expect(char c) {
+            if (!consume(c))
+                fail();
+        }
+
+        bool consume_literal(std::string_view literal) {
+            if (text.substr(position, literal.size()) != literal)
+                return false;
+
+            position += literal.size();
+            return true;
+        }
+
+        json_value parse_value() {
+            skip_whitespace();
+            if (position >= text.size())
+                fail();
+
+            switch (text[position]) {
+            case '{': return parse_object();
+            case '[': return parse_array();
+            case '"': return json_value{parse_string()};
+            default: break;
+            }
+
+            if (consume_literal("null"))
+                return json_value{nullptr};
+            if (consume_literal("true"))
+                return json_value{true};
+            if (consume_literal("false"))
+                return json_value{false};
+
+            return json_value{parse_number()};
+        }
+
+        json_value parse_object() {
+            expect('{');
+            json_value::object members;
+            if (consume('}'))
+                return json_value{std::move(members)};
+
+            do {
+                skip_whitespace();
+                auto name = parse_string();
+                expect(':');
+                members.emplace_back(std::move(name), parse_value());
+            } while (consume(','));
+
+            expect('}');
+            return json_value{std::move(members)};
+        }
+
+        json_value parse_array() {
+            expect('[');
+            json_value::array elements;
+            if (consume(']'))
+                return json_value{std::move(elements)};
+
+            do {
+                elements.push_back(parse_value());
+            } while (consume(','));
+
+            expect(']');
+            return json_value{std::move(elements)};
+        }
+
+        // Unicode escapes are kept as they are, the reports only contain ASCII
+        std::string parse_string() {
+            if (position >= text.size() || text[position] != '"')
+                fail();
+            ++position;
+
+            std::string result;
+            while (position < text.size() && text[position] != '"') {
+                char c = text[position++];
+                if (c == '\\') {
+                    if (position >= text.size())
+                        fail();
+
+                    c = text[position++];
+                    switch (c) {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'u': result += "\\u"; continue;
+                    default: break;
+                    }
+                }
+                result += c;
+            }
+
+            if (position >= text.size())
+                fail();
+            ++position;
+
+            return result;
+        }
+
+        double parse_number() {
+            double value;
+            auto begin = text.data() + position;
+            auto result = std::from_chars(begin, text.data() + text.size(), value);
+            if (result.ec != std::errc() || result.ptr == begin)
+                fail();
+
+            position += result.ptr - begin;
+            return value;
+        }
+    };
+
+}
+
+const json_value *json_value::find(std::string_view name) const {
+    auto members = std::get_if<object>(&value);
+    if (members == nullptr)
+        return nullptr;
+
+    for (auto &[member_name, member] : *members) {
+        if (member_name == name)
+            return &member;
+    }
+    return nullptr;
+}
+
+double json_value::as_number(double fallback) const {
+    auto number = std::get_if<double>(&value);
+    return number != nullptr ? *number : fallback;
+}
+
+std::string_view json_value::as_string() const {
+    auto string = std::get_if<std::string>(&value);
+    return string != nullptr ? std::string_view(*string) : std::string_view();
+}
+
+const json_value::array &json_value::as_array() const {
+    static const array empty;
+    auto elements = std::get_if<array>(&value);
+    return elements != nullptr ? *elements : empty;
+}
+
+json_value parse_json(std::string_view text) {
+    return json_parser(text).parse_document();
+}
+
+std::string escape_json(std::string_view text) {
+    std::string result;
+    result.reserve(text.size());
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            result += ' ';
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,31 @@
+#ifndef VOXLIFE_BENCH_JSON_VALUE_H
+#define VOXLIFE_BENCH_JSON_VALUE_H
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Just enough JSON to read back the reports of voxlife_bench, numbers are always doubles
+struct json_value {
+    using array = std::vector<json_value>;
+    using object = std::vector<std::pair<std::string, json_value>>;
+
+    std::variant<std::nullptr_t, bool, double, std::string, array, object> value;
+
+    // Returns nullptr if this is not an object or it has no member with that name
+    const json_value *find(std::string_view name) const;
+
+    double as_number(double fallback = 0.0) const;
+    std::string_view as_string() const;
+    const array &as_array() const;
+};
+
+// Throws std::runtime_error with the offset of the first character that could not be parsed
+json_value parse_json(std::string_view text);
+
+// Escapes quotes, backslashes and control characters for a JSON string literal
+std::string escape_json(std::string_view text);
+
+#endif //VOXLIFE_BENCH_JSON_VALUE_H
@@ -0,0 +1,257 @@
+#include "synthetic_level.h"
+
+#include <bsp/read_file.h>
+#include <hl1/read_entities.h>
+#include <voxel/level_mesh.h>
+#include <voxel/write_file.h>
+#include <wad/palette.h>
+#include <wad/read_file.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Times the hot kernels of the pipeline one at a time, each at a few input sizes, in nanoseconds per element:
+//   voxlife_bench_kernels [kernel names...]
+// Without arguments every kernel runs. The level kernels use synthetic levels, the others random input of a fixed seed.
+
+namespace {
+
+    constexpr uint32_t run_count = 9;
+    constexpr std::array level_room_counts = {8u, 32u, 128u};
+
+    // Median time in milliseconds, setup runs untimed before every repetition
+    template<typename S, typename F>
+    double measure(S &&setup, F &&f) {
+        std::vector<double> times;
+        for (uint32_t i = 0; i < run_count; ++i) {
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            f();
+            std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+            times.push_back(duration.count());
+        }
+
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    }
+
+    template<typename F>
+    double measure(F &&f) {
+        return measure([]() {}, f);
+    }
+
+    void report(std::string_view kernel, std::string_view size, size_t element_count, std::string_view unit, double milliseconds) {
+        std::cout << std::format("{:<18} {:>12} {:>10} {:>11.3f} ms {:>10.2f} ns/{}",
+                                 kernel, size, element_count, milliseconds,
+                                 milliseconds * 1e6 / static_cast<double>(std::max<size_t>(element_count, 1)), unit) << std::endl;
+    }
+
+    struct bench_file {
+        std::string name;
+        std::string bsp_path;
+        std::string wad_path;
+        size_t face_count;
+    };
+
+    std::vector<bench_file> write_levels(const std::filesystem::path &directory) {
+        std::vector<bench_file> files;
+        for (auto room_count : level_room_counts) {
+            auto name = std::format("kernels_{}", room_count);
+            auto wad_name = std::format("{}.wad", name);
+            auto level = generate_synthetic_level({.room_count = room_count, .texture_count = 64, .seed = room_count}, wad_name);
+
+            bench_file file{
+                .name = std::format("{} rooms", room_count),
+                .bsp_path = (directory / std::format("{}.bsp", name)).string(),
+                .wad_path = (directory / wad_name).string(),
+                .face_count = level.lumps.faces.size(),
+            };
+            voxlife::bsp::write_file(file.bsp_path, level.lumps);
+            voxlife::wad::write_file(file.wad_path, level.textures);
+            files.push_back(std::move(file));
+        }
+        return files;
+    }
+
+    void bench_level_kernels(std::span<const bench_file> files, auto &&selected) {
+        for (auto &file : files) {
+            voxlife::bsp::bsp_handle handle;
+            voxlife::bsp::open_file(file.bsp_path, &handle);
+
+            if (selected("get_entities")) {
+                size_t entity_count = 0;
+                auto time = measure([&]() {
+                    entity_count = voxlife::bsp::get_entities(handle).size();
+                });
+                report("get_entities", file.name, entity_count, "entity", time);
+            }
+
+            if (selected("read_entities")) {
+                size_t entity_count = 0;
+                auto time = measure([&]() {
+                    auto entities = voxlife::hl1::read_entities(handle);
+                    entity_count = 0;
+                    for (auto &list : entities.entities)
+                        entity_count += list.size();
+                });
+                report("read_entities", file.name, entity_count, "entity", time);
+            }
+
+            // The face arena is cached by the handle, every repetition needs a fresh one
+            if (selected("get_model_faces")) {
+                voxlife::bsp::bsp_handle fresh_handle = nullptr;
+                auto time = measure([&]() {
+                    if (fresh_handle != nullptr)
+                        voxlife::bsp::release(fresh_handle);
+                    voxlife::bsp::open_file(file.bsp_path, &fresh_handle);
+                }, [&]() {
+                    voxlife::bsp::get_model_faces(fresh_handle, 0);
+                });
+                voxlife::bsp::release(fresh_handle);
+                report("get_model_faces", file.name, file.face_count, "face", time);
+            }
+
+            // Fan triangulation, uv setup and tile clipping, the cpu counterpart of init_bsp_data
+            if (selected("build_level_mesh")) {
+                voxlife::wad::wad_handle wad_handle;
+                voxlife::wad::open_file(file.wad_path, &wad_handle);
+                voxlife::bsp::load_textures(handle, std::span(&wad_handle, 1));
+                voxlife::bsp::get_model_faces(handle, 0);
+
+                auto time = measure([&]() {
+                    auto mesh = build_level_mesh(handle);
+                });
+                report("build_level_mesh", file.name, file.face_count, "face", time);
+                voxlife::wad::release(wad_handle);
+            }
+
+            voxlife::bsp::release(handle);
+        }
+    }
+
+    void bench_color_kernels(auto &&selected) {
+        std::mt19937 rng(42);
+
+        if (selected("expand_palette")) {
+            std::vector<uint8_t> palette(256 * 3);
+            for (auto &color : palette)
+                color = static_cast<uint8_t>(rng());
+            auto table = voxlife::wad::make_palette_table(palette.data(), false);
+
+            for (uint32_t size : {64u, 256u, 1024u}) {
+                std::vector<uint8_t> indices(size * size);
+                for (auto &index : indices)
+                    index = static_cast<uint8_t>(rng());
+                std::vector<glm::u8vec4> rgba(indices.size());
+
+                auto time = measure([&]() {
+                    voxlife::wad::expand_palette(indices, table, rgba.data());
+                });
+                report("expand_palette", std::format("{}x{}", size, size), indices.size(), "texel", time);
+            }
+        }
+
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        auto random_colors = [&](size_t count) {
+            std::vector<glm::vec3> colors(count);
+            for (auto &color : colors)
+                color = glm::vec3(unit(rng), unit(rng), unit(rng));
+            return colors;
+        };
+
+        if (selected("rgb_to_oklab")) {
+            for (size_t count : {size_t{4096}, size_t{65536}, size_t{1} << 20}) {
+                auto rgb = random_colors(count);
+                std::vector<glm::vec3> oklab(count);
+
+                auto time = measure([&]() {
+                    rgb_to_oklab(rgb, oklab);
+                });
+                report("rgb_to_oklab", std::format("{}", count), count, "color", time);
+            }
+        }
+
+        // Palette slots per material are at most 16, apart from the shared slots
+        if (selected("kmeans")) {
+            for (size_t count : {size_t{1024}, size_t{16384}, size_t{65536}}) {
+                auto rgb = random_colors(count);
+                std::vector<glm::vec3> oklab(count);
+                rgb_to_oklab(rgb, oklab);
+
+                std::vector<int> assignments;
+                std::vector<glm::vec3> centroids;
+                auto time = measure([&]() {
+                    kmeans(oklab, 16, assignments, centroids);
+                });
+                report("kmeans", std::format("{} k=16", count), count, "color", time);
+            }
+        }
+    }
+
+    void bench_vox_writer(const std::filesystem::path &directory, auto &&selected) {
+        if (!selected("write_vox"))
+            return;
+
+        std::mt19937 rng(7);
+        std::vector<glm::u8vec3> colors(64);
+        for (auto &color : colors)
+            color = glm::u8vec3(rng(), rng(), rng());
+
+        // A quarter of the voxels are set, like the surface heavy volumes of the voxelizer after solid fill
+        for (uint32_t size : {32u, 64u, 128u}) {
+            SparseVolume volume{glm::uvec3(size)};
+            size_t voxel_count = 0;
+            for (uint32_t z = 0; z < size; ++z) {
+                for (uint32_t y = 0; y < size; ++y) {
+                    for (uint32_t x = 0; x < size; ++x) {
+                        if (rng() % 4 != 0)
+                            continue;
+
+                        volume.set(glm::ivec3(x, y, z), Voxel{colors[rng() % colors.size()], MaterialType::CONCRETE});
+                        ++voxel_count;
+                    }
+                }
+            }
+
+            VoxelModel model{.volume = &volume, .pos = {}, .size = glm::u32vec3(size)};
+            auto palette = generate_palette(std::span(&model, 1));
+            auto filename = (directory / std::format("kernels_{}.vox", size)).string();
+
+            auto time = measure([&]() {
+                write_magicavoxel_model(filename, std::span(&model, 1), palette);
+            });
+            report("write_vox", std::format("{}^3", size), voxel_count, "voxel", time);
+        }
+    }
+
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string_view> kernel_names(argv + 1, argv + argc);
+    auto selected = [&](std::string_view name) {
+        return kernel_names.empty() || std::find(kernel_names.begin(), kernel_names.end(), name) != kernel_names.end();
+    };
+
+    auto directory = std::filesystem::temp_directory_path() / "voxlife_bench_kernels";
+    std::filesystem::create_directories(directory);
+
+    std::cout << std::format("{:<18} {:>12} {:>10} {:>14} {:>13}   median of {} runs",
+                             "kernel", "size", "elements", "time", "per element", run_count) << std::endl;
+
+    auto files = write_levels(directory);
+    bench_level_kernels(files, selected);
+    bench_color_kernels(selected);
+    bench_vox_writer(directory, selected);
+
+    std::filesystem::remove_all(directory);
+    return 0;
+}
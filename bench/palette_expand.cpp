@@ -0,0 +1,109 @@
+#include <wad/palette.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Compares the palette expansion kernels against the two loops they replaced,
+// the per-channel gather into u8vec3 followed by the RGBA8 upload expansion.
+
+namespace {
+
+    constexpr uint32_t texture_size = 256;
+    constexpr uint32_t texture_count = 256;
+    constexpr uint32_t run_count = 15;
+
+    template<typename F>
+    double measure(F &&f) {
+        std::vector<double> times;
+        for (uint32_t i = 0; i < run_count; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            f();
+            std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+            times.push_back(duration.count());
+        }
+
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    }
+
+    void report(std::string_view name, double milliseconds, double baseline) {
+        const double texels = static_cast<double>(texture_size) * texture_size * texture_count;
+        std::cout << std::format("{:<24} {:>9.3f} ms {:>8.2f} Gtexel/s {:>6.2f}x",
+                                 name, milliseconds, texels / (milliseconds * 1e6), baseline / milliseconds) << std::endl;
+    }
+
+}
+
+int main() {
+    const size_t texel_count = static_cast<size_t>(texture_size) * texture_size * texture_count;
+
+    std::mt19937 rng(42);
+    std::vector<uint8_t> indices(texel_count);
+    std::vector<uint8_t> palette(256 * 3);
+    for (auto &index : indices)
+        index = static_cast<uint8_t>(rng());
+    for (auto &color : palette)
+        color = static_cast<uint8_t>(rng());
+
+    std::vector<glm::u8vec3> rgb(texel_count);
+    std::vector<glm::u8vec4> rgba(texel_count);
+    std::vector<uint8_t> upload(texel_count * 4);
+
+    auto baseline = measure([&]() {
+        for (size_t i = 0; i < texel_count; ++i) {
+            uint8_t index = indices[i];
+            rgb[i] = glm::u8vec3(palette[index * 3 + 0], palette[index * 3 + 1], palette[index * 3 + 2]);
+        }
+        for (size_t i = 0; i < texel_count; ++i) {
+            upload[i * 4 + 0] = rgb[i].r;
+            upload[i * 4 + 1] = rgb[i].g;
+            upload[i * 4 + 2] = rgb[i].b;
+            upload[i * 4 + 3] = 255;
+        }
+    });
+    auto expected_rgb = rgb;
+    auto expected_rgba = upload;
+
+    auto table = voxlife::wad::make_palette_table(palette.data(), false);
+
+    auto verify = [&](std::string_view name, bool matches) {
+        if (!matches) {
+            std::cerr << name << " does not match the reference output" << std::endl;
+            std::exit(1);
+        }
+    };
+
+    std::cout << std::format("{} textures of {}x{} texels, median of {} runs", texture_count, texture_size, texture_size, run_count) << std::endl;
+    report("reference rgb + upload", baseline, baseline);
+
+    auto time = measure([&]() { voxlife::wad::expand_palette_scalar(indices, table, rgba.data()); });
+    verify("scalar rgba", std::memcmp(rgba.data(), expected_rgba.data(), expected_rgba.size()) == 0);
+    report("scalar rgba", time, baseline);
+
+    time = measure([&]() { voxlife::wad::expand_palette(indices, table, rgba.data()); });
+    verify("simd rgba", std::memcmp(rgba.data(), expected_rgba.data(), expected_rgba.size()) == 0);
+    report("simd rgba", time, baseline);
+
+    time = measure([&]() { voxlife::wad::expand_palette_scalar(indices, table, rgb.data()); });
+    verify("scalar rgb", std::memcmp(rgb.data(), expected_rgb.data(), expected_rgb.size() * 3) == 0);
+    report("scalar rgb", time, baseline);
+
+    time = measure([&]() { voxlife::wad::expand_palette(indices, table, rgb.data()); });
+    verify("simd rgb", std::memcmp(rgb.data(), expected_rgb.data(), expected_rgb.size() * 3) == 0);
+    report("simd rgb", time, baseline);
+
+    // Odd lengths exercise the scalar tails of the vector loops
+    for (size_t length : {1, 7, 9, 10, 17, 250}) {
+        std::fill(rgb.begin(), rgb.begin() + length + 1, glm::u8vec3(0));
+        voxlife::wad::expand_palette(std::span(indices).first(length), table, rgb.data());
+        verify("simd rgb tail", std::memcmp(rgb.data(), expected_rgb.data(), length * 3) == 0 && rgb[length] == glm::u8vec3(0));
+    }
+
+    return 0;
+}
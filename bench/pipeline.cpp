@@ -0,0 +1,530 @@
+#include "json_value.h"
+#include "synthetic_level.h"
+
+#include <bsp/read_file.h>
+#include <hl1/read_entities.h>
+#include <voxel/level_mesh.h>
+#include <voxel/voxelize_cpu.h>
+#include <voxel/write_file.h>
+#include <wad/read_file.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Runs the stages of load_level one by one on a fixed set of synthetic levels and compares them against a baseline:
+//   voxlife_bench [--runs=N] [--json=<file>] [--baseline=<file>] [--time-threshold=<percent>]
+//                 [--memory-threshold=<percent>] [--min-ms=<ms>] [--sweep]
+// Exits with 2 if a stage got slower or uses more memory than the thresholds allow. --sweep instead starts with a single
+// room and doubles the room count until a lump of the format overflows, without comparing against the baseline.
+
+namespace {
+
+    struct bench_level {
+        std::string_view name;
+        uint32_t room_count;
+        uint32_t texture_count;
+        uint32_t seed;
+    };
+
+    constexpr uint32_t sweep_texture_count = 128;
+
+    // Changing these invalidates the baseline, record a new one afterwards
+    constexpr std::array bench_levels = {
+        bench_level{"rooms_8", 8, 16, 1},
+        bench_level{"rooms_32", 32, 64, 2},
+        bench_level{"rooms_128", 128, 128, 3},
+    };
+
+    enum stage_type : uint32_t {
+        STAGE_PARSE,
+        STAGE_ENTITIES,
+        STAGE_TEXTURES,
+        STAGE_TRIANGLES,
+        STAGE_VOXELIZE,
+        STAGE_PALETTE,
+        STAGE_WRITE,
+        STAGE_TYPE_MAX,
+    };
+
+    constexpr std::array<std::string_view, STAGE_TYPE_MAX> stage_names = {
+        "parse", "entities", "textures", "triangles", "voxelize", "palette", "write",
+    };
+
+    constexpr std::array<std::string_view, STAGE_TYPE_MAX> stage_units = {
+        "faces/s", "MB/s", "MB/s", "faces/s", "voxels/s", "voxels/s", "MB/s",
+    };
+
+    struct stage_result {
+        double milliseconds = 0.0;
+        double throughput = 0.0;    // in the unit of the stage
+        double peak_rss_mb = 0.0;
+    };
+
+    struct level_result {
+        std::string_view name;
+        uint32_t room_count = 0;
+        size_t face_count = 0;
+        size_t voxel_count = 0;
+        size_t bytes_written = 0;
+        double total_milliseconds = 0.0;
+        std::array<stage_result, STAGE_TYPE_MAX> stages;
+    };
+
+    struct bench_settings {
+        uint32_t run_count = 5;
+        std::string json_path;
+        std::string baseline_path = VOXLIFE_BENCH_BASELINE;
+        double time_threshold = 10.0;       // percent
+        double memory_threshold = 10.0;     // percent
+        double min_milliseconds = 1.0;      // time differences below this are noise
+        bool sweep = false;
+    };
+
+    constexpr double megabyte = 1024.0 * 1024.0;
+
+    // Starts a new peak RSS window. Only Linux can reset the counter, elsewhere the peak covers the whole process.
+    bool reset_peak_memory() {
+#if defined(__linux__)
+        std::ofstream file("/proc/self/clear_refs");
+        file << "5";
+        return static_cast<bool>(file.flush());
+#else
+        return false;
+#endif
+    }
+
+    double get_peak_memory_mb() {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters{};
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return 0.0;
+        return static_cast<double>(counters.PeakWorkingSetSize) / megabyte;
+#elif defined(__linux__)
+        // VmHWM follows the resets of clear_refs, ru_maxrss does not
+        std::ifstream file("/proc/self/status");
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.starts_with("VmHWM:"))
+                return static_cast<double>(std::stoull(line.substr(6))) / 1024.0;
+        }
+        return 0.0;
+#else
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<double>(usage.ru_maxrss) / megabyte;   // bytes on macOS
+#endif
+    }
+
+    size_t get_directory_size(const std::filesystem::path &path) {
+        size_t size = 0;
+        if (!std::filesystem::exists(path))
+            return size;
+
+        for (auto &entry : std::filesystem::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file())
+                size += entry.file_size();
+        }
+        return size;
+    }
+
+    double median(std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    }
+
+    // One pass of load_level over a level, split into its stages. The outputs go to the current directory.
+    struct level_run {
+        std::array<double, STAGE_TYPE_MAX> milliseconds{};
+        std::array<double, STAGE_TYPE_MAX> peak_rss_mb{};
+        size_t voxel_count = 0;
+        size_t bytes_written = 0;
+    };
+
+    level_run run_level(const bench_level &level, const std::string &bsp_path, const std::string &wad_path) {
+        level_run run;
+
+        auto measure = [&](stage_type stage, auto &&f) {
+            reset_peak_memory();
+            auto start = std::chrono::steady_clock::now();
+            f();
+            std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+            run.milliseconds[stage] = duration.count();
+            run.peak_rss_mb[stage] = get_peak_memory_mb();
+        };
+
+        // Every run writes its files from scratch, otherwise the writer only compares against the previous run
+        std::filesystem::remove_all(std::filesystem::path("brush") / level.name);
+        std::filesystem::remove(std::filesystem::path("levels") / std::format("{}.xml", level.name));
+
+        voxlife::bsp::bsp_handle handle;
+        measure(STAGE_PARSE, [&]() {
+            voxlife::bsp::open_file(bsp_path, &handle);
+        });
+
+        measure(STAGE_ENTITIES, [&]() {
+            auto entities = voxlife::hl1::read_entities(handle);
+        });
+
+        voxlife::wad::wad_handle wad_handle;
+        measure(STAGE_TEXTURES, [&]() {
+            voxlife::wad::open_file(wad_path, &wad_handle);
+            voxlife::bsp::load_textures(handle, std::span(&wad_handle, 1));
+        });
+
+        LevelMesh mesh;
+        measure(STAGE_TRIANGLES, [&]() {
+            mesh = build_level_mesh(handle);
+        });
+
+        std::vector<SparseVolume> volumes;
+        measure(STAGE_VOXELIZE, [&]() {
+            voxelize_mesh_cpu(handle, mesh, volumes);
+        });
+
+        std::vector<VoxelModel> voxel_models;
+        std::vector<uint32_t> texture_ids;
+        for (size_t i = 0; i < mesh.models.size(); ++i) {
+            auto &model = mesh.models[i];
+            voxel_models.push_back(VoxelModel{
+                .volume = &volumes[i],
+                .pos = glm::i32vec3(glm::floor((model.aabb_min + model.aabb_max) * 0.5f)),
+                .size = model.get_extent(),
+            });
+            texture_ids.push_back(model.texture_id);
+            volumes[i].for_each_voxel([&](glm::ivec3, const Voxel &) {
+                ++run.voxel_count;
+            });
+        }
+
+        VoxelPalette palette;
+        measure(STAGE_PALETTE, [&]() {
+            palette = generate_palette(voxel_models);
+        });
+
+        measure(STAGE_WRITE, [&]() {
+            std::vector<Model> models;
+            write_brush_models(level.name, voxel_models, texture_ids, palette, models);
+
+            LevelInfo info{};
+            info.name = level.name;
+            info.models = models;
+            info.environment.skybox = "cloudy.dds";
+            info.environment.brightness = 0.5f;
+            info.environment.sun_dir = glm::vec3(0, -1, 0);
+            write_teardown_level(info);
+        });
+
+        run.bytes_written = get_directory_size(std::filesystem::path("brush") / level.name) +
+                            std::filesystem::file_size(std::filesystem::path("levels") / std::format("{}.xml", level.name));
+
+        voxlife::wad::release(wad_handle);
+        voxlife::bsp::release(handle);
+
+        return run;
+    }
+
+    // Writes the level and its wad into the directory, throws if the level does not fit into the format
+    synthetic_level write_bench_level(const bench_level &level, const std::filesystem::path &directory) {
+        auto wad_name = std::format("{}.wad", level.name);
+
+        auto synthetic = generate_synthetic_level({
+            .room_count = level.room_count,
+            .texture_count = level.texture_count,
+            .seed = level.seed,
+        }, wad_name);
+        voxlife::bsp::write_file((directory / std::format("{}.bsp", level.name)).string(), synthetic.lumps);
+        voxlife::wad::write_file((directory / wad_name).string(), synthetic.textures);
+
+        return synthetic;
+    }
+
+    level_result bench_level_stages(const bench_level &level, const synthetic_level &synthetic,
+                                    const std::filesystem::path &directory, uint32_t run_count) {
+        auto bsp_path = (directory / std::format("{}.bsp", level.name)).string();
+        auto wad_path = (directory / std::format("{}.wad", level.name)).string();
+
+        level_result result;
+        result.name = level.name;
+        result.room_count = level.room_count;
+        result.face_count = synthetic.lumps.faces.size();
+
+        std::array<std::vector<double>, STAGE_TYPE_MAX> times;
+        std::vector<double> totals;
+        for (uint32_t i = 0; i < run_count; ++i) {
+            auto run = run_level(level, bsp_path, wad_path);
+
+            double total = 0.0;
+            for (uint32_t stage = 0; stage < STAGE_TYPE_MAX; ++stage) {
+                times[stage].push_back(run.milliseconds[stage]);
+                result.stages[stage].peak_rss_mb = std::max(result.stages[stage].peak_rss_mb, run.peak_rss_mb[stage]);
+                total += run.milliseconds[stage];
+            }
+            totals.push_back(total);
+
+            result.voxel_count = run.voxel_count;
+            result.bytes_written = run.bytes_written;
+        }
+
+        result.total_milliseconds = median(totals);
+
+        const auto wad_size = static_cast<double>(std::filesystem::file_size(wad_path));
+        const std::array<double, STAGE_TYPE_MAX> work = {
+            static_cast<double>(result.face_count),
+            static_cast<double>(synthetic.lumps.entities.size()) / megabyte,
+            wad_size / megabyte,
+            static_cast<double>(result.face_count),
+            static_cast<double>(result.voxel_count),
+            static_cast<double>(result.voxel_count),
+            static_cast<double>(result.bytes_written) / megabyte,
+        };
+
+        for (uint32_t stage = 0; stage < STAGE_TYPE_MAX; ++stage) {
+            auto &stage_result = result.stages[stage];
+            stage_result.milliseconds = median(times[stage]);
+            stage_result.throughput = stage_result.milliseconds > 0.0 ? work[stage] / (stage_result.milliseconds * 1e-3) : 0.0;
+        }
+
+        return result;
+    }
+
+    std::string format_report(std::span<const level_result> results, uint32_t run_count) {
+        std::string json = std::format("{{\n  \"runs\": {},\n  \"levels\": [\n", run_count);
+        for (size_t i = 0; i < results.size(); ++i) {
+            auto &result = results[i];
+            json += std::format("    {{\n      \"name\": \"{}\",\n      \"rooms\": {},\n      \"faces\": {},\n"
+                                "      \"voxels\": {},\n      \"bytes_written\": {},\n      \"total_ms\": {:.3f},\n"
+                                "      \"stages\": [\n",
+                                escape_json(result.name), result.room_count, result.face_count, result.voxel_count,
+                                result.bytes_written, result.total_milliseconds);
+
+            for (uint32_t stage = 0; stage < STAGE_TYPE_MAX; ++stage) {
+                auto &stage_result = result.stages[stage];
+                json += std::format("        {{\"name\": \"{}\", \"ms\": {:.3f}, \"throughput\": {:.1f}, \"unit\": \"{}\", \"peak_rss_mb\": {:.1f}}}{}\n",
+                                    stage_names[stage], stage_result.milliseconds, stage_result.throughput,
+                                    stage_units[stage], stage_result.peak_rss_mb, stage + 1 < STAGE_TYPE_MAX ? "," : "");
+            }
+
+            json += std::format("      ]\n    }}{}\n", i + 1 < results.size() ? "," : "");
+        }
+        json += "  ]\n}\n";
+        return json;
+    }
+
+    struct baseline_entry {
+        double milliseconds;
+        double peak_rss_mb;
+    };
+
+    std::optional<baseline_entry> find_baseline(const json_value &baseline, std::string_view level_name, std::string_view stage_name) {
+        if (auto levels = baseline.find("levels")) {
+            for (auto &level : levels->as_array()) {
+                auto name = level.find("name");
+                if (name == nullptr || name->as_string() != level_name)
+                    continue;
+
+                if (stage_name == "total") {
+                    if (auto total = level.find("total_ms"))
+                        return baseline_entry{total->as_number(), 0.0};
+                    return std::nullopt;
+                }
+
+                auto stages = level.find("stages");
+                if (stages == nullptr)
+                    return std::nullopt;
+
+                for (auto &stage : stages->as_array()) {
+                    auto stage_name_value = stage.find("name");
+                    auto milliseconds = stage.find("ms");
+                    auto peak_rss_mb = stage.find("peak_rss_mb");
+                    if (stage_name_value != nullptr && stage_name_value->as_string() == stage_name && milliseconds != nullptr)
+                        return baseline_entry{milliseconds->as_number(), peak_rss_mb != nullptr ? peak_rss_mb->as_number() : 0.0};
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Prints one line per stage and returns the number of regressions
+    uint32_t print_results(const level_result &result, const json_value *baseline, const bench_settings &settings) {
+        uint32_t regression_count = 0;
+
+        auto print_line = [&](std::string_view stage_name, double milliseconds, std::string throughput, double peak_rss_mb) {
+            std::string comparison = "no baseline";
+            if (baseline != nullptr) {
+                if (auto entry = find_baseline(*baseline, result.name, stage_name)) {
+                    double time_change = entry->milliseconds > 0.0 ? (milliseconds / entry->milliseconds - 1.0) * 100.0 : 0.0;
+                    double memory_change = entry->peak_rss_mb > 0.0 ? (peak_rss_mb / entry->peak_rss_mb - 1.0) * 100.0 : 0.0;
+                    bool slower = time_change > settings.time_threshold && milliseconds - entry->milliseconds > settings.min_milliseconds;
+                    bool larger = memory_change > settings.memory_threshold;
+
+                    comparison = std::format("{:+7.1f}% time {:+7.1f}% memory", time_change, memory_change);
+                    if (slower || larger) {
+                        comparison += "  REGRESSION";
+                        ++regression_count;
+                    }
+                }
+            }
+
+            std::cout << std::format("{:<10} {:<10} {:>11.3f} {:>22} {:>9.1f}  {}",
+                                     result.name, stage_name, milliseconds, throughput, peak_rss_mb, comparison) << std::endl;
+        };
+
+        for (uint32_t stage = 0; stage < STAGE_TYPE_MAX; ++stage) {
+            auto &stage_result = result.stages[stage];
+            print_line(stage_names[stage], stage_result.milliseconds,
+                       std::format("{:.3g} {}", stage_result.throughput, stage_units[stage]), stage_result.peak_rss_mb);
+        }
+
+        double peak_rss_mb = 0.0;
+        for (auto &stage_result : result.stages)
+            peak_rss_mb = std::max(peak_rss_mb, stage_result.peak_rss_mb);
+        print_line("total", result.total_milliseconds, "", peak_rss_mb);
+
+        return regression_count;
+    }
+
+    bool parse_number_option(std::string_view argument, std::string_view option, double &value) {
+        auto text = argument.substr(option.size());
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size() || value < 0.0) {
+            std::cerr << "Invalid value '" << text << "' for " << option << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+}
+
+int main(int argc, char *argv[]) {
+    bench_settings settings;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument = argv[i];
+
+        if (argument.starts_with("--runs=")) {
+            auto run_count = argument.substr(std::string_view("--runs=").size());
+            auto result = std::from_chars(run_count.data(), run_count.data() + run_count.size(), settings.run_count);
+            if (result.ec != std::errc() || result.ptr != run_count.data() + run_count.size() || settings.run_count == 0) {
+                std::cerr << "Invalid run count '" << run_count << "'" << std::endl;
+                return 1;
+            }
+        } else if (argument.starts_with("--json=")) {
+            settings.json_path = argument.substr(std::string_view("--json=").size());
+        } else if (argument.starts_with("--baseline=")) {
+            settings.baseline_path = argument.substr(std::string_view("--baseline=").size());
+        } else if (argument.starts_with("--time-threshold=")) {
+            if (!parse_number_option(argument, "--time-threshold=", settings.time_threshold))
+                return 1;
+        } else if (argument.starts_with("--memory-threshold=")) {
+            if (!parse_number_option(argument, "--memory-threshold=", settings.memory_threshold))
+                return 1;
+        } else if (argument.starts_with("--min-ms=")) {
+            if (!parse_number_option(argument, "--min-ms=", settings.min_milliseconds))
+                return 1;
+        } else if (argument == "--sweep") {
+            settings.sweep = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--runs=N] [--json=<file>] [--baseline=<file>] [--time-threshold=<percent>] [--memory-threshold=<percent>] [--min-ms=<ms>] [--sweep]" << std::endl;
+            return 1;
+        }
+    }
+
+    // A missing baseline only disables the comparison, the first run on a machine records it
+    std::optional<json_value> baseline;
+    if (!settings.baseline_path.empty() && std::filesystem::is_regular_file(settings.baseline_path)) {
+        std::ifstream file(settings.baseline_path, std::ios::binary);
+        std::stringstream text;
+        text << file.rdbuf();
+        try {
+            baseline = parse_json(text.str());
+        } catch (std::exception &e) {
+            std::cerr << std::format("Could not read baseline {}: {}", settings.baseline_path, e.what()) << std::endl;
+            return 1;
+        }
+    }
+
+    if (!reset_peak_memory())
+        std::cout << "Peak RSS can not be reset on this platform, every stage reports the peak of the process so far" << std::endl;
+
+    auto directory = std::filesystem::temp_directory_path() / "voxlife_bench";
+    std::filesystem::create_directories(directory);
+
+    // The writers work relative to the current directory
+    auto previous_path = std::filesystem::current_path();
+    std::filesystem::current_path(directory);
+
+    std::cout << std::format("{:<10} {:<10} {:>11} {:>22} {:>9}  {}",
+                             "level", "stage", "ms", "throughput", "peak MB", "change to baseline") << std::endl;
+
+    std::vector<level_result> results;
+    std::deque<std::string> sweep_names;
+    uint32_t regression_count = 0;
+    try {
+        if (settings.sweep) {
+            for (uint32_t room_count = 1;; room_count *= 2) {
+                auto &name = sweep_names.emplace_back(std::format("sweep_{}", room_count));
+                bench_level level{name, room_count, sweep_texture_count, room_count};
+
+                synthetic_level synthetic;
+                try {
+                    synthetic = write_bench_level(level, directory);
+                } catch (std::runtime_error &e) {
+                    std::cout << std::format("{} rooms: {}", room_count, e.what()) << std::endl;
+                    break;
+                }
+
+                results.push_back(bench_level_stages(level, synthetic, directory, settings.run_count));
+                print_results(results.back(), nullptr, settings);
+            }
+        } else {
+            for (auto &level : bench_levels) {
+                auto synthetic = write_bench_level(level, directory);
+                results.push_back(bench_level_stages(level, synthetic, directory, settings.run_count));
+                regression_count += print_results(results.back(), baseline ? &*baseline : nullptr, settings);
+            }
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        std::filesystem::current_path(previous_path);
+        return 1;
+    }
+
+    std::filesystem::current_path(previous_path);
+    std::filesystem::remove_all(directory);
+
+    if (!settings.json_path.empty()) {
+        std::ofstream file(settings.json_path, std::ios::trunc);
+        file << format_report(results, settings.run_count);
+        if (!file) {
+            std::cerr << "Failed to write " << settings.json_path << std::endl;
+            return 1;
+        }
+    }
+
+    if (regression_count != 0) {
+        std::cerr << std::format("{} stages regressed against {}", regression_count, settings.baseline_path) << std::endl;
+        return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,551 @@
+#include "synthetic_level.h"
+
+#include <glm/common.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vector_relational.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <format>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace voxlife;
+
+
+namespace {
+
+    constexpr int32_t cell_size = 32;           // hammer units, the level is built from cubes of this size
+    constexpr int32_t slot_cells = 8;           // every room sits in its own slot of slot_cells^2 cells
+    constexpr int32_t min_room_cells = 3;
+    constexpr int32_t max_room_cells = 6;
+    constexpr int32_t max_room_height = 5;
+    constexpr int32_t corridor_height = 2;
+
+    enum surface_kind : uint32_t {
+        SURFACE_FLOOR,
+        SURFACE_WALL,
+        SURFACE_CEILING,
+        SURFACE_KIND_MAX
+    };
+
+    // Cells are either solid or belong to a room or corridor, the outermost layer is always solid
+    struct cell_grid {
+        glm::ivec3 size{};
+        std::vector<uint32_t> regions;      // zero for solid cells, otherwise the region index plus one
+
+        size_t index(glm::ivec3 cell) const {
+            return cell.x + static_cast<size_t>(cell.y) * size.x + static_cast<size_t>(cell.z) * size.x * size.y;
+        }
+
+        uint32_t at(glm::ivec3 cell) const {
+            if (glm::any(glm::lessThan(cell, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(cell, size)))
+                return 0;
+            return regions[index(cell)];
+        }
+
+        void carve(glm::ivec3 min, glm::ivec3 max, uint32_t region) {
+            for (int32_t z = min.z; z < max.z; ++z) {
+                for (int32_t y = min.y; y < max.y; ++y) {
+                    for (int32_t x = min.x; x < max.x; ++x) {
+                        auto &cell = regions[index({x, y, z})];
+                        if (cell == 0)
+                            cell = region + 1;
+                    }
+                }
+            }
+        }
+
+        // Cell corners in hammer units, the level is centered on the origin
+        glm::ivec3 to_world(glm::ivec3 corner) const {
+            return (corner - size / 2) * cell_size;
+        }
+    };
+
+    // Axis aligned kd-tree over the cells, it splits until every box is entirely solid or entirely empty.
+    // All solid boxes share leaf zero like in the levels of the game.
+    class tree_builder {
+    public:
+        tree_builder(const cell_grid &grid, bsp::file_lumps &lumps) : grid(grid), lumps(lumps) {
+            const glm::ivec3 p = grid.size + 1;
+            prefix.resize(static_cast<size_t>(p.x) * p.y * p.z, 0);
+
+            for (int32_t z = 1; z < p.z; ++z) {
+                for (int32_t y = 1; y < p.y; ++y) {
+                    for (int32_t x = 1; x < p.x; ++x) {
+                        uint32_t empty = grid.regions[grid.index({x - 1, y - 1, z - 1})] != 0;
+                        prefix[prefix_index({x, y, z})] = empty
+                            + prefix[prefix_index({x - 1, y, z})] + prefix[prefix_index({x, y - 1, z})] + prefix[prefix_index({x, y, z - 1})]
+                            - prefix[prefix_index({x - 1, y - 1, z})] - prefix[prefix_index({x - 1, y, z - 1})] - prefix[prefix_index({x, y - 1, z - 1})]
+                            + prefix[prefix_index({x - 1, y - 1, z - 1})];
+                    }
+                }
+            }
+
+            cell_leafs.resize(grid.regions.size(), 0);
+        }
+
+        void build() {
+            lumps.leafs.push_back(lump_leaf_of(bsp::lump_leaf::CONTENTS_SOLID, glm::ivec3(0), glm::ivec3(0)));
+            build_box(glm::ivec3(0), grid.size);
+        }
+
+        uint32_t get_plane(int axis, int32_t corner) {
+            const int32_t coordinate = (corner - grid.size[axis] / 2) * cell_size;
+            const uint64_t key = (static_cast<uint64_t>(axis) << 32) | static_cast<uint32_t>(coordinate);
+
+            auto [it, inserted] = plane_ids.try_emplace(key, static_cast<uint32_t>(lumps.planes.size()));
+            if (inserted) {
+                bsp::lump_plane plane{};
+                plane.normal = glm::vec3(0.0f);
+                plane.normal[axis] = 1.0f;
+                plane.dist = static_cast<float>(coordinate);
+                plane.type = static_cast<enum bsp::lump_plane::type>(bsp::lump_plane::PLANE_X + axis);
+                lumps.planes.push_back(plane);
+                bsp::check_lump_size(bsp::LUMP_PLANES, lumps.planes.size());
+            }
+
+            return it->second;
+        }
+
+        // Node whose plane separates two neighbouring cells, the face between them lies on that plane
+        uint32_t find_separating_node(glm::ivec3 a, glm::ivec3 b) const {
+            int32_t node = 0;
+            while (node >= 0) {
+                auto [axis, corner] = node_splits[node];
+                bool a_front = a[axis] >= corner;
+                if (a_front != (b[axis] >= corner))
+                    return static_cast<uint32_t>(node);
+
+                node = lumps.nodes[node].children[a_front ? 0 : 1];
+            }
+
+            throw std::logic_error("Neighbouring cells of different contents share a leaf");
+        }
+
+        uint32_t get_cell_leaf(glm::ivec3 cell) const {
+            return cell_leafs[grid.index(cell)];
+        }
+
+    private:
+        size_t prefix_index(glm::ivec3 p) const {
+            return p.x + static_cast<size_t>(p.y) * (grid.size.x + 1) + static_cast<size_t>(p.z) * (grid.size.x + 1) * (grid.size.y + 1);
+        }
+
+        uint32_t count_empty(glm::ivec3 min, glm::ivec3 max) const {
+            return prefix[prefix_index({max.x, max.y, max.z})]
+                - prefix[prefix_index({min.x, max.y, max.z})] - prefix[prefix_index({max.x, min.y, max.z})] - prefix[prefix_index({max.x, max.y, min.z})]
+                + prefix[prefix_index({min.x, min.y, max.z})] + prefix[prefix_index({min.x, max.y, min.z})] + prefix[prefix_index({max.x, min.y, min.z})]
+                - prefix[prefix_index({min.x, min.y, min.z})];
+        }
+
+        bsp::lump_leaf lump_leaf_of(enum bsp::lump_leaf::contents contents, glm::ivec3 min, glm::ivec3 max) const {
+            bsp::lump_leaf leaf{};
+            leaf.contents = contents;
+            leaf.visibility_offset = -1;
+            for (int axis = 0; axis < 3; ++axis) {
+                leaf.min[axis] = static_cast<int16_t>(min[axis]);
+                leaf.max[axis] = static_cast<int16_t>(max[axis]);
+            }
+            return leaf;
+        }
+
+        // Splits where the contents change, closest to the middle of the box so the tree stays shallow
+        std::pair<int, int32_t> choose_split(glm::ivec3 min, glm::ivec3 max) const {
+            const glm::ivec3 extent = max - min;
+            std::array<int, 3> axes = {0, 1, 2};
+            std::sort(axes.begin(), axes.end(), [&](int a, int b) { return extent[a] > extent[b]; });
+
+            for (int axis : axes) {
+                const int32_t middle = (min[axis] + max[axis]) / 2;
+                int32_t best = -1;
+
+                auto slice_empty = [&](int32_t corner) {
+                    glm::ivec3 slice_min = min, slice_max = max;
+                    slice_min[axis] = corner;
+                    slice_max[axis] = corner + 1;
+                    return count_empty(slice_min, slice_max);
+                };
+
+                for (int32_t corner = min[axis] + 1; corner < max[axis]; ++corner) {
+                    if (slice_empty(corner - 1) != slice_empty(corner) && (best < 0 || std::abs(corner - middle) < std::abs(best - middle)))
+                        best = corner;
+                }
+
+                if (best >= 0)
+                    return {axis, best};
+            }
+
+            return {axes[0], (min[axes[0]] + max[axes[0]]) / 2};
+        }
+
+        int16_t build_box(glm::ivec3 min, glm::ivec3 max) {
+            const uint32_t volume = static_cast<uint32_t>(max.x - min.x) * (max.y - min.y) * (max.z - min.z);
+            const uint32_t empty = count_empty(min, max);
+
+            if (empty == 0)
+                return ~int16_t(0);
+
+            if (empty == volume) {
+                const auto leaf_index = static_cast<uint32_t>(lumps.leafs.size());
+                lumps.leafs.push_back(lump_leaf_of(bsp::lump_leaf::CONTENTS_EMPTY, grid.to_world(min), grid.to_world(max)));
+                bsp::check_lump_size(bsp::LUMP_LEAFS, lumps.leafs.size());
+
+                for (int32_t z = min.z; z < max.z; ++z) {
+                    for (int32_t y = min.y; y < max.y; ++y) {
+                        for (int32_t x = min.x; x < max.x; ++x)
+                            cell_leafs[grid.index({x, y, z})] = leaf_index;
+                    }
+                }
+
+                return static_cast<int16_t>(~leaf_index);
+            }
+
+            auto [axis, corner] = choose_split(min, max);
+
+            const auto node_index = static_cast<uint32_t>(lumps.nodes.size());
+            lumps.nodes.emplace_back();
+            node_splits.emplace_back(axis, corner);
+            bsp::check_lump_size(bsp::LUMP_NODES, lumps.nodes.size());
+
+            glm::ivec3 front_min = min, back_max = max;
+            front_min[axis] = corner;
+            back_max[axis] = corner;
+
+            // Points on the plane count as in front of it, like in the point contents walk
+            const int16_t front = build_box(front_min, max);
+            const int16_t back = build_box(min, back_max);
+
+            auto &node = lumps.nodes[node_index];
+            node.plane = get_plane(axis, corner);
+            node.children[0] = front;
+            node.children[1] = back;
+
+            const glm::ivec3 world_min = grid.to_world(min);
+            const glm::ivec3 world_max = grid.to_world(max);
+            for (int i = 0; i < 3; ++i) {
+                node.min[i] = static_cast<int16_t>(world_min[i]);
+                node.max[i] = static_cast<int16_t>(world_max[i]);
+            }
+
+            return static_cast<int16_t>(node_index);
+        }
+
+        const cell_grid &grid;
+        bsp::file_lumps &lumps;
+
+        std::vector<uint32_t> prefix;                               // empty cells in the box from the origin to each corner
+        std::vector<uint32_t> cell_leafs;                           // leaf of every empty cell
+        std::vector<std::pair<int, int32_t>> node_splits;           // axis and cell corner of every node plane
+        std::unordered_map<uint64_t, uint32_t> plane_ids;
+    };
+
+    std::vector<wad::source_texture> generate_textures(uint32_t texture_count, uint32_t seed) {
+        std::vector<wad::source_texture> textures(texture_count);
+
+        for (uint32_t i = 0; i < texture_count; ++i) {
+            std::mt19937 rng(seed * 7919u + i);
+            auto &texture = textures[i];
+            texture.name = std::format("synth_{:03}", i);
+            texture.size = glm::u32vec2(32u << (rng() % 3), 32u << (rng() % 3));
+            texture.indices.resize(static_cast<size_t>(texture.size.x) * texture.size.y);
+
+            // Gradient between two random colors with some noise, so the palette stage sees many distinct colors
+            glm::vec3 from(rng() % 256, rng() % 256, rng() % 256);
+            glm::vec3 to(rng() % 256, rng() % 256, rng() % 256);
+            for (uint32_t j = 0; j < 256; ++j) {
+                glm::vec3 noise(static_cast<float>(rng() % 17) - 8.0f, static_cast<float>(rng() % 17) - 8.0f, static_cast<float>(rng() % 17) - 8.0f);
+                texture.palette[j] = glm::u8vec3(glm::clamp(glm::mix(from, to, j / 255.0f) + noise, glm::vec3(0.0f), glm::vec3(255.0f)));
+            }
+
+            for (uint32_t y = 0; y < texture.size.y; ++y) {
+                for (uint32_t x = 0; x < texture.size.x; ++x) {
+                    uint8_t index;
+                    switch (i % 3) {
+                        case 0:     // noise
+                            index = static_cast<uint8_t>(rng());
+                            break;
+                        case 1:     // checker
+                            index = static_cast<uint8_t>((((x / 8) + (y / 8)) & 1) != 0 ? 32 + rng() % 32 : 192 + rng() % 32);
+                            break;
+                        default: {  // bricks with dark mortar
+                            uint32_t row = y / 8;
+                            uint32_t offset = (row & 1) != 0 ? 8 : 0;
+                            bool mortar = y % 8 == 0 || (x + offset) % 16 == 0;
+                            index = static_cast<uint8_t>(mortar ? rng() % 16 : 96 + (x + y) % 128);
+                            break;
+                        }
+                    }
+                    texture.indices[x + static_cast<size_t>(y) * texture.size.x] = index;
+                }
+            }
+        }
+
+        return textures;
+    }
+
+}
+
+synthetic_level generate_synthetic_level(const synthetic_level_settings &settings, std::string_view wad_name) {
+    if (settings.room_count == 0)
+        throw std::runtime_error("A synthetic level needs at least one room");
+
+    if (settings.texture_count == 0 || settings.texture_count > static_cast<uint32_t>(bsp::max_lump_size[bsp::LUMP_TEXTURES]))
+        throw std::runtime_error(std::format("Texture count must be between 1 and {}", bsp::max_lump_size[bsp::LUMP_TEXTURES]));
+
+    std::mt19937 rng(settings.seed);
+
+    const auto slots_x = static_cast<int32_t>(std::ceil(std::sqrt(static_cast<double>(settings.room_count))));
+    const auto slots_y = static_cast<int32_t>((settings.room_count + slots_x - 1) / slots_x);
+
+    cell_grid grid;
+    grid.size = glm::ivec3(slots_x * slot_cells + 2, slots_y * slot_cells + 2, max_room_height + 2);
+    grid.regions.resize(static_cast<size_t>(grid.size.x) * grid.size.y * grid.size.z, 0);
+
+    // Node and leaf bounds are stored as 16 bit integers
+    if (grid.size.x * cell_size / 2 > INT16_MAX || grid.size.y * cell_size / 2 > INT16_MAX)
+        throw std::runtime_error(std::format("{} rooms exceed the coordinate range of the format", settings.room_count));
+
+    std::vector<glm::ivec3> room_min(settings.room_count);
+    std::vector<glm::ivec3> room_max(settings.room_count);
+    for (uint32_t room = 0; room < settings.room_count; ++room) {
+        glm::ivec3 slot(room % slots_x, room / slots_x, 0);
+        glm::ivec3 size(min_room_cells + rng() % (max_room_cells - min_room_cells + 1),
+                        min_room_cells + rng() % (max_room_cells - min_room_cells + 1),
+                        corridor_height + rng() % (max_room_height - corridor_height + 1));
+
+        // At least one solid cell to the slot border, so rooms only meet through corridors
+        glm::ivec3 offset(1 + rng() % (slot_cells - size.x - 1), 1 + rng() % (slot_cells - size.y - 1), 0);
+        room_min[room] = glm::ivec3(1, 1, 1) + slot * slot_cells + offset;
+        room_max[room] = room_min[room] + size;
+        grid.carve(room_min[room], room_max[room], room);
+    }
+
+    // L shaped corridors to the right and upper neighbour, one cell wide and carved only through solid cells
+    uint32_t region_count = settings.room_count;
+    for (uint32_t room = 0; room < settings.room_count; ++room) {
+        for (uint32_t neighbour : {room + 1, room + static_cast<uint32_t>(slots_x)}) {
+            if (neighbour >= settings.room_count || (neighbour == room + 1 && neighbour % slots_x == 0))
+                continue;
+
+            glm::ivec3 from = (room_min[room] + room_max[room]) / 2;
+            glm::ivec3 to = (room_min[neighbour] + room_max[neighbour]) / 2;
+
+            glm::ivec3 corner(to.x, from.y, 1);
+            grid.carve(glm::ivec3(std::min(from.x, corner.x), from.y, 1), glm::ivec3(std::max(from.x, corner.x) + 1, from.y + 1, 1 + corridor_height), region_count);
+            grid.carve(glm::ivec3(to.x, std::min(corner.y, to.y), 1), glm::ivec3(to.x + 1, std::max(corner.y, to.y) + 1, 1 + corridor_height), region_count);
+            region_count++;
+        }
+    }
+
+    std::vector<std::array<uint32_t, SURFACE_KIND_MAX>> region_textures(region_count);
+    for (auto &textures : region_textures) {
+        for (auto &texture : textures)
+            texture = rng() % settings.texture_count;
+    }
+
+    synthetic_level level;
+    level.textures = generate_textures(settings.texture_count, settings.seed);
+
+    auto &lumps = level.lumps;
+    for (auto &texture : level.textures) {
+        bsp::lump_mip_texture mip_texture{};
+        std::copy(texture.name.begin(), texture.name.end(), mip_texture.name);
+        mip_texture.width = texture.size.x;
+        mip_texture.height = texture.size.y;
+        lumps.textures.push_back(mip_texture);
+    }
+
+    // One texture info per texture and axis, projected like the default alignment of the editor
+    for (uint32_t texture = 0; texture < settings.texture_count; ++texture) {
+        const std::array<std::pair<glm::vec3, glm::vec3>, 3> axes = {
+            std::pair(glm::vec3(0, 1, 0), glm::vec3(0, 0, -1)),
+            std::pair(glm::vec3(1, 0, 0), glm::vec3(0, 0, -1)),
+            std::pair(glm::vec3(1, 0, 0), glm::vec3(0, -1, 0)),
+        };
+
+        for (auto &[s, t] : axes) {
+            bsp::lump_texture_info texture_info{};
+            texture_info.s = s;
+            texture_info.t = t;
+            texture_info.mip_texture = texture;
+            lumps.texture_infos.push_back(texture_info);
+        }
+    }
+
+    tree_builder tree(grid, lumps);
+    tree.build();
+
+    // Every empty cell gets a quad toward each solid neighbour, facing into the cell
+    struct pending_face {
+        glm::ivec3 cell;
+        int axis;
+        int direction;      // toward the solid neighbour
+        uint32_t texture;
+        uint32_t node;
+    };
+
+    std::vector<pending_face> pending_faces;
+    for (int32_t z = 0; z < grid.size.z; ++z) {
+        for (int32_t y = 0; y < grid.size.y; ++y) {
+            for (int32_t x = 0; x < grid.size.x; ++x) {
+                glm::ivec3 cell(x, y, z);
+                uint32_t region = grid.at(cell);
+                if (region == 0)
+                    continue;
+
+                for (int axis = 0; axis < 3; ++axis) {
+                    for (int direction : {-1, 1}) {
+                        glm::ivec3 neighbour = cell;
+                        neighbour[axis] += direction;
+                        if (grid.at(neighbour) != 0)
+                            continue;
+
+                        surface_kind kind = axis != 2 ? SURFACE_WALL : direction < 0 ? SURFACE_FLOOR : SURFACE_CEILING;
+                        pending_faces.push_back({
+                            .cell = cell,
+                            .axis = axis,
+                            .direction = direction,
+                            .texture = region_textures[region - 1][kind],
+                            .node = tree.find_separating_node(cell, neighbour),
+                        });
+                    }
+                }
+            }
+        }
+    }
+
+    bsp::check_lump_size(bsp::LUMP_FACES, pending_faces.size());
+
+    // Faces are stored with the node whose plane they lie on, so they are emitted grouped by node
+    std::stable_sort(pending_faces.begin(), pending_faces.end(), [](const pending_face &a, const pending_face &b) {
+        return a.node < b.node;
+    });
+
+    std::unordered_map<uint64_t, uint16_t> vertex_ids;
+    std::unordered_map<uint32_t, int32_t> edge_ids;
+    lumps.edges.push_back({});      // edge zero can not be referenced with a sign
+
+    auto get_vertex = [&](glm::ivec3 corner) {
+        const glm::ivec3 world = grid.to_world(corner);
+        const uint64_t key = (static_cast<uint64_t>(static_cast<uint16_t>(world.x)) << 32)
+                           | (static_cast<uint64_t>(static_cast<uint16_t>(world.y)) << 16)
+                           | static_cast<uint16_t>(world.z);
+
+        auto [it, inserted] = vertex_ids.try_emplace(key, static_cast<uint16_t>(lumps.vertices.size()));
+        if (inserted) {
+            lumps.vertices.push_back(glm::vec3(world));
+            bsp::check_lump_size(bsp::LUMP_VERTICES, lumps.vertices.size());
+        }
+        return it->second;
+    };
+
+    auto add_edge = [&](uint16_t from, uint16_t to) {
+        const uint32_t key = (static_cast<uint32_t>(std::min(from, to)) << 16) | std::max(from, to);
+        auto [it, inserted] = edge_ids.try_emplace(key, static_cast<int32_t>(lumps.edges.size()));
+        if (inserted)
+            lumps.edges.push_back({{from, to}});
+
+        const int32_t edge = it->second;
+        lumps.surface_edges.push_back({lumps.edges[edge].vertex[0] == from ? edge : -edge});
+    };
+
+    std::vector<std::vector<uint16_t>> leaf_faces(lumps.leafs.size());
+    for (auto &node : lumps.nodes) {
+        node.first_face = 0;
+        node.face_count = 0;
+    }
+
+    for (size_t face_index = 0; face_index < pending_faces.size(); ++face_index) {
+        auto &pending = pending_faces[face_index];
+        auto &node = lumps.nodes[pending.node];
+        if (node.face_count == 0)
+            node.first_face = static_cast<uint16_t>(face_index);
+        node.face_count++;
+
+        const int u = (pending.axis + 1) % 3;
+        const int v = (pending.axis + 2) % 3;
+        glm::ivec3 base = pending.cell;
+        base[pending.axis] += pending.direction > 0 ? 1 : 0;
+
+        glm::ivec3 du(0), dv(0);
+        du[u] = 1;
+        dv[v] = 1;
+
+        // Clockwise seen from the side the face points to, which is the empty cell
+        std::array<glm::ivec3, 4> corners = pending.direction > 0
+            ? std::array<glm::ivec3, 4>{base, base + du, base + du + dv, base + dv}
+            : std::array<glm::ivec3, 4>{base, base + dv, base + du + dv, base + du};
+
+        bsp::lump_face face{};
+        face.plane = static_cast<uint16_t>(tree.get_plane(pending.axis, base[pending.axis]));
+        face.side = pending.direction > 0 ? 1 : 0;
+        face.first_edge = static_cast<uint32_t>(lumps.surface_edges.size());
+        face.edge_count = 4;
+        face.texture_info = static_cast<uint16_t>(pending.texture * 3 + pending.axis);
+        face.styles[0] = 0;
+        face.styles[1] = face.styles[2] = face.styles[3] = 255;
+        face.light_offset = -1;
+
+        std::array<uint16_t, 4> vertices;
+        for (size_t i = 0; i < corners.size(); ++i)
+            vertices[i] = get_vertex(corners[i]);
+        for (size_t i = 0; i < vertices.size(); ++i)
+            add_edge(vertices[i], vertices[(i + 1) % vertices.size()]);
+
+        lumps.faces.push_back(face);
+        leaf_faces[tree.get_cell_leaf(pending.cell)].push_back(static_cast<uint16_t>(face_index));
+    }
+
+    for (size_t leaf = 0; leaf < lumps.leafs.size(); ++leaf) {
+        lumps.leafs[leaf].first_mark_surface = static_cast<uint16_t>(lumps.mark_surfaces.size());
+        lumps.leafs[leaf].mark_surface_count = static_cast<uint16_t>(leaf_faces[leaf].size());
+        for (auto face : leaf_faces[leaf])
+            lumps.mark_surfaces.push_back({face});
+    }
+    bsp::check_lump_size(bsp::LUMP_MARKSURFACES, lumps.mark_surfaces.size());
+
+    // The clipping hulls reuse the hull 0 tree instead of expanding the brushes by the player size
+    for (auto &node : lumps.nodes) {
+        bsp::lump_clip_node clip_node{};
+        clip_node.plane = static_cast<int32_t>(node.plane);
+        for (int i = 0; i < 2; ++i) {
+            clip_node.children[i] = node.children[i] >= 0
+                ? node.children[i]
+                : static_cast<int16_t>(lumps.leafs[static_cast<uint16_t>(~node.children[i])].contents);
+        }
+        lumps.clip_nodes.push_back(clip_node);
+    }
+
+    bsp::lump_model world{};
+    world.min = glm::vec3(grid.to_world(glm::ivec3(0)));
+    world.max = glm::vec3(grid.to_world(grid.size));
+    world.vis_leafs = static_cast<int32_t>(lumps.leafs.size()) - 1;
+    world.first_face = 0;
+    world.face_count = static_cast<int32_t>(lumps.faces.size());
+    lumps.models.push_back(world);
+
+    // Rooms span whole cells, so their centers are whole units
+    auto room_center = [&](uint32_t room) {
+        return (grid.to_world(room_min[room]) + grid.to_world(room_max[room])) / 2;
+    };
+
+    auto &entities = lumps.entities;
+    entities += std::format("{{\n\"classname\" \"worldspawn\"\n\"wad\" \"{}\"\n\"mapversion\" \"220\"\n}}\n", wad_name);
+
+    glm::ivec3 spawn = room_center(0);
+    spawn.z = grid.to_world(room_min[0]).z + 36;
+    entities += std::format("{{\n\"classname\" \"info_player_start\"\n\"origin\" \"{} {} {}\"\n\"angle\" \"0\"\n}}\n", spawn.x, spawn.y, spawn.z);
+
+    // One light per room below the ceiling, as far as the entity limit allows
+    const uint32_t light_count = std::min<uint32_t>(settings.room_count, bsp::max_lump_size[bsp::LUMP_ENTITIES] - 2);
+    for (uint32_t room = 0; room < light_count; ++room) {
+        glm::ivec3 origin = room_center(room);
+        origin.z = grid.to_world(room_max[room]).z - cell_size / 2;
+        entities += std::format("{{\n\"classname\" \"light\"\n\"origin\" \"{} {} {}\"\n\"_light\" \"255 240 220 200\"\n}}\n", origin.x, origin.y, origin.z);
+    }
+
+    return level;
+}
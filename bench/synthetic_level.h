@@ -0,0 +1,29 @@
+#ifndef VOXLIFE_BENCH_SYNTHETIC_LEVEL_H
+#define VOXLIFE_BENCH_SYNTHETIC_LEVEL_H
+
+#include <bsp/write_file.h>
+#include <wad/write_file.h>
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Procedural levels for measuring the pipeline without game files. Rooms sit on a square grid of slots and are joined
+// to their right and upper neighbours by corridors, every room and corridor draws its floor, wall and ceiling
+// textures from the generated wad. Faces grow roughly linearly with the room count, about 400 rooms reach the face
+// limit of the format.
+struct synthetic_level_settings {
+    uint32_t room_count = 16;
+    uint32_t texture_count = 32;    // at most 512, the texture lump limit
+    uint32_t seed = 1;
+};
+
+struct synthetic_level {
+    voxlife::bsp::file_lumps lumps;
+    std::vector<voxlife::wad::source_texture> textures;
+};
+
+// The worldspawn entity references wad_name, which the reader resolves relative to the valve directory of the game
+synthetic_level generate_synthetic_level(const synthetic_level_settings &settings, std::string_view wad_name);
+
+#endif //VOXLIFE_BENCH_SYNTHETIC_LEVEL_H
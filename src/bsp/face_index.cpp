@@ -0,0 +1,154 @@
+#include <bsp/read_file.h>
+#include <bsp/read_file_info.h>
+
+#include <glm/common.hpp>
+#include <glm/vector_relational.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <utility>
+
+
+namespace voxlife::bsp {
+
+    constexpr uint32_t max_leaf_faces = 4;
+    constexpr uint32_t max_bvh_depth = 64;
+
+    void build_face_bvh(const face_arena &faces, bsp_caches::face_arena_storage &storage) {
+        const auto face_count = static_cast<uint32_t>(faces.size());
+        if (face_count == 0)
+            return;
+
+        storage.face_mins.resize(face_count);
+        storage.face_maxs.resize(face_count);
+        std::vector<glm::vec3> centers(face_count);
+
+        for (uint32_t face_id = 0; face_id < face_count; ++face_id) {
+            auto vertices = faces.get_vertices(face_id);
+            glm::vec3 face_min(std::numeric_limits<float>::max());
+            glm::vec3 face_max(std::numeric_limits<float>::lowest());
+            for (auto &vertex : vertices) {
+                face_min = glm::min(face_min, vertex);
+                face_max = glm::max(face_max, vertex);
+            }
+
+            storage.face_mins[face_id] = face_min;
+            storage.face_maxs[face_id] = face_max;
+            centers[face_id] = (face_min + face_max) * 0.5f;
+        }
+
+        storage.bvh_face_ids.resize(face_count);
+        std::iota(storage.bvh_face_ids.begin(), storage.bvh_face_ids.end(), 0);
+
+        // A binary tree with at least one face per leaf never has more than 2n - 1 nodes
+        storage.bvh_nodes.reserve(face_count * 2);
+        storage.bvh_nodes.push_back({});
+
+        struct build_task {
+            uint32_t node;
+            uint32_t begin;
+            uint32_t end;
+        };
+
+        std::vector<build_task> tasks = {{0, 0, face_count}};
+        while (!tasks.empty()) {
+            auto task = tasks.back();
+            tasks.pop_back();
+
+            glm::vec3 node_min(std::numeric_limits<float>::max());
+            glm::vec3 node_max(std::numeric_limits<float>::lowest());
+            glm::vec3 center_min(std::numeric_limits<float>::max());
+            glm::vec3 center_max(std::numeric_limits<float>::lowest());
+            for (uint32_t i = task.begin; i < task.end; ++i) {
+                auto face_id = storage.bvh_face_ids[i];
+                node_min = glm::min(node_min, storage.face_mins[face_id]);
+                node_max = glm::max(node_max, storage.face_maxs[face_id]);
+                center_min = glm::min(center_min, centers[face_id]);
+                center_max = glm::max(center_max, centers[face_id]);
+            }
+
+            auto &node = storage.bvh_nodes[task.node];
+            node.min = node_min;
+            node.max = node_max;
+
+            glm::vec3 center_extent = center_max - center_min;
+            uint32_t axis = center_extent.x > center_extent.y ? (center_extent.x > center_extent.z ? 0 : 2)
+                                                              : (center_extent.y > center_extent.z ? 1 : 2);
+
+            // Faces sharing one center cannot be split any further
+            if (task.end - task.begin <= max_leaf_faces || center_extent[axis] <= 0.0f) {
+                node.first = task.begin;
+                node.count = task.end - task.begin;
+                continue;
+            }
+
+            // Median split, keeps the tree balanced so the depth stays logarithmic
+            uint32_t middle = task.begin + (task.end - task.begin) / 2;
+            std::nth_element(storage.bvh_face_ids.begin() + task.begin,
+                             storage.bvh_face_ids.begin() + middle,
+                             storage.bvh_face_ids.begin() + task.end,
+                             [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; });
+
+            auto child = static_cast<uint32_t>(storage.bvh_nodes.size());
+            node.first = child;
+            node.count = 0;
+            storage.bvh_nodes.push_back({});
+            storage.bvh_nodes.push_back({});
+
+            tasks.push_back({child, task.begin, middle});
+            tasks.push_back({child + 1, middle, task.end});
+        }
+    }
+
+    void get_model_faces_in_aabb(bsp_handle handle, uint32_t model_id, const aabb &bounds, std::vector<uint32_t> &face_ids) {
+        auto& info = *reinterpret_cast<bsp_info*>(handle);
+        face_ids.clear();
+
+        auto faces = get_model_faces(handle, model_id);
+        auto& storage = info.caches.model_faces[model_id];
+        std::call_once(storage.bvh_flag, [&]() {
+            // Like the faces, the hierarchy is only cached once it is complete
+            bsp_caches::face_arena_storage built;
+            build_face_bvh(faces, built);
+
+            storage.bvh_nodes = std::move(built.bvh_nodes);
+            storage.bvh_face_ids = std::move(built.bvh_face_ids);
+            storage.face_mins = std::move(built.face_mins);
+            storage.face_maxs = std::move(built.face_maxs);
+        });
+
+        if (storage.bvh_nodes.empty())
+            return;
+
+        auto overlaps = [&](glm::vec3 min, glm::vec3 max) {
+            return glm::all(glm::lessThanEqual(min, bounds.max)) && glm::all(glm::greaterThanEqual(max, bounds.min));
+        };
+
+        uint32_t stack[max_bvh_depth];
+        uint32_t stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            auto& node = storage.bvh_nodes[stack[--stack_size]];
+            if (!overlaps(node.min, node.max))
+                continue;
+
+            if (node.count == 0) {
+                stack[stack_size++] = node.first;
+                stack[stack_size++] = node.first + 1;
+                continue;
+            }
+
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                auto face_id = storage.bvh_face_ids[i];
+                if (overlaps(storage.face_mins[face_id], storage.face_maxs[face_id]))
+                    face_ids.push_back(face_id);
+            }
+        }
+
+        // Consumers like the voxelizers depend on the original face order
+        std::sort(face_ids.begin(), face_ids.end());
+    }
+
+}
@@ -0,0 +1,71 @@
+#include <bsp/read_file.h>
+#include <bsp/primitives.h>
+#include <bsp/read_file_info.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace voxlife::bsp {
+
+    // Points are walked down the tree in packets, every lane follows its own path until all of them hit a leaf
+    constexpr uint32_t packet_size = 8;
+
+    void get_point_contents(bsp_handle handle, std::span<const glm::vec3> points, std::span<int32_t> contents) {
+        const auto& file = reinterpret_cast<bsp_info*>(handle)->file;
+
+        if (contents.size() < points.size())
+            throw std::out_of_range("Contents span is smaller than the point span");
+
+        if (file.models.empty() || file.nodes.empty()) {
+            std::fill(contents.begin(), contents.begin() + points.size(), lump_leaf::CONTENTS_SOLID);
+            return;
+        }
+
+        // Plane, child and head node indices were checked by validate_lumps, the walk needs no bounds checks
+        const auto* nodes = file.validated.get_nodes().data();
+        const auto* planes = file.validated.get_planes().data();
+        const auto leafs = file.validated.get_leafs();
+        const int32_t head_node = file.models[0].head_nodes[0];
+
+        for (size_t packet = 0; packet < points.size(); packet += packet_size) {
+            const auto lane_count = static_cast<uint32_t>(std::min<size_t>(packet_size, points.size() - packet));
+
+            float x[packet_size], y[packet_size], z[packet_size];
+            int32_t node[packet_size];
+
+            for (uint32_t lane = 0; lane < packet_size; ++lane) {
+                auto& point = points[packet + std::min(lane, lane_count - 1)];
+                x[lane] = point.x;
+                y[lane] = point.y;
+                z[lane] = point.z;
+                node[lane] = head_node;
+            }
+
+            bool any_node = true;
+            while (any_node) {
+                any_node = false;
+
+#pragma omp simd reduction(|:any_node)
+                for (uint32_t lane = 0; lane < packet_size; ++lane) {
+                    int32_t current = node[lane];
+                    auto& tree_node = nodes[current < 0 ? 0 : current];
+                    auto& plane = planes[tree_node.plane];
+
+                    float distance = plane.normal.x * x[lane] + plane.normal.y * y[lane] + plane.normal.z * z[lane] - plane.dist;
+                    int32_t next = distance >= 0.0f ? tree_node.children[0] : tree_node.children[1];
+
+                    node[lane] = current < 0 ? current : next;
+                    any_node |= node[lane] >= 0;
+                }
+            }
+
+            for (uint32_t lane = 0; lane < lane_count; ++lane) {
+                // Negative children are leafs, stored as the complement of the leaf index
+                auto leaf_index = static_cast<size_t>(~node[lane]);
+                contents[packet + lane] = leafs[leaf_index].contents;
+            }
+        }
+    }
+
+}
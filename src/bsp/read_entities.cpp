@@ -84,10 +84,10 @@ namespace voxlife::bsp {
 
 
     std::vector<entity> get_entities(bsp_handle handle) {
-        auto& info = *reinterpret_cast<bsp_info*>(handle);
+        const auto& file = reinterpret_cast<bsp_info*>(handle)->file;
         std::vector<entity> result;
 
-        tokenizer tokenizer(info.entities_str);
+        tokenizer tokenizer(file.entities_str);
         parser_state state = STATE_START;
 
         while (true) {
@@ -2,11 +2,20 @@
 #include <bsp/read_file.h>
 #include <bsp/primitives.h>
 #include <bsp/read_file_info.h>
+#include <utils/case_insensitive.h>
+#include <utils/trace.h>
+#include <utils/memory_usage.h>
+
+#include <glm/common.hpp>
 
 #include <cstring>
 #include <stdexcept>
+#include <algorithm>
+#include <exception>
+#include <mutex>
 #include <format>
 #include <iostream>
+#include <memory>
 #include <fstream>
 #include <span>
 #include <charconv>
@@ -24,50 +33,73 @@
 
 namespace voxlife::bsp {
 
-    void parse_header(bsp_info &info) {
-        if (info.header->version != header::bsp_version_halflife)
-            throw std::runtime_error(std::format("Unsupported BSP version {}", info.header->version));
+    // Size of one entry of every lump, lumps without fixed entries are counted in bytes
+    constexpr size_t lump_entry_size[] = {
+            /* [LUMP_ENTITIES]      = */ 1,
+            /* [LUMP_PLANES]        = */ sizeof(lump_plane),
+            /* [LUMP_TEXTURES]      = */ 1,
+            /* [LUMP_VERTICES]      = */ sizeof(lump_vertex),
+            /* [LUMP_VISIBILITY]    = */ 1,
+            /* [LUMP_NODES]         = */ sizeof(lump_node),
+            /* [LUMP_TEXINFO]       = */ sizeof(lump_texture_info),
+            /* [LUMP_FACES]         = */ sizeof(lump_face),
+            /* [LUMP_LIGHTING]      = */ 1,
+            /* [LUMP_CLIPNODES]     = */ sizeof(lump_clip_node),
+            /* [LUMP_LEAFS]         = */ sizeof(lump_leaf),
+            /* [LUMP_MARKSURFACES]  = */ sizeof(lump_mark_surface),
+            /* [LUMP_EDGES]         = */ sizeof(lump_edge),
+            /* [LUMP_SURFEDGES]     = */ sizeof(lump_surf_edge),
+            /* [LUMP_MODELS]        = */ sizeof(lump_model)
+    };
+
+    void parse_header(bsp_file &file) {
+        if (file.header->version != header::bsp_version_halflife)
+            throw std::runtime_error(std::format("Unsupported BSP version {}", file.header->version));
 
         for (int i = 0; i < lump_type::LUMP_MAX; ++i) {
-            auto& lump = info.header->lumps[i];
+            auto& lump = file.header->lumps[i];
             if (lump.offset < 0 || lump.length < 0)
                 throw std::runtime_error(std::format("Lump {} is not valid", lump_names[i]));
 
-            if (lump.offset + lump.length > info.file_size)
+            if (static_cast<size_t>(lump.offset) + static_cast<size_t>(lump.length) > file.file_size)
                 throw std::runtime_error(std::format("Lump {} extends beyond end of file", lump_names[i]));
 
-            info.lump_begins[i] = info.file_data + lump.offset;
-            info.lump_ends[i]   = info.file_data + lump.offset + lump.length;
+            if (lump.length % lump_entry_size[i] != 0)
+                throw std::runtime_error(std::format("Lump {} is not a whole number of entries", lump_names[i]));
+
+            file.lump_begins[i] = file.file_data + lump.offset;
+            file.lump_ends[i]   = file.file_data + lump.offset + lump.length;
         }
 
-        info.entities_str  = std::string_view(reinterpret_cast<const char*>      (info.lump_begins[lump_type::LUMP_ENTITIES]),
-                                              reinterpret_cast<const char*>      (  info.lump_ends[lump_type::LUMP_ENTITIES]));
-        info.planes        = std::span(reinterpret_cast<const lump_plane*>       (info.lump_begins[lump_type::LUMP_PLANES]),
-                                       reinterpret_cast<const lump_plane*>       (  info.lump_ends[lump_type::LUMP_PLANES]));
-        info.textures      = std::span(reinterpret_cast<const lump_mip_texture*> (info.lump_begins[lump_type::LUMP_TEXTURES]),
-                                       reinterpret_cast<const lump_mip_texture*> (  info.lump_ends[lump_type::LUMP_TEXTURES]));
-        info.vertices      = std::span(reinterpret_cast<const lump_vertex*>      (info.lump_begins[lump_type::LUMP_VERTICES]),
-                                       reinterpret_cast<const lump_vertex*>      (  info.lump_ends[lump_type::LUMP_VERTICES]));
-        info.nodes         = std::span(reinterpret_cast<const lump_node*>        (info.lump_begins[lump_type::LUMP_NODES]),
-                                       reinterpret_cast<const lump_node*>        (  info.lump_ends[lump_type::LUMP_NODES]));
-        info.texture_infos = std::span(reinterpret_cast<const lump_texture_info*>(info.lump_begins[lump_type::LUMP_TEXINFO]),
-                                       reinterpret_cast<const lump_texture_info*>(  info.lump_ends[lump_type::LUMP_TEXINFO]));
-        info.faces         = std::span(reinterpret_cast<const lump_face*>        (info.lump_begins[lump_type::LUMP_FACES]),
-                                       reinterpret_cast<const lump_face*>        (  info.lump_ends[lump_type::LUMP_FACES]));
-        info.clip_nodes    = std::span(reinterpret_cast<const lump_clip_node*>   (info.lump_begins[lump_type::LUMP_CLIPNODES]),
-                                       reinterpret_cast<const lump_clip_node*>   (  info.lump_ends[lump_type::LUMP_CLIPNODES]));
-        info.leafs         = std::span(reinterpret_cast<const lump_leaf*>        (info.lump_begins[lump_type::LUMP_LEAFS]),
-                                       reinterpret_cast<const lump_leaf*>        (  info.lump_ends[lump_type::LUMP_LEAFS]));
-        info.mark_surfaces = std::span(reinterpret_cast<const lump_mark_surface*>(info.lump_begins[lump_type::LUMP_MARKSURFACES]),
-                                       reinterpret_cast<const lump_mark_surface*>(  info.lump_ends[lump_type::LUMP_MARKSURFACES]));
-        info.edges         = std::span(reinterpret_cast<const lump_edge*>        (info.lump_begins[lump_type::LUMP_EDGES]),
-                                       reinterpret_cast<const lump_edge*>        (  info.lump_ends[lump_type::LUMP_EDGES]));
-        info.surface_edges = std::span(reinterpret_cast<const lump_surf_edge*>   (info.lump_begins[lump_type::LUMP_SURFEDGES]),
-                                       reinterpret_cast<const lump_surf_edge*>   (  info.lump_ends[lump_type::LUMP_SURFEDGES]));
-        info.models        = std::span(reinterpret_cast<const lump_model*>       (info.lump_begins[lump_type::LUMP_MODELS]),
-                                       reinterpret_cast<const lump_model*>       (  info.lump_ends[lump_type::LUMP_MODELS]));
+        file.entities_str  = std::string_view(reinterpret_cast<const char*>      (file.lump_begins[lump_type::LUMP_ENTITIES]),
+                                              reinterpret_cast<const char*>      (  file.lump_ends[lump_type::LUMP_ENTITIES]));
+        file.planes        = std::span(reinterpret_cast<const lump_plane*>       (file.lump_begins[lump_type::LUMP_PLANES]),
+                                       reinterpret_cast<const lump_plane*>       (  file.lump_ends[lump_type::LUMP_PLANES]));
+        file.textures      = std::span(reinterpret_cast<const lump_mip_texture*> (file.lump_begins[lump_type::LUMP_TEXTURES]),
+                                       reinterpret_cast<const lump_mip_texture*> (  file.lump_ends[lump_type::LUMP_TEXTURES]));
+        file.vertices      = std::span(reinterpret_cast<const lump_vertex*>      (file.lump_begins[lump_type::LUMP_VERTICES]),
+                                       reinterpret_cast<const lump_vertex*>      (  file.lump_ends[lump_type::LUMP_VERTICES]));
+        file.nodes         = std::span(reinterpret_cast<const lump_node*>        (file.lump_begins[lump_type::LUMP_NODES]),
+                                       reinterpret_cast<const lump_node*>        (  file.lump_ends[lump_type::LUMP_NODES]));
+        file.texture_infos = std::span(reinterpret_cast<const lump_texture_info*>(file.lump_begins[lump_type::LUMP_TEXINFO]),
+                                       reinterpret_cast<const lump_texture_info*>(  file.lump_ends[lump_type::LUMP_TEXINFO]));
+        file.faces         = std::span(reinterpret_cast<const lump_face*>        (file.lump_begins[lump_type::LUMP_FACES]),
+                                       reinterpret_cast<const lump_face*>        (  file.lump_ends[lump_type::LUMP_FACES]));
+        file.clip_nodes    = std::span(reinterpret_cast<const lump_clip_node*>   (file.lump_begins[lump_type::LUMP_CLIPNODES]),
+                                       reinterpret_cast<const lump_clip_node*>   (  file.lump_ends[lump_type::LUMP_CLIPNODES]));
+        file.leafs         = std::span(reinterpret_cast<const lump_leaf*>        (file.lump_begins[lump_type::LUMP_LEAFS]),
+                                       reinterpret_cast<const lump_leaf*>        (  file.lump_ends[lump_type::LUMP_LEAFS]));
+        file.mark_surfaces = std::span(reinterpret_cast<const lump_mark_surface*>(file.lump_begins[lump_type::LUMP_MARKSURFACES]),
+                                       reinterpret_cast<const lump_mark_surface*>(  file.lump_ends[lump_type::LUMP_MARKSURFACES]));
+        file.edges         = std::span(reinterpret_cast<const lump_edge*>        (file.lump_begins[lump_type::LUMP_EDGES]),
+                                       reinterpret_cast<const lump_edge*>        (  file.lump_ends[lump_type::LUMP_EDGES]));
+        file.surface_edges = std::span(reinterpret_cast<const lump_surf_edge*>   (file.lump_begins[lump_type::LUMP_SURFEDGES]),
+                                       reinterpret_cast<const lump_surf_edge*>   (  file.lump_ends[lump_type::LUMP_SURFEDGES]));
+        file.models        = std::span(reinterpret_cast<const lump_model*>       (file.lump_begins[lump_type::LUMP_MODELS]),
+                                       reinterpret_cast<const lump_model*>       (  file.lump_ends[lump_type::LUMP_MODELS]));
     }
 
+    // Checks ids passed in by callers, indices stored in the file were already checked by validate_lumps
     template<typename T>
     constexpr T& span_at(std::span<T> span, size_t index) {
         if (index >= span.size()) [[unlikely]]
@@ -76,15 +108,7 @@ namespace voxlife::bsp {
         return span[index];
     }
 
-    template<typename T>
-    constexpr std::span<T> safe_subspan(std::span<T> span, size_t offset, size_t length) {
-        if (offset + length > span.size()) [[unlikely]]
-            throw std::out_of_range("Span index out of bounds");
-
-        return span.subspan(offset, length);
-    }
-
-    void read_map(bsp_info &info) {
+    void read_map(const bsp_file &info) {
         auto file = std::ofstream("map.ply", std::ios::out);
 
         file << "ply\n";
@@ -101,11 +125,9 @@ namespace voxlife::bsp {
             file << vertex.x << " " << vertex.y << " " << vertex.z << "\n";
 
         for (auto& face : info.faces) {
-            auto surface_edges = safe_subspan(info.surface_edges, face.first_edge, face.edge_count);
-
             file << face.edge_count;
-            for (auto& surface_edge : surface_edges) {
-                auto edge = span_at(info.edges, std::abs(surface_edge.edge));
+            for (auto& surface_edge : info.validated.get_surface_edges(face)) {
+                auto edge = info.edges[std::abs(surface_edge.edge)];
 
                 uint16_t edge_index = surface_edge.edge < 0 ? edge.vertex[0] : edge.vertex[1];
                 file << " " << edge_index;
@@ -114,341 +136,323 @@ namespace voxlife::bsp {
         }
     }
 
-    std::pair<const uint8_t*, size_t> lookup_texture(bsp_handle handle, std::string_view name, std::span<wad::wad_handle> resources) {
-        for (auto& resource : resources) {
-            auto* data = reinterpret_cast<const uint8_t*>(wad::get_entry(resource, name));
-
-            if (data != nullptr) {
-                size_t texture_size = wad::get_entry_size(resource, name);
-                return { data, texture_size };
-            }
-        }
-        return { nullptr, 0 };
+    uint32_t get_texture_name_flags(std::string_view name) {
+        case_insensitive_equal equal;
+        uint32_t flags = 0;
+
+        if (equal(name, "sky"))
+            flags |= TEXTURE_SKY;
+        if (name.starts_with('!'))
+            flags |= TEXTURE_WATER;
+        if (name.starts_with('{'))
+            flags |= TEXTURE_ALPHA_MASKED;
+        if (equal(name, "aaatrigger"))
+            flags |= TEXTURE_TRIGGER;
+        if (equal(name, "clip"))
+            flags |= TEXTURE_CLIP;
+        if (equal(name, "origin"))
+            flags |= TEXTURE_ORIGIN;
+
+        return flags;
     }
 
-    void load_textures(bsp_handle handle, std::span<wad::wad_handle> resources) {
-        auto& info = *reinterpret_cast<bsp_info*>(handle);
-        info.resources = resources;
+    void read_texture_directory(bsp_file &file) {
+        auto* texture_lump_begin = reinterpret_cast<const uint8_t*>(file.lump_begins[lump_type::LUMP_TEXTURES]);
+        auto* texture_lump_end = reinterpret_cast<const uint8_t*>(file.lump_ends[lump_type::LUMP_TEXTURES]);
 
-        auto* texture_lump_begin = reinterpret_cast<const uint8_t*>(info.lump_begins[lump_type::LUMP_TEXTURES]);
-        auto* texture_lump_end = reinterpret_cast<const uint8_t*>(info.lump_ends[lump_type::LUMP_TEXTURES]);
+        if (texture_lump_begin + sizeof(lump_texture_header) > texture_lump_end)
+            return;
 
         auto* texture_header = reinterpret_cast<const lump_texture_header*>(texture_lump_begin);
-        uint32_t texture_header_length = sizeof(lump_texture_header) + (texture_header->mip_texture_count - 1) * sizeof(uint32_t);
         auto* texture_begin = texture_lump_begin + sizeof(lump_texture_header);
-        auto* texture_end = texture_lump_begin + texture_header_length;
+        auto* texture_end = texture_begin + static_cast<size_t>(texture_header->mip_texture_count) * sizeof(uint32_t);
 
         if (texture_end > texture_lump_end)
             throw std::runtime_error("Texture header extends beyond end of lump");
 
-        for (; texture_begin < texture_end; texture_begin += sizeof(uint32_t)) {
-            auto texture_offset = *reinterpret_cast<const uint32_t*>(texture_begin);
-            auto* mip_texture = reinterpret_cast<const uint8_t*>(texture_lump_begin + texture_offset);
-            auto* mip_texture_handle = reinterpret_cast<const lump_mip_texture*>(mip_texture);
-
-            if (reinterpret_cast<const uint8_t*>(mip_texture) > texture_lump_end)
-                throw std::runtime_error("Mip texture extends beyond end of lump");
-
-            auto texture_data_end = texture_lump_end;
-            if (mip_texture_handle->offsets[0] & mip_texture_handle->offsets[1]
-                & mip_texture_handle->offsets[2] & mip_texture_handle->offsets[3]) {
-                // Texture is internal, do nothing
-            } else {
-                // Texture is external, load it
-                auto texture = lookup_texture(handle, mip_texture_handle->name, resources);
-                mip_texture = texture.first;
-                size_t texture_size = texture.second;
-
-                if (mip_texture == nullptr) {
-                    //throw std::runtime_error(std::format("Could not find texture '{}'", mip_texture_handle->name));
-                    std::cout << std::format("Could not find texture '{}'\n", mip_texture_handle->name);
-                    continue;
-                }
-
-                texture_data_end = mip_texture + texture_size;
-
-                mip_texture_handle = reinterpret_cast<const lump_mip_texture*>(mip_texture);
-            }
+        auto texture_offsets = std::span(reinterpret_cast<const uint32_t*>(texture_begin), texture_header->mip_texture_count);
 
-            const uint32_t texel_count = mip_texture_handle->width * mip_texture_handle->height;
-            auto color_data = mip_texture + mip_texture_handle->offsets[3] + texel_count / 64 + 2;
+        file.texture_directory = std::vector<bsp_file::texture_entry>(texture_offsets.size());
+        file.texture_ids.reserve(texture_offsets.size());
 
-            if (color_data + 256 > texture_data_end)
-                throw std::runtime_error("Color data extends beyond end of lump");
-
-            const uint32_t texture_width  = mip_texture_handle->width;
-            const uint32_t texture_height = mip_texture_handle->height;
-            const uint8_t* texture_data = mip_texture + mip_texture_handle->offsets[0];
+        for (uint32_t texture_id = 0; texture_id < texture_offsets.size(); ++texture_id) {
+            auto* mip_texture = texture_lump_begin + texture_offsets[texture_id];
+            auto* mip_texture_handle = reinterpret_cast<const lump_mip_texture*>(mip_texture);
 
-            if (texture_data + texel_count > color_data)
-                throw std::runtime_error("Texture data extends beyond color data");
+            if (mip_texture + sizeof(lump_mip_texture) > texture_lump_end)
+                throw std::runtime_error("Mip texture extends beyond end of lump");
 
-            std::vector<glm::u8vec3> texture_data_vec(texel_count);
+            auto& entry = file.texture_directory[texture_id];
+            entry.name = std::string_view(mip_texture_handle->name, strnlen(mip_texture_handle->name, lump_mip_texture::max_texture_name));
+            entry.size = glm::u32vec2(mip_texture_handle->width, mip_texture_handle->height);
+            entry.flags = get_texture_name_flags(entry.name);
 
-            for (uint32_t y = 0; y < texture_height; ++y) {
-                for (uint32_t x = 0; x < texture_width; ++x) {
-                    uint32_t pixel_index = y * texture_width + x;
-                    uint8_t index = texture_data[pixel_index];
-                    glm::u8vec3 texel;
-                    texel.r = color_data[index * 3 + 0];
-                    texel.g = color_data[index * 3 + 1];
-                    texel.b = color_data[index * 3 + 2];
-                    texture_data_vec[pixel_index] = texel;
-                }
-            }
+            // External textures have no mip levels in the level, they are looked up in the wads
+            if (mip_texture_handle->offsets[0] & mip_texture_handle->offsets[1]
+                & mip_texture_handle->offsets[2] & mip_texture_handle->offsets[3])
+                entry.mip_texture = mip_texture;
 
-            info.loaded_textures.emplace_back(std::move(texture_data_vec), glm::u32vec2(texture_width, texture_height));
-
-            /*
-            for (int i = 0; i < lump_mip_texture::mip_levels; ++i) {
-                const uint32_t texture_width  = mip_texture_handle->width >> (i * 2);
-                const uint32_t texture_height = mip_texture_handle->height >> (i * 2);
-                const uint32_t texture_length = texel_count >> (i * 2);
-                const uint8_t* texture_data = mip_texture + mip_texture_handle->offsets[i];
-
-                if (texture_data + texture_length > color_data)
-                    throw std::runtime_error("Texture data extends beyond color data");
-
-                auto file = std::ofstream(std::format("textures/texture_{}_{}.ppm", a, i), std::ios::out);
-                file << "P3\n";
-                file << texture_width << " " << texture_height << "\n255";
-                for (uint32_t y = 0; y < texture_height; ++y) {
-                    for (uint32_t x = 0; x < texture_width; ++x) {
-                        uint8_t index = texture_data[y * texture_width + x];
-                        uint8_t r = color_data[index * 3 + 0];
-                        uint8_t g = color_data[index * 3 + 1];
-                        uint8_t b = color_data[index * 3 + 2];
-                        file << "\n" << +r << " " << +g << " " << +b;
-                    }
-                }
-            }
-             */
+            // Names are not unique in every level, the first texture wins
+            file.texture_ids.try_emplace(entry.name, texture_id);
         }
     }
 
-    texture get_texture_data(bsp_handle handle, std::string_view texture_name) {
+    void load_textures(bsp_handle handle, std::span<wad::wad_handle> resources) {
+        VOXLIFE_TRACE_ZONE("load_textures");
         auto& info = *reinterpret_cast<bsp_info*>(handle);
+        info.caches.resources = resources;
+
+        for (uint32_t texture_id = 0; texture_id < info.file.texture_directory.size(); ++texture_id) {
+            auto& entry = info.file.texture_directory[texture_id];
+            if (entry.mip_texture != nullptr)
+                continue;
+
+            auto resource = std::find_if(resources.begin(), resources.end(), [&](wad::wad_handle resource) {
+                return wad::get_entry(resource, entry.name) != nullptr;
+            });
+
+            auto& cache_entry = info.caches.textures[texture_id];
+            if (resource == resources.end()) {
+                //throw std::runtime_error(std::format("Could not find texture '{}'", entry.name));
+                std::cout << std::format("Could not find texture '{}'\n", entry.name);
+                cache_entry.flags |= TEXTURE_MISSING;
+                continue;
+            }
 
-        // fast path: texture is part of the level and already loaded
-        uint32_t texture_id = get_texture_id(handle, texture_name);
-        if (texture_id && texture_id < info.loaded_textures.size()) {
-            auto& texture = info.loaded_textures[texture_id];
-            return { texture.data, texture.size };
+            cache_entry.resource = *resource;
         }
+    }
 
-        // slow path: texture is not part of the level, load it
-        auto texture = lookup_texture(handle, texture_name, info.resources);
-        auto mip_texture = texture.first;
-        size_t texture_size = texture.second;
+    // Stands in for textures that could not be found, so callers always get a valid image
+    const glm::u8vec4 missing_texel = glm::u8vec4(255, 0, 255, 255);
 
-        if (mip_texture == nullptr) {
-            //throw std::runtime_error(std::format("Could not find texture '{}'", mip_texture_handle->name));
-            std::cout << std::format("Could not find texture '{}'\n", texture_name);
+    texture get_missing_texture() {
+        return { std::span(&missing_texel, 1), glm::u32vec2(1) };
+    }
 
-            auto& loaded_texture = info.loaded_textures.front();
-            return { loaded_texture.data, loaded_texture.size };
-        }
+    // Decodes the texture on first access, safe to call from multiple threads
+    texture get_loaded_texture(bsp_info &info, uint32_t texture_id) {
+        if (texture_id >= info.file.texture_directory.size())
+            return get_missing_texture();
+
+        auto& entry = info.file.texture_directory[texture_id];
+        auto& cache_entry = info.caches.textures[texture_id];
+        std::call_once(cache_entry.decode_flag, [&]() {
+            if (entry.mip_texture != nullptr) {
+                auto* texture_lump_end = reinterpret_cast<const uint8_t*>(info.file.lump_ends[lump_type::LUMP_TEXTURES]);
+                auto texture = wad::decode_mip_texture(entry.mip_texture, texture_lump_end - entry.mip_texture);
+
+                cache_entry.storage = std::move(texture.data);
+                cache_entry.data = std::span(cache_entry.storage).first(static_cast<size_t>(texture.size.x) * texture.size.y);
+                cache_entry.size = texture.size;
+            } else if (cache_entry.resource != nullptr) {
+                auto texture = wad::get_texture(cache_entry.resource, entry.name);
+                cache_entry.data = texture.data;
+                cache_entry.size = texture.size;
+            }
+        });
 
-        auto texture_data_end = mip_texture + texture_size;
+        if (cache_entry.data.empty())
+            return get_missing_texture();
 
-        auto mip_texture_handle = reinterpret_cast<const lump_mip_texture*>(mip_texture);
+        return { cache_entry.data, cache_entry.size };
+    }
 
-        const uint32_t texel_count = mip_texture_handle->width * mip_texture_handle->height;
-        auto color_data = mip_texture + mip_texture_handle->offsets[3] + texel_count / 64 + 2;
+    void prefetch_textures(bsp_handle handle, std::span<const uint32_t> texture_ids) {
+        auto& info = *reinterpret_cast<bsp_info*>(handle);
 
-        if (color_data + 256 > texture_data_end)
-            throw std::runtime_error("Color data extends beyond end of lump");
+        std::exception_ptr decode_error;
+        std::mutex decode_error_mutex;
+
+#pragma omp parallel for schedule(dynamic)
+        for (int64_t i = 0; i < static_cast<int64_t>(texture_ids.size()); ++i) {
+            try {
+                get_loaded_texture(info, texture_ids[i]);
+            } catch (...) {
+                std::lock_guard lock(decode_error_mutex);
+                if (!decode_error)
+                    decode_error = std::current_exception();
+            }
+        }
 
-        const uint32_t texture_width  = mip_texture_handle->width;
-        const uint32_t texture_height = mip_texture_handle->height;
-        const uint8_t* texture_data = mip_texture + mip_texture_handle->offsets[0];
+        if (decode_error)
+            std::rethrow_exception(decode_error);
+    }
 
-        if (texture_data + texel_count > color_data)
-            throw std::runtime_error("Texture data extends beyond color data");
+    texture get_texture_data(bsp_handle handle, std::string_view texture_name) {
+        auto& info = *reinterpret_cast<bsp_info*>(handle);
+
+        // fast path: texture is part of the level
+        auto it = info.file.texture_ids.find(texture_name);
+        if (it != info.file.texture_ids.end() && !(info.caches.textures[it->second].flags & TEXTURE_MISSING))
+            return get_loaded_texture(info, it->second);
 
-        std::vector<glm::u8vec3> texture_data_vec(texel_count);
+        {
+            std::lock_guard lock(info.caches.named_textures_mutex);
+            auto cached_it = info.caches.named_textures.find(texture_name);
+            if (cached_it != info.caches.named_textures.end())
+                return cached_it->second;
+        }
 
-        for (uint32_t y = 0; y < texture_height; ++y) {
-            for (uint32_t x = 0; x < texture_width; ++x) {
-                uint32_t pixel_index = y * texture_width + x;
-                uint8_t index = texture_data[pixel_index];
-                glm::u8vec3 texel;
-                texel.r = color_data[index * 3 + 0];
-                texel.g = color_data[index * 3 + 1];
-                texel.b = color_data[index * 3 + 2];
-                texture_data_vec[pixel_index] = texel;
+        // slow path: texture is not part of the level, take it from the decoded wad textures.
+        // The wads decode outside of the lock, if another thread was faster its result is kept instead.
+        auto result = get_missing_texture();
+        for (auto& resource : info.caches.resources) {
+            auto texture = wad::get_texture(resource, texture_name);
+            if (!texture.data.empty()) {
+                result = { texture.data, texture.size };
+                break;
             }
         }
 
-        auto& loaded_texture = info.loaded_textures.front();
-        return { loaded_texture.data, loaded_texture.size };
+        std::lock_guard lock(info.caches.named_textures_mutex);
+        auto [cached_it, inserted] = info.caches.named_textures.try_emplace(std::string(texture_name), result);
+        if (inserted && cached_it->second.data.data() == &missing_texel) {
+            //throw std::runtime_error(std::format("Could not find texture '{}'", texture_name));
+            std::cout << std::format("Could not find texture '{}'\n", texture_name);
+        }
+
+        return cached_it->second;
     }
 
     texture get_texture_data(bsp_handle handle, uint32_t texture_id) {
         auto& info = *reinterpret_cast<bsp_info*>(handle);
-
-        if (texture_id < info.loaded_textures.size()) {
-            auto& texture = info.loaded_textures[texture_id];
-            return { texture.data, texture.size };
-        }
-
-        auto& texture = info.loaded_textures.front();
-        return { texture.data, texture.size };
+        return get_loaded_texture(info, texture_id);
     }
 
     std::string_view get_texture_name(bsp_handle handle, uint32_t texture_id) {
-        auto &info = *reinterpret_cast<bsp_info *>(handle);
-
-        auto* texture_lump_begin = reinterpret_cast<const uint8_t*>(info.lump_begins[lump_type::LUMP_TEXTURES]);
-        auto* texture_lump_end = reinterpret_cast<const uint8_t*>(info.lump_ends[lump_type::LUMP_TEXTURES]);
-
-        auto* texture_header = reinterpret_cast<const lump_texture_header*>(texture_lump_begin);
-        uint32_t texture_header_length = sizeof(lump_texture_header) + (texture_header->mip_texture_count - 1) * sizeof(uint32_t);
-        auto* texture_begin = texture_lump_begin + sizeof(lump_texture_header);
-        auto* texture_end = texture_lump_begin + texture_header_length;
-
-        if (texture_end > texture_lump_end)
-            throw std::runtime_error("Texture header extends beyond end of lump");
-
-        auto texture_indices = std::span<const uint32_t>(reinterpret_cast<const uint32_t*>(texture_begin), texture_header_length);
-        auto texture_index = span_at(texture_indices, texture_id);
-
-        auto *mip_texture_handle = reinterpret_cast<const lump_mip_texture *>(texture_lump_begin + texture_index);
-        uint32_t string_length = strnlen(mip_texture_handle->name, lump_mip_texture::max_texture_name);
-        std::string_view texture_name = std::string_view(mip_texture_handle->name, string_length);
-
-        return { mip_texture_handle->name, string_length };
+        const auto& file = reinterpret_cast<bsp_info*>(handle)->file;
+        return span_at(std::span(file.texture_directory), texture_id).name;
     }
 
     uint32_t get_texture_id(bsp_handle handle, std::string_view name) {
-        auto& info = *reinterpret_cast<bsp_info*>(handle);
-
-        auto* texture_lump_begin = reinterpret_cast<const uint8_t*>(info.lump_begins[lump_type::LUMP_TEXTURES]);
-        auto* texture_lump_end = reinterpret_cast<const uint8_t*>(info.lump_ends[lump_type::LUMP_TEXTURES]);
+        const auto& file = reinterpret_cast<bsp_info*>(handle)->file;
 
-        auto* texture_header = reinterpret_cast<const lump_texture_header*>(texture_lump_begin);
-        uint32_t texture_header_length = sizeof(lump_texture_header) + (texture_header->mip_texture_count - 1) * sizeof(uint32_t);
-        auto* texture_begin = texture_lump_begin + sizeof(lump_texture_header);
-        auto* texture_end = texture_lump_begin + texture_header_length;
+        auto it = file.texture_ids.find(name);
+        if (it == file.texture_ids.end())
+            return 0;
 
-        if (texture_end > texture_lump_end)
-            throw std::runtime_error("Texture header extends beyond end of lump");
-
-        uint32_t texture_id = 0;
-        for (; texture_begin < texture_end; texture_begin += sizeof(uint32_t)) {
-            auto texture_offset = *reinterpret_cast<const uint32_t *>(texture_begin);
-            auto *mip_texture_handle = reinterpret_cast<const lump_mip_texture *>(texture_lump_begin + texture_offset);
-            uint32_t string_length = strnlen(mip_texture_handle->name, lump_mip_texture::max_texture_name);
-            std::string_view texture_name = std::string_view(mip_texture_handle->name, string_length);
+        return it->second;
+    }
 
-            if (texture_name == name)
-                return texture_id;
+    uint32_t get_texture_count(bsp_handle handle) {
+        const auto& file = reinterpret_cast<bsp_info*>(handle)->file;
+        return static_cast<uint32_t>(file.texture_directory.size());
+    }
 
-            texture_id++;
-        }
+    uint32_t get_texture_flags(bsp_handle handle, uint32_t texture_id) {
+        auto& info = *reinterpret_cast<bsp_info*>(handle);
+        auto flags = span_at(std::span(info.file.texture_directory), texture_id).flags;
+        return flags | info.caches.textures[texture_id].flags;
+    }
 
-        return 0;
+    glm::u32vec2 get_texture_size(bsp_handle handle, uint32_t texture_id) {
+        const auto& file = reinterpret_cast<bsp_info*>(handle)->file;
+        return span_at(std::span(file.texture_directory), texture_id).size;
     }
 
     aabb get_model_aabb(bsp_handle handle, uint32_t model_id) {
-        auto& info = *reinterpret_cast<bsp_info*>(handle);
-
-        const auto& root_model = span_at(info.models, model_id);
-        const auto& root_node = span_at(info.nodes, root_model.head_nodes[0]);
+        const auto& file = reinterpret_cast<bsp_info*>(handle)->file;
 
+        const auto& root_model = span_at(file.models, model_id);
         return { root_model.min, root_model.max };
     }
 
-    std::vector<face> get_model_faces(bsp_handle handle, uint32_t model_id) {
-        auto& info = *reinterpret_cast<bsp_info*>(handle);
-
-        const auto& root_model = span_at(info.models, model_id);
-        const auto& root_node = span_at(info.nodes, root_model.head_nodes[0]);
-
-        std::vector<lump_face> bsp_faces;
-        auto face_span = safe_subspan(info.faces, root_model.first_face, root_model.face_count);
-        bsp_faces.insert(bsp_faces.end(), face_span.begin(), face_span.end());
+    // Every index was checked by validate_lumps when the file was opened
+    void build_model_faces(const bsp_file &file, const lump_model &model, bsp_caches::face_arena_storage &faces) {
+        auto& lumps = file.validated;
+        auto bsp_faces = lumps.get_model_faces(model);
 
-        /*
-        std::stack<lump_node> node_stack;
-        node_stack.push(root_node);
+        size_t vertex_count = 0;
+        for (auto& face : bsp_faces)
+            vertex_count += face.edge_count;
 
-        uint32_t node_count = 0;
-        uint32_t leaf_count = 0;
-        uint32_t face_count = 0;
+        faces.vertices.reserve(vertex_count);
+        faces.first_vertices.reserve(bsp_faces.size());
+        faces.vertex_counts.reserve(bsp_faces.size());
+        faces.normals.reserve(bsp_faces.size());
+        faces.distances.reserve(bsp_faces.size());
+        faces.texture_ids.reserve(bsp_faces.size());
+        faces.texture_s.reserve(bsp_faces.size());
+        faces.texture_t.reserve(bsp_faces.size());
 
-        while (!node_stack.empty()) {
-            auto &node = node_stack.top();
-            node_stack.pop();
-
-            //auto node_face_span = safe_subspan(info.faces, node.first_face, node.face_count);
-            //bsp_faces.insert(bsp_faces.end(), node_face_span.begin(), node_face_span.end());
-
-            for (auto& child_node : node.children) {
-                std::span<const lump_mark_surface> mark_surfaces;
+        for (auto& face : bsp_faces) {
+            auto& plane = lumps.get_plane(face);
 
-                if (child_node > 0) {
-                    node_count++;
-                    node_stack.push(span_at(info.nodes, child_node));
-                    continue;
-                }
+            faces.first_vertices.push_back(static_cast<uint32_t>(faces.vertices.size()));
+            faces.vertex_counts.push_back(face.edge_count);
 
-                if (child_node == -1)
-                    continue;
+            for (auto& surface_edge : lumps.get_surface_edges(face))
+                faces.vertices.push_back(lumps.get_vertex(surface_edge));
 
-                leaf_count++;
-                auto& leaf = span_at(info.leafs, ~child_node);
-                mark_surfaces = safe_subspan(info.mark_surfaces, leaf.first_mark_surface, leaf.mark_surface_count);
+            float side = face.side != 0 ? -1.0f : 1.0f;
+            faces.normals.push_back(plane.normal * side);
+            faces.distances.push_back(plane.dist * side);
 
-                face_count += leaf.mark_surface_count;
+            auto& texture_info = lumps.get_texture_info(face);
+            faces.texture_ids.push_back(texture_info.mip_texture);
 
-                for (auto& mark_surface : mark_surfaces) {
-                    auto &face = span_at(info.faces, mark_surface.face);
+            glm::vec2 texture_size(1.0f);
+            if (texture_info.mip_texture < file.texture_directory.size())
+                texture_size = glm::max(glm::vec2(file.texture_directory[texture_info.mip_texture].size), glm::vec2(1.0f));
 
-                    bsp_faces.push_back(face);
-                }
-            }
+            faces.texture_s.push_back(glm::vec4(texture_info.s, texture_info.shift_s) / texture_size.x);
+            faces.texture_t.push_back(glm::vec4(texture_info.t, texture_info.shift_t) / texture_size.y);
         }
-         */
-
-        std::vector<face> faces;
-
-        for (auto& face : bsp_faces) {
-            auto& plane = span_at(info.planes, face.plane);
-
-            std::vector<glm::vec3> vertices;
-            auto surface_edges = safe_subspan(info.surface_edges, face.first_edge, face.edge_count);
-
-            for (auto& surface_edge : surface_edges) {
-                auto edge = span_at(info.edges, std::abs(surface_edge.edge));
-                uint16_t vertex_index = surface_edge.edge < 0 ? edge.vertex[0] : edge.vertex[1];
+    }
 
-                auto& vertex = span_at(info.vertices, vertex_index);
-                vertices.push_back(vertex);
-            }
+    face_arena get_model_faces(bsp_handle handle, uint32_t model_id) {
+        auto& info = *reinterpret_cast<bsp_info*>(handle);
 
-            auto& texture_info = span_at(info.texture_infos, face.texture_info);
-            glm::vec<2, face::texture_position> texture_coords{};
-            texture_coords.x.axis = texture_info.s;
-            texture_coords.x.shift = texture_info.shift_s;
-            texture_coords.y.axis = texture_info.t;
-            texture_coords.y.shift = texture_info.shift_t;
-
-            faces.emplace_back(
-                    static_cast<face::type>(plane.type),
-                    texture_coords,
-                    texture_info.mip_texture,
-                    plane.normal,
-                    std::move(vertices)
-                    );
-        }
+        const auto& model = span_at(info.file.models, model_id);
+        auto& faces = info.caches.model_faces[model_id];
+        std::call_once(faces.build_flag, [&]() {
+            // Only a complete build reaches the cache, a throw leaves it empty and the next call builds again
+            bsp_caches::face_arena_storage built;
+            build_model_faces(info.file, model, built);
+
+            faces.vertices = std::move(built.vertices);
+            faces.first_vertices = std::move(built.first_vertices);
+            faces.vertex_counts = std::move(built.vertex_counts);
+            faces.normals = std::move(built.normals);
+            faces.distances = std::move(built.distances);
+            faces.texture_ids = std::move(built.texture_ids);
+            faces.texture_s = std::move(built.texture_s);
+            faces.texture_t = std::move(built.texture_t);
+        });
+
+        return {
+            .vertices = faces.vertices,
+            .first_vertices = faces.first_vertices,
+            .vertex_counts = faces.vertex_counts,
+            .normals = faces.normals,
+            .distances = faces.distances,
+            .texture_ids = faces.texture_ids,
+            .texture_s = faces.texture_s,
+            .texture_t = faces.texture_t,
+        };
+    }
 
-        return faces;
+    void unmap_file(bsp_file &file) {
+#if defined(_WIN32)
+        UnmapViewOfFile(file.file_data);
+        CloseHandle(file.hMap);
+        CloseHandle(file.hFile);
+#else
+        munmap(const_cast<void*>(reinterpret_cast<const void*>(file.file_data)), file.file_size);
+        close(file.bsp_file);
+#endif
+        memory::remove_mapped_bytes(file.file_size);
     }
 
     void open_file(std::string_view file_path, bsp_handle* handle) {
-        *handle = reinterpret_cast<bsp_handle>(new bsp_info{});
-        auto& info = reinterpret_cast<bsp_info&>(**handle);
+        VOXLIFE_TRACE_ZONE("open bsp");
+        *handle = nullptr;
+
+        // Only handed out once the file passed every check, a rejected file leaves nothing open
+        auto info_storage = std::make_unique<bsp_info>();
+        auto& info = *info_storage;
+        auto& file = info.file;
 
 
 #if defined(_WIN32)
@@ -456,81 +460,94 @@ namespace voxlife::bsp {
         LPVOID lpBasePtr;
         LARGE_INTEGER liFileSize;
 
-        info.hFile = CreateFile(file_path.data(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        file.hFile = CreateFile(file_path.data(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
 
-        if (info.hFile == INVALID_HANDLE_VALUE) {
+        if (file.hFile == INVALID_HANDLE_VALUE) {
             auto err = GetLastError();
             throw std::runtime_error(std::format("CreateFile failed with error '{}'", err));
         }
 
-        if (!GetFileSizeEx(info.hFile, &liFileSize)) {
+        if (!GetFileSizeEx(file.hFile, &liFileSize)) {
             auto err = GetLastError();
-            CloseHandle(info.hFile);
+            CloseHandle(file.hFile);
             throw std::runtime_error(std::format("GetFileSize failed with error '{}'", err));
         }
 
         if (liFileSize.QuadPart == 0) {
-            CloseHandle(info.hFile);
+            CloseHandle(file.hFile);
             throw std::runtime_error(std::format("File is empty '{}'", file_path));
         }
 
-        info.hMap = CreateFileMapping(info.hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        file.hMap = CreateFileMapping(file.hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
 
-        if (info.hMap == 0) {
+        if (file.hMap == 0) {
             auto err = GetLastError();
-            CloseHandle(info.hFile);
+            CloseHandle(file.hFile);
             throw std::runtime_error(std::format("CreateFileMapping failed with error '{}'", err));
         }
 
-        lpBasePtr = MapViewOfFile(info.hMap, FILE_MAP_READ, 0, 0, 0);
+        lpBasePtr = MapViewOfFile(file.hMap, FILE_MAP_READ, 0, 0, 0);
 
         if (lpBasePtr == nullptr) {
             auto err = GetLastError();
-            CloseHandle(info.hMap);
-            CloseHandle(info.hFile);
+            CloseHandle(file.hMap);
+            CloseHandle(file.hFile);
             throw std::runtime_error(std::format("MapViewOfFile failed with error '{}'", err));
         }
 
-        info.file_size = liFileSize.QuadPart;
-        info.file_data = reinterpret_cast<uint8_t*>(lpBasePtr);
+        file.file_size = liFileSize.QuadPart;
+        file.file_data = reinterpret_cast<uint8_t*>(lpBasePtr);
 
 #else
 
-        info.bsp_file = open(file_path.data(), O_RDONLY);
-        if (info.bsp_file < 0)
+        file.bsp_file = open(file_path.data(), O_RDONLY);
+        if (file.bsp_file < 0)
             throw std::runtime_error(std::format("Could not open file '{}'", file_path));
 
         struct stat st{};
-        if (fstat(info.bsp_file, &st) < 0)
+        if (fstat(file.bsp_file, &st) < 0) {
+            close(file.bsp_file);
             throw std::runtime_error(std::format("Could not stat file '{}'", file_path));
+        }
 
-        info.file_size = st.st_size;
+        file.file_size = st.st_size;
 
-        void* data = mmap(nullptr, info.file_size, PROT_READ, MAP_PRIVATE | MAP_FILE, info.bsp_file, 0);
-        if (data == MAP_FAILED)
+        void* data = mmap(nullptr, file.file_size, PROT_READ, MAP_PRIVATE | MAP_FILE, file.bsp_file, 0);
+        if (data == MAP_FAILED) {
+            close(file.bsp_file);
             throw std::runtime_error(std::format("Could not mmap file '{}'", file_path));
+        }
 
-        if (madvise(data, info.file_size, MADV_RANDOM | MADV_WILLNEED | MADV_HUGEPAGE) < 0)
+        if (madvise(data, file.file_size, MADV_RANDOM | MADV_WILLNEED | MADV_HUGEPAGE) < 0) {
+            munmap(data, file.file_size);
+            close(file.bsp_file);
             throw std::runtime_error(std::format("Could not madvise file '{}'", file_path));
+        }
 
-        info.file_data = reinterpret_cast<uint8_t*>(data);
+        file.file_data = reinterpret_cast<uint8_t*>(data);
 
 #endif
 
-        parse_header(info);
+        memory::add_mapped_bytes(file.file_size);
+        try {
+            parse_header(file);
+            read_texture_directory(file);
+            file.validated = validate_lumps(file);
+
+            info.caches.textures = std::vector<bsp_caches::texture_entry>(file.texture_directory.size());
+            info.caches.model_faces = std::vector<bsp_caches::face_arena_storage>(file.models.size());
+        } catch (...) {
+            unmap_file(file);
+            throw;
+        }
 
-        //read_map(info);
+        //read_map(file);
+        *handle = reinterpret_cast<bsp_handle>(info_storage.release());
     }
 
     void release(bsp_handle handle) {
-        auto& info = reinterpret_cast<bsp_info&>(*handle);
-#if defined(_WIN32)
-        CloseHandle(info.hMap);
-        CloseHandle(info.hFile);
-#else
-        munmap(const_cast<void*>(reinterpret_cast<const void*>(info.file_data)), info.file_size);
-        close(info.bsp_file);
-#endif
-        delete reinterpret_cast<bsp_info*>(handle);
+        auto* info = reinterpret_cast<bsp_info*>(handle);
+        unmap_file(info->file);
+        delete info;
     }
 }
\ No newline at end of file
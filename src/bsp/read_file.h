@@ -10,40 +10,60 @@
 
 #include <glm/vec3.hpp>
 #include <glm/vec2.hpp>
+#include <glm/vec4.hpp>
 
 
 namespace voxlife::bsp {
 
     typedef struct bsp_handle_T *bsp_handle;
 
+    // open_file, load_textures and release need exclusive access to the handle. Every other function may be called
+    // from any number of threads on one handle at the same time, results built on first use are built exactly once.
+    // Returned spans and string views stay valid until release.
     void open_file(std::string_view filename, bsp_handle* handle);
     void release(bsp_handle handle);
     void load_textures(bsp_handle handle, std::span<wad::wad_handle> resources);
 
-    struct face {
-        enum type : int32_t {
-            PLANE_X     = 0,
-            PLANE_Y     = 1,
-            PLANE_Z     = 2,
-            PLANE_ANYX  = 3,
-            PLANE_ANYY  = 4,
-            PLANE_ANYZ  = 5
-        } facing;
-
-        struct texture_position {
-            glm::vec3 axis;
-            float shift;
-        };
-
-        glm::vec<2, texture_position> texture_coords;
-        uint32_t texture_id;
+    // Faces of one model as flat arrays, indexed by the face id within the model
+    struct face_arena {
+        std::span<const glm::vec3> vertices;        // polygons of all faces back to back, in winding order
+        std::span<const uint32_t>  first_vertices;
+        std::span<const uint32_t>  vertex_counts;
+        std::span<const glm::vec3> normals;         // plane of the face, already flipped for back facing faces
+        std::span<const float>     distances;
+        std::span<const uint32_t>  texture_ids;
+        std::span<const glm::vec4> texture_s;       // axis and shift, already divided by the texture size
+        std::span<const glm::vec4> texture_t;
+
+        size_t size() const {
+            return texture_ids.size();
+        }
+
+        std::span<const glm::vec3> get_vertices(uint32_t face_id) const {
+            return vertices.subspan(first_vertices[face_id], vertex_counts[face_id]);
+        }
+
+        // Normalized texture coordinates of a point on the face
+        glm::vec2 get_uv(uint32_t face_id, glm::vec3 pos) const {
+            return {
+                texture_s[face_id].x * pos.x + texture_s[face_id].y * pos.y + texture_s[face_id].z * pos.z + texture_s[face_id].w,
+                texture_t[face_id].x * pos.x + texture_t[face_id].y * pos.y + texture_t[face_id].z * pos.z + texture_t[face_id].w,
+            };
+        }
+    };
 
-        glm::vec3 normal;
-        std::vector<glm::vec3> vertices;
+    enum texture_flags : uint32_t {
+        TEXTURE_SKY          = 1 << 0,
+        TEXTURE_WATER        = 1 << 1,  // '!' prefix
+        TEXTURE_ALPHA_MASKED = 1 << 2,  // '{' prefix, the last palette entry is transparent
+        TEXTURE_TRIGGER      = 1 << 3,
+        TEXTURE_CLIP         = 1 << 4,
+        TEXTURE_ORIGIN       = 1 << 5,
+        TEXTURE_MISSING      = 1 << 6,  // external texture that is in none of the wads
     };
 
     struct texture {
-        std::span<glm::u8vec3> data;
+        std::span<const glm::u8vec4> data;
 
         glm::u32vec2 size;
     };
@@ -62,12 +82,26 @@ namespace voxlife::bsp {
         glm::vec3 max;
     };
 
-    std::vector<face> get_model_faces(bsp_handle handle, uint32_t model_id);
+    // Built on first use and owned by the handle, every later call returns the same arrays
+    face_arena get_model_faces(bsp_handle handle, uint32_t model_id);
+
+    // Ids into the face arena of every face whose bounds touch the box, in ascending order.
+    // The first query of a model builds a bounding volume hierarchy over its faces.
+    void get_model_faces_in_aabb(bsp_handle handle, uint32_t model_id, const aabb &bounds, std::vector<uint32_t> &face_ids);
+
+    // Contents of the hull 0 leaf each point falls into, one of the lump_leaf::contents values
+    void get_point_contents(bsp_handle handle, std::span<const glm::vec3> points, std::span<int32_t> contents);
     aabb get_model_aabb(bsp_handle handle, uint32_t model_id);
     texture get_texture_data(bsp_handle handle, uint32_t texture_id);
     texture get_texture_data(bsp_handle handle, std::string_view texture_id);
     std::string_view get_texture_name(bsp_handle handle, uint32_t texture_id);
     uint32_t get_texture_id(bsp_handle handle, std::string_view name);
+    uint32_t get_texture_count(bsp_handle handle);
+    uint32_t get_texture_flags(bsp_handle handle, uint32_t texture_id);
+    glm::u32vec2 get_texture_size(bsp_handle handle, uint32_t texture_id);
+
+    // Texels are decoded on first access, this decodes the given textures up front and in parallel
+    void prefetch_textures(bsp_handle handle, std::span<const uint32_t> texture_ids);
     std::vector<entity> get_entities(bsp_handle handle);
 }
 
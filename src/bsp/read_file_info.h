@@ -3,19 +3,89 @@
 #define VOXLIFE_READ_FILE_INFO_H
 
 #include <bsp/primitives.h>
+#include <bsp/read_file.h>
 #include <wad/read_file.h>
+#include <utils/case_insensitive.h>
 
 #include <glm/vec2.hpp>
+#include <glm/vec4.hpp>
 
+#include <string>
 #include <string_view>
 #include <span>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <unordered_map>
 
 
 namespace voxlife::bsp {
 
-    struct bsp_info {
+    struct bsp_file;
+
+    // Lumps whose cross references were all checked by validate_lumps, the accessors index them without bounds checks.
+    // Only validate_lumps creates a non-empty view, so holding one proves the file passed validation.
+    class validated_view {
+    public:
+        validated_view() = default;
+
+        std::span<const lump_face> get_model_faces(const lump_model &model) const {
+            return faces.subspan(static_cast<size_t>(model.first_face), static_cast<size_t>(model.face_count));
+        }
+
+        std::span<const lump_surf_edge> get_surface_edges(const lump_face &face) const {
+            return surface_edges.subspan(face.first_edge, face.edge_count);
+        }
+
+        // Vertex the surface edge starts from, the sign of the edge gives its direction
+        const lump_vertex &get_vertex(lump_surf_edge surface_edge) const {
+            auto &edge = edges[static_cast<size_t>(surface_edge.edge < 0 ? -surface_edge.edge : surface_edge.edge)];
+            return vertices[surface_edge.edge < 0 ? edge.vertex[0] : edge.vertex[1]];
+        }
+
+        const lump_plane &get_plane(const lump_face &face) const {
+            return planes[face.plane];
+        }
+
+        const lump_texture_info &get_texture_info(const lump_face &face) const {
+            return texture_infos[face.texture_info];
+        }
+
+        std::span<const lump_node> get_nodes() const {
+            return nodes;
+        }
+
+        std::span<const lump_plane> get_planes() const {
+            return planes;
+        }
+
+        std::span<const lump_leaf> get_leafs() const {
+            return leafs;
+        }
+
+    private:
+        friend validated_view validate_lumps(const bsp_file &file);
+
+        std::span<const lump_plane>        planes;
+        std::span<const lump_vertex>       vertices;
+        std::span<const lump_node>         nodes;
+        std::span<const lump_texture_info> texture_infos;
+        std::span<const lump_face>         faces;
+        std::span<const lump_leaf>         leafs;
+        std::span<const lump_edge>         edges;
+        std::span<const lump_surf_edge>    surface_edges;
+    };
+
+    // Checks every index one lump holds into another: faces to planes, texinfos and surfedges, surfedges to edges,
+    // edges to vertices, nodes to planes, nodes, leafs and faces, leafs to marksurfaces, marksurfaces to faces,
+    // clipnodes to planes and clipnodes, and models to faces, nodes and clipnodes. Throws std::runtime_error
+    // naming the first bad reference. Texinfos may still name a texture outside the texture lump, every texture
+    // lookup handles that as a missing texture.
+    validated_view validate_lumps(const bsp_file &file);
+
+    // Everything open_file parses out of the file. Nothing changes it until release, so any number of threads
+    // may read it without locking.
+    struct bsp_file {
 #if defined(_WIN32)
         void* hFile;
         void* hMap;
@@ -46,14 +116,76 @@ namespace voxlife::bsp {
         std::span<const lump_surf_edge>    surface_edges;
         std::span<const lump_model>        models;
 
-        struct loaded_texture {
-            std::vector<glm::u8vec3> data;
+        // Every traversal of the lumps goes through it
+        validated_view validated;
+
+        struct texture_entry {
+            std::string_view name;
+            glm::u32vec2 size{};
+            uint32_t flags = 0;                     // from the name, see get_texture_name_flags
+            const uint8_t* mip_texture = nullptr;   // embedded in the level, otherwise stored in a wad
+        };
+
+        // One entry per texture in the lump
+        std::vector<texture_entry> texture_directory;
+        std::unordered_map<std::string_view, uint32_t, case_insensitive_hash, case_insensitive_equal> texture_ids;
+    };
+
+    // State the queries fill in on first use. Every member is guarded by a once_flag or a mutex, only
+    // load_textures writes without synchronization and has to run before the handle is shared.
+    struct bsp_caches {
+        struct texture_entry {
+            wad::wad_handle resource = nullptr;     // wad holding an external texture, set by load_textures
+            uint32_t flags = 0;                     // TEXTURE_MISSING, set by load_textures
+
+            // Texels are decoded on first access
+            std::once_flag decode_flag;
+            std::vector<glm::u8vec4> storage;       // only used by textures embedded in the level
+            std::span<const glm::u8vec4> data;      // points into storage or into the decoded wad texture
+            glm::u32vec2 size{};                    // of data, a wad texture can differ from the header in the level
+        };
 
-            glm::u32vec2 size;
+        struct face_bvh_node {
+            glm::vec3 min;
+            uint32_t first;     // first of two adjacent children for inner nodes, offset into bvh_face_ids for leaves
+            glm::vec3 max;
+            uint32_t count;     // faces in a leaf, zero for inner nodes
+        };
+
+        struct face_arena_storage {
+            std::once_flag build_flag;
+
+            std::vector<glm::vec3> vertices;
+            std::vector<uint32_t>  first_vertices;
+            std::vector<uint32_t>  vertex_counts;
+            std::vector<glm::vec3> normals;
+            std::vector<float>     distances;
+            std::vector<uint32_t>  texture_ids;
+            std::vector<glm::vec4> texture_s;
+            std::vector<glm::vec4> texture_t;
+
+            // Bounding volume hierarchy over the faces above, built by the first region query
+            std::once_flag bvh_flag;
+            std::vector<face_bvh_node> bvh_nodes;
+            std::vector<uint32_t>      bvh_face_ids;   // faces of a leaf are contiguous
+            std::vector<glm::vec3>     face_mins;
+            std::vector<glm::vec3>     face_maxs;
         };
 
         std::span<wad::wad_handle> resources;
-        std::vector<loaded_texture> loaded_textures;
+
+        // Sized by open_file and never resized afterwards, so entries can be filled concurrently
+        std::vector<texture_entry> textures;        // one per entry of the texture directory
+        std::vector<face_arena_storage> model_faces;
+
+        // Textures looked up by a name that is not in the level, misses are stored as the missing texture
+        std::mutex named_textures_mutex;
+        std::unordered_map<std::string, texture, case_insensitive_hash, case_insensitive_equal> named_textures;
+    };
+
+    struct bsp_info {
+        bsp_file file;
+        bsp_caches caches;
     };
 
 }
@@ -0,0 +1,120 @@
+#include <bsp/read_file.h>
+#include <bsp/primitives.h>
+#include <bsp/read_file_info.h>
+#include <utils/trace.h>
+
+#include <cstdint>
+#include <format>
+#include <limits>
+#include <stdexcept>
+
+
+namespace voxlife::bsp {
+
+    namespace {
+
+        [[noreturn]] void throw_bad_reference(std::string_view from, size_t index, std::string_view to, int64_t value, size_t count) {
+            throw std::runtime_error(std::format("{} {} references {} {}, the level has {}", from, index, to, value, count));
+        }
+
+        void check_index(std::string_view from, size_t index, std::string_view to, int64_t value, size_t count) {
+            if (value < 0 || static_cast<uint64_t>(value) >= count) [[unlikely]]
+                throw_bad_reference(from, index, to, value, count);
+        }
+
+        // Ranges are summed in 64 bits, first + count of the lumps can not overflow
+        void check_range(std::string_view from, size_t index, std::string_view to, int64_t first, int64_t count, size_t size) {
+            if (first < 0 || count < 0 || static_cast<uint64_t>(first + count) > size) [[unlikely]]
+                throw std::runtime_error(std::format("{} {} references {} {} to {}, the level has {}",
+                                                     from, index, to, first, first + count, size));
+        }
+
+        // Negative children are the complement of a leaf index. Compilers write the tree in preorder, requiring
+        // children to come after their parent rejects every cycle, which would make tree walks loop forever.
+        void check_node_child(size_t index, int16_t child, size_t node_count, size_t leaf_count) {
+            if (child < 0) {
+                check_index("Node", index, "leaf", ~static_cast<int32_t>(child), leaf_count);
+                return;
+            }
+
+            check_index("Node", index, "node", child, node_count);
+            if (static_cast<size_t>(child) <= index) [[unlikely]]
+                throw std::runtime_error(std::format("Node {} references node {}, children have to come after their parent", index, child));
+        }
+
+    }
+
+    validated_view validate_lumps(const bsp_file &file) {
+        VOXLIFE_TRACE_ZONE("validate lumps");
+
+        for (size_t i = 0; i < file.faces.size(); ++i) {
+            auto &face = file.faces[i];
+            check_index("Face", i, "plane", face.plane, file.planes.size());
+            check_index("Face", i, "texinfo", face.texture_info, file.texture_infos.size());
+            check_range("Face", i, "surfedges", face.first_edge, face.edge_count, file.surface_edges.size());
+        }
+
+        for (size_t i = 0; i < file.surface_edges.size(); ++i) {
+            auto edge = file.surface_edges[i].edge;
+            if (edge == std::numeric_limits<int32_t>::min())
+                throw_bad_reference("Surfedge", i, "edge", edge, file.edges.size());
+
+            check_index("Surfedge", i, "edge", edge < 0 ? -int64_t(edge) : int64_t(edge), file.edges.size());
+        }
+
+        for (size_t i = 0; i < file.edges.size(); ++i) {
+            check_index("Edge", i, "vertex", file.edges[i].vertex[0], file.vertices.size());
+            check_index("Edge", i, "vertex", file.edges[i].vertex[1], file.vertices.size());
+        }
+
+        for (size_t i = 0; i < file.nodes.size(); ++i) {
+            auto &node = file.nodes[i];
+            check_index("Node", i, "plane", node.plane, file.planes.size());
+            check_node_child(i, node.children[0], file.nodes.size(), file.leafs.size());
+            check_node_child(i, node.children[1], file.nodes.size(), file.leafs.size());
+            check_range("Node", i, "faces", node.first_face, node.face_count, file.faces.size());
+        }
+
+        for (size_t i = 0; i < file.leafs.size(); ++i) {
+            auto &leaf = file.leafs[i];
+            check_range("Leaf", i, "marksurfaces", leaf.first_mark_surface, leaf.mark_surface_count, file.mark_surfaces.size());
+        }
+
+        for (size_t i = 0; i < file.mark_surfaces.size(); ++i)
+            check_index("Marksurface", i, "face", file.mark_surfaces[i].face, file.faces.size());
+
+        // Negative clipnode children are contents, not indices
+        for (size_t i = 0; i < file.clip_nodes.size(); ++i) {
+            auto &clip_node = file.clip_nodes[i];
+            check_index("Clipnode", i, "plane", clip_node.plane, file.planes.size());
+            for (auto child : clip_node.children) {
+                if (child >= 0)
+                    check_index("Clipnode", i, "clipnode", child, file.clip_nodes.size());
+            }
+        }
+
+        for (size_t i = 0; i < file.models.size(); ++i) {
+            auto &model = file.models[i];
+            check_range("Model", i, "faces", model.first_face, model.face_count, file.faces.size());
+            if (!file.nodes.empty())
+                check_index("Model", i, "node", model.head_nodes[0], file.nodes.size());
+
+            for (uint32_t hull = 1; hull < lump_model::max_map_hulls; ++hull) {
+                if (model.head_nodes[hull] >= 0)
+                    check_index("Model", i, "clipnode", model.head_nodes[hull], file.clip_nodes.size());
+            }
+        }
+
+        validated_view view;
+        view.planes = file.planes;
+        view.vertices = file.vertices;
+        view.nodes = file.nodes;
+        view.texture_infos = file.texture_infos;
+        view.faces = file.faces;
+        view.leafs = file.leafs;
+        view.edges = file.edges;
+        view.surface_edges = file.surface_edges;
+        return view;
+    }
+
+}
@@ -0,0 +1,104 @@
+
+#include <bsp/write_file.h>
+
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+
+
+namespace voxlife::bsp {
+
+    void check_lump_size(lump_type type, size_t count) {
+        if (count > static_cast<size_t>(max_lump_size[type]))
+            throw std::runtime_error(std::format("Lump {} has {} entries, the limit is {}", lump_names[type], count, max_lump_size[type]));
+    }
+
+    template<typename T>
+    std::span<const uint8_t> as_lump_bytes(const std::vector<T> &entries) {
+        return std::span(reinterpret_cast<const uint8_t*>(entries.data()), entries.size() * sizeof(T));
+    }
+
+    // Texture lump header, one offset per texture and the mip texture headers, external textures carry no texels
+    std::vector<uint8_t> encode_texture_lump(std::span<const lump_mip_texture> textures) {
+        const size_t header_size = sizeof(lump_texture_header) + textures.size() * sizeof(uint32_t);
+        std::vector<uint8_t> data(header_size + textures.size() * sizeof(lump_mip_texture));
+
+        lump_texture_header texture_header{};
+        texture_header.mip_texture_count = static_cast<uint32_t>(textures.size());
+        std::memcpy(data.data(), &texture_header, sizeof(texture_header));
+
+        for (size_t i = 0; i < textures.size(); ++i) {
+            auto offset = static_cast<uint32_t>(header_size + i * sizeof(lump_mip_texture));
+            std::memcpy(data.data() + sizeof(lump_texture_header) + i * sizeof(uint32_t), &offset, sizeof(offset));
+            std::memcpy(data.data() + offset, &textures[i], sizeof(lump_mip_texture));
+        }
+
+        return data;
+    }
+
+    void write_file(std::string_view filename, const file_lumps &lumps) {
+        check_lump_size(LUMP_ENTITIES, std::count(lumps.entities.begin(), lumps.entities.end(), '{'));
+        check_lump_size(LUMP_PLANES, lumps.planes.size());
+        check_lump_size(LUMP_TEXTURES, lumps.textures.size());
+        check_lump_size(LUMP_VERTICES, lumps.vertices.size());
+        check_lump_size(LUMP_NODES, lumps.nodes.size());
+        check_lump_size(LUMP_TEXINFO, lumps.texture_infos.size());
+        check_lump_size(LUMP_FACES, lumps.faces.size());
+        check_lump_size(LUMP_CLIPNODES, lumps.clip_nodes.size());
+        check_lump_size(LUMP_LEAFS, lumps.leafs.size());
+        check_lump_size(LUMP_MARKSURFACES, lumps.mark_surfaces.size());
+        check_lump_size(LUMP_EDGES, lumps.edges.size());
+        check_lump_size(LUMP_SURFEDGES, lumps.surface_edges.size());
+        check_lump_size(LUMP_MODELS, lumps.models.size());
+
+        auto texture_lump = encode_texture_lump(lumps.textures);
+
+        std::span<const uint8_t> lump_data[LUMP_MAX];
+        lump_data[LUMP_ENTITIES]     = std::span(reinterpret_cast<const uint8_t*>(lumps.entities.c_str()), lumps.entities.size() + 1);
+        lump_data[LUMP_PLANES]       = as_lump_bytes(lumps.planes);
+        lump_data[LUMP_TEXTURES]     = texture_lump;
+        lump_data[LUMP_VERTICES]     = as_lump_bytes(lumps.vertices);
+        lump_data[LUMP_NODES]        = as_lump_bytes(lumps.nodes);
+        lump_data[LUMP_TEXINFO]      = as_lump_bytes(lumps.texture_infos);
+        lump_data[LUMP_FACES]        = as_lump_bytes(lumps.faces);
+        lump_data[LUMP_CLIPNODES]    = as_lump_bytes(lumps.clip_nodes);
+        lump_data[LUMP_LEAFS]        = as_lump_bytes(lumps.leafs);
+        lump_data[LUMP_MARKSURFACES] = as_lump_bytes(lumps.mark_surfaces);
+        lump_data[LUMP_EDGES]        = as_lump_bytes(lumps.edges);
+        lump_data[LUMP_SURFEDGES]    = as_lump_bytes(lumps.surface_edges);
+        lump_data[LUMP_MODELS]       = as_lump_bytes(lumps.models);
+
+        // Lumps follow the header in order, each one starts on a four byte boundary
+        header bsp_header{};
+        bsp_header.version = header::bsp_version_halflife;
+
+        size_t offset = sizeof(header);
+        for (int i = 0; i < LUMP_MAX; ++i) {
+            offset = (offset + 3) & ~size_t(3);
+            bsp_header.lumps[i].offset = static_cast<int32_t>(offset);
+            bsp_header.lumps[i].length = static_cast<int32_t>(lump_data[i].size());
+            offset += lump_data[i].size();
+        }
+
+        std::ofstream file(std::string(filename), std::ios::binary | std::ios::trunc);
+        if (!file)
+            throw std::runtime_error(std::format("Could not create bsp file '{}'", filename));
+
+        file.write(reinterpret_cast<const char*>(&bsp_header), sizeof(bsp_header));
+
+        const char padding[4] = {};
+        size_t written = sizeof(header);
+        for (int i = 0; i < LUMP_MAX; ++i) {
+            file.write(padding, static_cast<std::streamsize>(bsp_header.lumps[i].offset - written));
+            file.write(reinterpret_cast<const char*>(lump_data[i].data()), static_cast<std::streamsize>(lump_data[i].size()));
+            written = bsp_header.lumps[i].offset + lump_data[i].size();
+        }
+
+        if (!file)
+            throw std::runtime_error(std::format("Could not write bsp file '{}'", filename));
+    }
+
+}
@@ -0,0 +1,40 @@
+
+#ifndef VOXLIFE_BSP_WRITE_FILE_H
+#define VOXLIFE_BSP_WRITE_FILE_H
+
+#include <bsp/primitives.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace voxlife::bsp {
+
+    // Lumps of a level in their on disk layout. The visibility and lighting lumps are always written empty.
+    struct file_lumps {
+        std::string                    entities;       // entity text, the terminator is appended by the writer
+        std::vector<lump_plane>        planes;
+        std::vector<lump_mip_texture>  textures;       // offsets of zero reference a texture in a wad
+        std::vector<lump_vertex>       vertices;
+        std::vector<lump_node>         nodes;
+        std::vector<lump_texture_info> texture_infos;
+        std::vector<lump_face>         faces;
+        std::vector<lump_clip_node>    clip_nodes;
+        std::vector<lump_leaf>         leafs;
+        std::vector<lump_mark_surface> mark_surfaces;
+        std::vector<lump_edge>         edges;
+        std::vector<lump_surf_edge>    surface_edges;
+        std::vector<lump_model>        models;
+    };
+
+    // Throws if count exceeds the entry of the lump in max_lump_size
+    void check_lump_size(lump_type type, size_t count);
+
+    // Writes a version 30 bsp readable by open_file. Throws if a lump exceeds its entry in max_lump_size,
+    // entities are counted by their opening braces.
+    void write_file(std::string_view filename, const file_lumps &lumps);
+
+}
+
+#endif //VOXLIFE_BSP_WRITE_FILE_H
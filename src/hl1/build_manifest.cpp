@@ -0,0 +1,112 @@
+
+#include <hl1/build_manifest.h>
+#include <utils/content_hash.h>
+#include <utils/trace.h>
+
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+
+namespace voxlife::hl1 {
+
+    namespace {
+
+        std::mutex wad_hash_mutex;
+        std::unordered_map<std::string, std::optional<uint64_t>> wad_hashes;
+
+        // Missing wads are remembered as well, load_level skips them the same way on every run
+        std::optional<uint64_t> get_wad_hash(const std::string &path) {
+            {
+                std::lock_guard lock(wad_hash_mutex);
+                auto it = wad_hashes.find(path);
+                if (it != wad_hashes.end())
+                    return it->second;
+            }
+
+            // Hashed outside the lock, two levels racing on the same wad only hash it twice
+            std::optional<uint64_t> hash;
+            if (std::filesystem::is_regular_file(path))
+                hash = hash_file_content(path);
+
+            std::lock_guard lock(wad_hash_mutex);
+            wad_hashes.emplace(path, hash);
+            return hash;
+        }
+
+        std::filesystem::path get_manifest_path(std::string_view level_name) {
+            return std::filesystem::path("manifest") / std::format("{}.txt", level_name);
+        }
+
+    }
+
+    uint64_t compute_level_key(std::string_view level_path, std::span<const std::string> wad_paths, std::string_view settings) {
+        VOXLIFE_TRACE_ZONE("compute_level_key");
+        content_hasher hasher;
+        hasher.update(tool_version);
+        hasher.update(settings);
+        hasher.update_u64(hash_file_content(std::filesystem::path(level_path)));
+
+        hasher.update_u64(wad_paths.size());
+        for (auto &path : wad_paths) {
+            auto hash = get_wad_hash(path);
+            hasher.update_u64(hash.has_value());
+            hasher.update_u64(hash.value_or(0));
+        }
+
+        return hasher.digest();
+    }
+
+    bool is_level_up_to_date(std::string_view level_name, uint64_t key) {
+        std::ifstream file(get_manifest_path(level_name));
+        if (!file)
+            return false;
+
+        std::string line;
+        if (!std::getline(file, line) || line != std::format("{:016x}", key))
+            return false;
+
+        // A deleted output file has to be rebuilt, even though none of the inputs changed
+        bool has_outputs = false;
+        while (std::getline(file, line)) {
+            if (line.empty())
+                continue;
+            if (!std::filesystem::is_regular_file(line))
+                return false;
+            has_outputs = true;
+        }
+
+        return has_outputs;
+    }
+
+    void write_level_manifest(std::string_view level_name, uint64_t key, std::span<const std::string> output_paths) {
+        auto manifest_path = get_manifest_path(level_name);
+        std::filesystem::create_directories(manifest_path.parent_path());
+
+        // Written last and swapped in, an interrupted conversion never leaves a manifest for partial outputs
+        auto temp_path = manifest_path;
+        temp_path += std::format(".{}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+        {
+            std::ofstream file(temp_path, std::ios::trunc);
+            if (!file)
+                throw std::runtime_error(std::format("Could not create manifest '{}'", temp_path.string()));
+
+            file << std::format("{:016x}", key) << '\n';
+            for (auto &path : output_paths)
+                file << path << '\n';
+
+            if (!file)
+                throw std::runtime_error(std::format("Could not write manifest '{}'", temp_path.string()));
+        }
+
+        std::filesystem::rename(temp_path, manifest_path);
+    }
+
+}
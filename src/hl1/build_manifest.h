@@ -0,0 +1,29 @@
+
+#ifndef VOXLIFE_BUILD_MANIFEST_H
+#define VOXLIFE_BUILD_MANIFEST_H
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+
+namespace voxlife::hl1 {
+
+    // Bumped whenever a change to the converter changes its output, invalidates every manifest
+    constexpr std::string_view tool_version = "voxlife-1";
+
+    // Hash of everything the output of a level depends on: the bsp, its wads, the settings and the tool version.
+    // Wad hashes are computed once per process, most levels share the same wads.
+    uint64_t compute_level_key(std::string_view level_path, std::span<const std::string> wad_paths, std::string_view settings);
+
+    // True if the manifest of the level was written with this key and all of its output files still exist
+    bool is_level_up_to_date(std::string_view level_name, uint64_t key);
+
+    // Records the key together with every output file of the level in manifest/<level_name>.txt
+    void write_level_manifest(std::string_view level_name, uint64_t key, std::span<const std::string> output_paths);
+
+}
+
+
+#endif //VOXLIFE_BUILD_MANIFEST_H
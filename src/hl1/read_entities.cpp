@@ -1,5 +1,6 @@
 
 #include <hl1/read_entities.h>
+#include <utils/trace.h>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/vec_swizzle.hpp>
@@ -363,6 +364,7 @@ namespace voxlife::hl1 {
     }
 
     level_entities read_entities(bsp::bsp_handle handle) {
+        VOXLIFE_TRACE_ZONE("read_entities");
         level_entities result{};
 
         auto entities = bsp::get_entities(handle);
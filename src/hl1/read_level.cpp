@@ -1,6 +1,9 @@
 
 #include <hl1/read_level.h>
 #include <hl1/read_entities.h>
+#include <hl1/build_manifest.h>
+#include <utils/trace.h>
+#include <utils/memory_usage.h>
 #include <bsp/read_file.h>
 #include <set>
 #include <voxel/write_file.h>
@@ -15,8 +18,14 @@
 #include <iostream>
 #include <charconv>
 #include <ranges>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 
-#include <voxel/voxelize_bsp.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 using namespace voxlife::voxel;
 
@@ -139,7 +148,25 @@ namespace voxlife::hl1 {
         "c5a1",
     };
 
-    int load_level(std::string_view game_path, std::string_view level_name) {
+    // Releases the files of a level on every way out of load_level, errors included
+    struct level_files {
+        bsp::bsp_handle bsp_handle = nullptr;
+        std::vector<wad::wad_handle> wad_handles;
+
+        level_files() = default;
+        level_files(const level_files &) = delete;
+        level_files &operator=(const level_files &) = delete;
+
+        ~level_files() {
+            for (auto wad_handle : wad_handles)
+                wad::release(wad_handle);
+            if (bsp_handle != nullptr)
+                bsp::release(bsp_handle);
+        }
+    };
+
+    int load_level(std::string_view game_path, std::string_view level_name, const load_options &options, bool &up_to_date) {
+        VOXLIFE_TRACE_ZONE_DETAIL("load_level", level_name);
         std::filesystem::path game_path_fs(game_path);
 
         if (!std::filesystem::is_directory(game_path_fs)) {
@@ -154,10 +181,17 @@ namespace voxlife::hl1 {
             return 1;
         }
 
-        voxlife::bsp::bsp_handle bsp_handle;
-        voxlife::bsp::open_file(std::filesystem::weakly_canonical(level_path).make_preferred().string(), &bsp_handle);
-        auto entities = read_entities(bsp_handle);
-        std::vector<wad::wad_handle> wad_handles;
+        auto level_path_string = std::filesystem::weakly_canonical(level_path).make_preferred().string();
+        level_files files;
+        auto &bsp_handle = files.bsp_handle;
+        auto &wad_handles = files.wad_handles;
+        level_entities entities;
+        {
+            memory::stage_scope stage("parse");
+            voxlife::bsp::open_file(level_path_string, &bsp_handle);
+            entities = read_entities(bsp_handle);
+        }
+        uint64_t level_key = 0;
 
         {
             auto worldspan_entities = entities.entities[static_cast<size_t>(classname_type::worldspawn)];
@@ -202,13 +236,23 @@ namespace voxlife::hl1 {
                     start = end + 1;
                 }
 
+                // The wad list comes from the bsp itself, so the key is known before any texture is decoded
+                level_key = compute_level_key(level_path_string, wad_paths, options.settings);
+                if (!options.force && is_level_up_to_date(level_name, level_key)) {
+                    up_to_date = true;
+                    return 0;
+                }
+
+                memory::stage_scope stage("textures");
                 wad_handles.reserve(wad_paths.size());
                 for (auto &path : wad_paths) {
                     wad::wad_handle wad_handle;
                     try {
-                        wad::open_file(path, &wad_handle);
+                        // Levels share most of their wads, keep them open for the whole batch
+                        wad::open_shared_file(path, &wad_handle);
                     } catch (std::exception &e) {
                         std::cerr << "Failed to open wad file " << path << ": " << e.what() << std::endl;
+                        continue;
                     }
 
                     wad_handles.push_back(wad_handle);
@@ -225,15 +269,18 @@ namespace voxlife::hl1 {
 
             bool has_sky = false;
             auto faces = voxlife::bsp::get_model_faces(bsp_handle, 0);
-            for (auto &face : faces) {
-                auto texture_name = voxlife::bsp::get_texture_name(bsp_handle, face.texture_id);
-                if (texture_name == "SKY" || texture_name == "sky") {
+            for (auto texture_id : faces.texture_ids) {
+                if (voxlife::bsp::get_texture_flags(bsp_handle, texture_id) & voxlife::bsp::TEXTURE_SKY) {
                     has_sky = true;
                     break;
                 }
             }
 
-            voxelize_gpu(bsp_handle, level_name, models);
+            {
+                VOXLIFE_TRACE_ZONE("voxelize");
+                memory::stage_scope stage("voxelize");
+                options.voxelize(bsp_handle, level_name, options.voxelize_options, models);
+            }
 
             std::vector<Light> lights;
             for (auto const &entity : entities.entities[static_cast<uint32_t>(voxlife::hl1::classname_type::light)]) {
@@ -370,30 +417,121 @@ namespace voxlife::hl1 {
             // c2a2g wrong sky
             // xen level transitions have weird scripted teleports?
 
+            memory::stage_scope stage("write level");
             write_teardown_level(info);
-        }
 
-        for (auto wad_handle : wad_handles) {
-            voxlife::wad::release(wad_handle);
+            // Every write above throws on failure, so the manifest only ever lists outputs that were written
+            std::vector<std::string> output_paths;
+            output_paths.reserve(models.size() + 1);
+            for (auto &model : models)
+                output_paths.push_back(std::format("brush/{}/{}.vox", level_name, model.name));
+            output_paths.push_back(std::format("levels/{}.xml", level_name));
+            write_level_manifest(level_name, level_key, output_paths);
         }
-        wad_handles.clear();
-        voxlife::bsp::release(bsp_handle);
 
         return 0;
     }
 
-    int load_game_levels(std::string_view game_path, std::span<const std::string_view> level_names) {
+    int load_game_levels(std::string_view game_path, std::span<const std::string_view> level_names, const load_options &options) {
         if (level_names.empty())
             level_names = default_level_names;
 
-        for (auto level_name : level_names) {
-            std::cout << level_name << std::endl;
-            auto result = load_level(game_path, level_name);
-            if (result != 0)
-                return result;
+        uint32_t job_count = options.jobs != 0 ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+        job_count = std::min(job_count, static_cast<uint32_t>(level_names.size()));
+
+        constexpr int not_converted = -1;
+        std::vector<int> results(level_names.size(), not_converted);
+        std::vector<uint8_t> up_to_date(level_names.size(), false);
+        std::atomic<size_t> next_level = 0;
+        std::atomic<bool> has_failed = false;
+        std::mutex output_mutex;
+
+        // Levels share no state besides the output directories, so every worker pulls whole levels
+        auto worker = [&]() {
+#if defined(_OPENMP)
+            // Split the cores between the workers, instead of every level spawning a full team
+            omp_set_num_threads(std::max(1, omp_get_num_procs() / static_cast<int>(job_count)));
+#endif
+
+            while (options.keep_going || !has_failed) {
+                auto level_index = next_level.fetch_add(1);
+                if (level_index >= level_names.size())
+                    break;
+
+                auto level_name = level_names[level_index];
+                {
+                    std::lock_guard lock(output_mutex);
+                    std::cout << level_name << std::endl;
+                }
+
+                auto start_time = std::chrono::steady_clock::now();
+                int result;
+                std::string error;
+                bool skipped = false;
+                memory::level_usage memory_usage;
+                try {
+                    memory::level_scope memory_scope(memory_usage);
+                    result = load_level(game_path, level_name, options, skipped);
+                    memory::check_budget(std::format("by {}", level_name));
+                } catch (std::exception &e) {
+                    result = 1;
+                    error = e.what();
+                }
+                std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+
+                results[level_index] = result;
+                up_to_date[level_index] = skipped;
+                if (result != 0)
+                    has_failed = true;
+
+                std::lock_guard lock(output_mutex);
+                if (result == 0 && skipped)
+                    std::cout << std::format("{}: up to date", level_name) << std::endl;
+                else if (result == 0)
+                    std::cout << std::format("{}: converted in {:.2f}s", level_name, duration.count()) << std::endl;
+                else if (error.empty())
+                    std::cerr << std::format("{}: failed with result {}", level_name, result) << std::endl;
+                else
+                    std::cerr << std::format("{}: failed: {}", level_name, error) << std::endl;
+
+                if (options.memory_report && !skipped)
+                    std::cout << memory::format_level_usage(level_name, memory_usage) << std::endl;
+            }
+        };
+
+        if (job_count <= 1) {
+            worker();
+        } else {
+            std::vector<std::jthread> workers;
+            workers.reserve(job_count);
+            for (uint32_t i = 0; i < job_count; ++i)
+                workers.emplace_back(worker);
         }
 
-        return 0;
+        wad::release_shared_files();
+
+        int first_error = 0;
+        size_t converted_count = 0;
+        size_t up_to_date_count = 0;
+        std::vector<std::string_view> failed_levels;
+        for (size_t i = 0; i < level_names.size(); ++i) {
+            if (results[i] == 0) {
+                converted_count++;
+                up_to_date_count += up_to_date[i];
+            } else if (results[i] != not_converted) {
+                failed_levels.push_back(level_names[i]);
+                if (first_error == 0)
+                    first_error = results[i];
+            }
+        }
+
+        if (level_names.size() > 1) {
+            std::cout << std::format("Converted {} of {} levels, {} of them were up to date", converted_count, level_names.size(), up_to_date_count) << std::endl;
+            for (auto level_name : failed_levels)
+                std::cerr << "Failed to convert " << level_name << std::endl;
+        }
+
+        return first_error;
     }
 
 } // namespace voxlife::hl1
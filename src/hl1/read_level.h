@@ -2,13 +2,28 @@
 #ifndef VOXLIFE_READ_LEVEL_H
 #define VOXLIFE_READ_LEVEL_H
 
+#include <voxel/voxelizer.h>
+
+#include <cstdint>
+#include <string>
 #include <string_view>
 #include <span>
 
 
 namespace voxlife::hl1 {
 
-    int load_game_levels(std::string_view game_path, std::span<const std::string_view> level_names);
+    struct load_options {
+        voxel::voxelize_fn voxelize = nullptr;
+        voxel::voxelize_options voxelize_options;
+        uint32_t jobs = 1;          // levels converted concurrently, 0 uses one per hardware thread
+        bool keep_going = false;    // keep converting the remaining levels after a level failed
+        bool force = false;         // convert levels even if their build manifest says they are up to date
+        std::string settings;       // every option that changes the output, part of the build manifest key
+        bool memory_report = false; // print the peak memory of every level and its stages
+    };
+
+    // Returns zero if every level was converted, otherwise the result of the first failed level
+    int load_game_levels(std::string_view game_path, std::span<const std::string_view> level_names, const load_options &options);
 
 }
 
@@ -1,25 +1,141 @@
-
 #include <iostream>
 #include <hl1/read_level.h>
+#include <wad/read_file.h>
+#include <voxel/voxelizer.h>
+#include <voxel/voxelize_cpu.h>
+#include <utils/trace.h>
+#include <utils/memory_usage.h>
+#if defined(VOXLIFE_ENABLE_GPU)
+#include <voxel/voxelize_bsp.h>
+#endif
 #include <vector>
+#include <charconv>
+#include <format>
+
+
+namespace {
 
+    voxlife::voxel::voxelize_fn get_backend(voxlife::voxel::backend_type type) {
+        switch (type) {
+            case voxlife::voxel::backend_type::cpu:
+                return voxelize_cpu;
+#if defined(VOXLIFE_ENABLE_GPU)
+            case voxlife::voxel::backend_type::gpu:
+                return voxelize_gpu;
+#endif
+            default:
+                return nullptr;
+        }
+    }
+
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <game path> <level name>" << std::endl;
+#if defined(VOXLIFE_ENABLE_GPU)
+    auto backend = voxlife::voxel::backend_type::gpu;
+#else
+    auto backend = voxlife::voxel::backend_type::cpu;
+#endif
+
+    voxlife::hl1::load_options options{};
+    std::string_view trace_path;
+
+    std::vector<std::string_view> arguments;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument = argv[i];
+
+        if (argument.starts_with("--backend=")) {
+            auto backend_name = argument.substr(std::string_view("--backend=").size());
+            auto parsed_backend = voxlife::voxel::parse_backend_type(backend_name);
+            if (!parsed_backend) {
+                std::cerr << "Unknown voxelizer backend '" << backend_name << "'" << std::endl;
+                return 1;
+            }
+            backend = *parsed_backend;
+        } else if (argument.starts_with("--jobs=")) {
+            auto job_count = argument.substr(std::string_view("--jobs=").size());
+            auto result = std::from_chars(job_count.data(), job_count.data() + job_count.size(), options.jobs);
+            if (result.ec != std::errc() || result.ptr != job_count.data() + job_count.size()) {
+                std::cerr << "Invalid job count '" << job_count << "'" << std::endl;
+                return 1;
+            }
+        } else if (argument == "--keep-going") {
+            options.keep_going = true;
+        } else if (argument == "--force") {
+            options.force = true;
+        } else if (argument == "--level-palette") {
+            options.voxelize_options.level_palette = true;
+        } else if (argument == "--fill-solid") {
+            options.voxelize_options.fill_solid = true;
+        } else if (argument.starts_with("--trace=")) {
+#if defined(VOXLIFE_ENABLE_TRACING)
+            trace_path = argument.substr(std::string_view("--trace=").size());
+#else
+            std::cerr << "--trace requires a build with VOXLIFE_ENABLE_TRACING" << std::endl;
+            return 1;
+#endif
+        } else if (argument.starts_with("--memory-budget=")) {
+            auto budget = argument.substr(std::string_view("--memory-budget=").size());
+            size_t budget_megabytes;
+            auto result = std::from_chars(budget.data(), budget.data() + budget.size(), budget_megabytes);
+            if (result.ec != std::errc() || result.ptr != budget.data() + budget.size()) {
+                std::cerr << "Invalid memory budget '" << budget << "'" << std::endl;
+                return 1;
+            }
+            voxlife::memory::set_budget(budget_megabytes * 1024 * 1024);
+        } else if (argument == "--memory-report") {
+            options.memory_report = true;
+        } else if (argument.starts_with("--texture-cache=")) {
+            voxlife::wad::set_texture_cache_directory(argument.substr(std::string_view("--texture-cache=").size()));
+        } else if (argument.starts_with("--")) {
+            std::cerr << "Unknown option '" << argument << "'" << std::endl;
+            return 1;
+        } else {
+            arguments.push_back(argument);
+        }
+    }
+
+    if (arguments.size() < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--backend=cpu|gpu] [--jobs=N] [--keep-going] [--force] [--level-palette] [--fill-solid] [--texture-cache=<dir>] [--memory-budget=<MB>] [--memory-report] [--trace=<file>] <game path> <level name>" << std::endl;
         return 1;
     }
 
-    std::string_view game_path = argv[1];
-    auto level_count = argc - 2;
+    options.voxelize = get_backend(backend);
+    if (options.voxelize == nullptr) {
+        std::cerr << "Voxelizer backend '" << voxlife::voxel::backend_names[static_cast<uint32_t>(backend)]
+                  << "' is not available in this build" << std::endl;
+        return 1;
+    }
+
+    if (options.voxelize_options.fill_solid && backend != voxlife::voxel::backend_type::cpu) {
+        std::cerr << "--fill-solid is only supported by the cpu voxelizer backend" << std::endl;
+        return 1;
+    }
 
-    if (level_count == 1 && std::string_view(argv[2]) == "all")
-        return voxlife::hl1::load_game_levels(game_path, {});
+    // The texture cache, the memory options and the job count do not change the output, so they are left out of the build manifest key
+    options.settings = std::format("backend={};fill_solid={};level_palette={}",
+                                   voxlife::voxel::backend_names[static_cast<uint32_t>(backend)], options.voxelize_options.fill_solid,
+                                   options.voxelize_options.level_palette);
 
-    std::vector<std::string_view> level_names;
-    level_names.reserve(level_count);
-    for (int i = 0; i < level_count; ++i)
-        level_names.emplace_back(argv[2 + i]);
+    std::string_view game_path = arguments[0];
+    auto level_names = std::span(arguments).subspan(1);
+
+    if (level_names.size() == 1 && level_names[0] == "all")
+        level_names = {};
+
+#if defined(VOXLIFE_ENABLE_TRACING)
+    if (!trace_path.empty())
+        voxlife::trace::start_tracing();
+#endif
+
+    int result = voxlife::hl1::load_game_levels(game_path, level_names, options);
+
+#if defined(VOXLIFE_ENABLE_TRACING)
+    if (!trace_path.empty() && !voxlife::trace::write_chrome_trace(std::string(trace_path))) {
+        std::cerr << "Failed to write trace to " << trace_path << std::endl;
+        return result != 0 ? result : 1;
+    }
+#endif
 
-    return voxlife::hl1::load_game_levels(game_path, std::span(level_names));
+    return result;
 }
@@ -0,0 +1,55 @@
+#ifndef VOXLIFE_CASE_INSENSITIVE_H
+#define VOXLIFE_CASE_INSENSITIVE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+
+// FNV-1a over ASCII lowercase, Half-Life treats texture and file names case-insensitively
+struct case_insensitive_hash {
+    using is_transparent = void;    // lets maps keyed by std::string find a std::string_view
+
+    std::size_t operator()(std::string_view s) const noexcept {
+#if SIZE_MAX == UINT64_MAX
+        const std::size_t FNV_offset_basis = 14695981039346656037ULL;
+        const std::size_t FNV_prime = 1099511628211ULL;
+#elif SIZE_MAX == UINT32_MAX
+        const std::size_t FNV_offset_basis = 2166136261U;
+        const std::size_t FNV_prime = 16777619U;
+#else
+#error "Unsupported size_t size"
+#endif
+        std::size_t hash = FNV_offset_basis;
+        for (unsigned char c : s) {
+            c = to_lower_ascii(c);
+            hash ^= c;
+            hash *= FNV_prime;
+        }
+        return hash;
+    }
+
+protected:
+    static constexpr unsigned char to_lower_ascii(unsigned char c) noexcept {
+        // Convert uppercase ASCII letters to lowercase
+        if (c >= 'A' && c <= 'Z')
+            return c + 32;
+        return c;
+    }
+};
+
+struct case_insensitive_equal : case_insensitive_hash {
+    bool operator()(std::string_view lhs, std::string_view rhs) const noexcept {
+        if (lhs.size() != rhs.size())
+            return false;
+
+        for (std::size_t i = 0; i < lhs.size(); ++i) {
+            if (case_insensitive_hash::to_lower_ascii(lhs[i]) != case_insensitive_hash::to_lower_ascii(rhs[i]))
+                return false;
+        }
+        return true;
+    }
+};
+
+
+#endif //VOXLIFE_CASE_INSENSITIVE_H
@@ -0,0 +1,61 @@
+#ifndef VOXLIFE_CONTENT_HASH_H
+#define VOXLIFE_CONTENT_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+
+// 64 bit FNV-1a over arbitrary bytes, used to key build outputs by the content of their inputs
+class content_hasher {
+public:
+    void update(const void *data, size_t size) {
+        auto *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= FNV_prime;
+        }
+    }
+
+    // Strings are prefixed with their length, so consecutive strings can not run into each other
+    void update(std::string_view s) {
+        update_u64(s.size());
+        update(s.data(), s.size());
+    }
+
+    void update_u64(uint64_t value) {
+        update(&value, sizeof(value));
+    }
+
+    uint64_t digest() const {
+        return hash;
+    }
+
+private:
+    static constexpr uint64_t FNV_offset_basis = 14695981039346656037ULL;
+    static constexpr uint64_t FNV_prime = 1099511628211ULL;
+
+    uint64_t hash = FNV_offset_basis;
+};
+
+inline uint64_t hash_file_content(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Could not open '" + path.string() + "' for hashing");
+
+    content_hasher hasher;
+    std::vector<char> buffer(1 << 20);
+    while (file) {
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        hasher.update(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+
+    return hasher.digest();
+}
+
+
+#endif //VOXLIFE_CONTENT_HASH_H
@@ -0,0 +1,334 @@
+#include <utils/memory_usage.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <new>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+namespace voxlife::memory {
+
+    namespace {
+
+        constexpr double megabyte = 1024.0 * 1024.0;
+
+        // Smaller allocations only mark the budget as exceeded, failing them could throw from an error path
+        constexpr size_t budget_fail_size = 1024 * 1024;
+
+        // Levels and stages that are running at the same time on every thread, each one holds a window
+        constexpr uint32_t max_windows = 64;
+        constexpr uint32_t no_window = UINT32_MAX;
+
+        std::atomic<size_t> allocated_bytes = 0;
+        std::atomic<size_t> mapped_bytes = 0;
+        std::atomic<size_t> budget_bytes = 0;
+        std::atomic<size_t> budget_overshoot = 0;   // highest usage above the budget outside of any level
+
+        std::atomic<uint64_t> open_windows = 0;     // one bit per window in use
+        std::atomic<uint64_t> level_windows = 0;    // the subset held by levels
+        std::array<std::atomic<size_t>, max_windows> window_peaks{};
+        std::array<std::atomic<size_t>, max_windows> window_overshoots{};  // of levels, since their last check
+
+        thread_local level_usage *current_usage = nullptr;
+        thread_local uint32_t current_level_window = no_window;
+        thread_local uint32_t current_depth = 0;
+
+        void update_maximum(std::atomic<size_t> &maximum, size_t value) {
+            auto current = maximum.load(std::memory_order_relaxed);
+            while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+        }
+
+        size_t get_used_bytes() {
+            return allocated_bytes.load(std::memory_order_relaxed) + mapped_bytes.load(std::memory_order_relaxed);
+        }
+
+        void on_usage_changed(size_t used_bytes) {
+            for (auto windows = open_windows.load(std::memory_order_relaxed); windows != 0; windows &= windows - 1)
+                update_maximum(window_peaks[std::countr_zero(windows)], used_bytes);
+
+            auto budget = budget_bytes.load(std::memory_order_relaxed);
+            if (budget == 0 || used_bytes <= budget)
+                return;
+
+            // Worker threads of a level run outside of its scope, what they allocate counts against every level
+            if (current_level_window != no_window) {
+                update_maximum(window_overshoots[current_level_window], used_bytes);
+                return;
+            }
+
+            auto levels = level_windows.load(std::memory_order_relaxed);
+            if (levels == 0)
+                update_maximum(budget_overshoot, used_bytes);
+            for (; levels != 0; levels &= levels - 1)
+                update_maximum(window_overshoots[std::countr_zero(levels)], used_bytes);
+        }
+
+        // Peaks and overshoots of free windows are zero, so usage reported while a window is claimed is never lost
+        uint32_t open_window(bool is_level) {
+            auto windows = open_windows.load(std::memory_order_relaxed);
+            uint32_t window;
+            do {
+                if (windows == UINT64_MAX)
+                    return no_window;
+                window = static_cast<uint32_t>(std::countr_one(windows));
+            } while (!open_windows.compare_exchange_weak(windows, windows | (uint64_t(1) << window), std::memory_order_relaxed));
+
+            if (is_level)
+                level_windows.fetch_or(uint64_t(1) << window, std::memory_order_relaxed);
+            update_maximum(window_peaks[window], get_used_bytes());
+            return window;
+        }
+
+        // Returns the peak, without a window the higher of the usage at the start and now
+        size_t close_window(uint32_t window, size_t start_bytes) {
+            if (window == no_window)
+                return std::max(start_bytes, get_used_bytes());
+
+            level_windows.fetch_and(~(uint64_t(1) << window), std::memory_order_relaxed);
+            open_windows.fetch_and(~(uint64_t(1) << window), std::memory_order_relaxed);
+            window_overshoots[window].store(0, std::memory_order_relaxed);
+            return window_peaks[window].exchange(0, std::memory_order_relaxed);
+        }
+
+        std::atomic<size_t> &get_overshoot() {
+            return current_level_window != no_window ? window_overshoots[current_level_window] : budget_overshoot;
+        }
+
+        // The message is formatted without allocating, this is thrown from inside operator new
+        class budget_exceeded : public std::bad_alloc {
+        public:
+            budget_exceeded(size_t size, size_t budget) {
+                std::snprintf(message, sizeof(message), "Allocation of %.1f MB exceeds the memory budget of %.1f MB",
+                              static_cast<double>(size) / megabyte, static_cast<double>(budget) / megabyte);
+            }
+
+            const char *what() const noexcept override {
+                return message;
+            }
+
+        private:
+            char message[128];
+        };
+
+        bool may_throw() {
+#if defined(_OPENMP)
+            // An exception can not leave a parallel region, it would terminate the process
+            return !omp_in_parallel();
+#else
+            return true;
+#endif
+        }
+
+        size_t get_usable_size(void *pointer, size_t alignment) {
+#if defined(_WIN32)
+            return alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? _aligned_msize(pointer, alignment, 0) : _msize(pointer);
+#elif defined(__APPLE__)
+            (void)alignment;
+            return malloc_size(pointer);
+#else
+            (void)alignment;
+            return malloc_usable_size(pointer);
+#endif
+        }
+
+        void *allocate(size_t size, size_t alignment) {
+            auto budget = budget_bytes.load(std::memory_order_relaxed);
+            if (budget != 0 && size >= budget_fail_size && get_used_bytes() + size > budget && may_throw())
+                throw budget_exceeded(size, budget);
+
+            size = std::max<size_t>(size, 1);
+            void *pointer;
+#if defined(_WIN32)
+            pointer = alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? _aligned_malloc(size, alignment) : std::malloc(size);
+#else
+            if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+                if (posix_memalign(&pointer, alignment, size) != 0)
+                    pointer = nullptr;
+            } else {
+                pointer = std::malloc(size);
+            }
+#endif
+            if (pointer == nullptr)
+                throw std::bad_alloc();
+
+            auto usable_size = get_usable_size(pointer, alignment);
+            on_usage_changed(allocated_bytes.fetch_add(usable_size, std::memory_order_relaxed) + usable_size +
+                             mapped_bytes.load(std::memory_order_relaxed));
+            return pointer;
+        }
+
+        void deallocate(void *pointer, size_t alignment) noexcept {
+            if (pointer == nullptr)
+                return;
+
+            allocated_bytes.fetch_sub(get_usable_size(pointer, alignment), std::memory_order_relaxed);
+#if defined(_WIN32)
+            if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+                _aligned_free(pointer);
+                return;
+            }
+#endif
+            std::free(pointer);
+        }
+
+    }
+
+    size_t get_allocated_bytes() {
+        return allocated_bytes.load(std::memory_order_relaxed);
+    }
+
+    size_t get_mapped_bytes() {
+        return mapped_bytes.load(std::memory_order_relaxed);
+    }
+
+    void add_mapped_bytes(size_t size) {
+        on_usage_changed(mapped_bytes.fetch_add(size, std::memory_order_relaxed) + size +
+                         allocated_bytes.load(std::memory_order_relaxed));
+    }
+
+    void remove_mapped_bytes(size_t size) {
+        mapped_bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    void set_budget(size_t bytes) {
+        budget_bytes = bytes;
+        budget_overshoot = 0;
+    }
+
+    void check_budget(std::string_view context) {
+        auto overshoot = get_overshoot().exchange(0, std::memory_order_relaxed);
+        if (overshoot == 0)
+            return;
+
+        throw std::runtime_error(std::format("Memory budget of {:.1f} MB exceeded {}, {:.1f} MB were in use",
+                                             static_cast<double>(budget_bytes.load()) / megabyte, context,
+                                             static_cast<double>(overshoot) / megabyte));
+    }
+
+    level_scope::level_scope(level_usage &usage)
+        : usage(usage), outer_usage(current_usage), outer_level_window(current_level_window) {
+        usage.start_bytes = get_used_bytes();
+        window = open_window(true);
+        current_usage = &usage;
+        current_level_window = window;
+    }
+
+    level_scope::~level_scope() {
+        usage.peak_bytes = close_window(window, usage.start_bytes);
+        current_usage = outer_usage;
+        current_level_window = outer_level_window;
+    }
+
+    stage_scope::stage_scope(std::string_view name) : usage(current_usage) {
+        if (get_overshoot().load(std::memory_order_relaxed) != 0)
+            check_budget(std::format("before {}", name));
+        if (usage == nullptr)
+            return;
+
+        stage_index = usage->stages.size();
+        usage->stages.push_back(stage_usage{
+            .name = std::string(name),
+            .depth = current_depth,
+            .start_bytes = get_used_bytes(),
+            .end_bytes = 0,
+            .peak_bytes = 0,
+            .mapped_bytes = 0,
+        });
+
+        window = open_window(false);
+        ++current_depth;
+    }
+
+    stage_scope::~stage_scope() {
+        if (usage == nullptr)
+            return;
+
+        --current_depth;
+        auto &stage = usage->stages[stage_index];
+        stage.end_bytes = get_used_bytes();
+        stage.peak_bytes = close_window(window, stage.start_bytes);
+        stage.mapped_bytes = get_mapped_bytes();
+    }
+
+    std::string format_level_usage(std::string_view level_name, const level_usage &usage) {
+        auto to_megabytes = [](size_t bytes) {
+            return static_cast<double>(bytes) / megabyte;
+        };
+
+        auto result = std::format("{}: peak {:.1f} MB, {:.1f} MB in use before the level",
+                                  level_name, to_megabytes(usage.peak_bytes), to_megabytes(usage.start_bytes));
+        for (auto &stage : usage.stages) {
+            result += std::format("\n  {:{}}{:<{}} peak {:>9.1f} MB, {:>+9.1f} MB kept, {:>9.1f} MB mapped",
+                                  "", stage.depth * 2, stage.name, std::max(20u, stage.depth * 2) - stage.depth * 2, to_megabytes(stage.peak_bytes),
+                                  to_megabytes(stage.end_bytes) - to_megabytes(stage.start_bytes), to_megabytes(stage.mapped_bytes));
+        }
+        return result;
+    }
+
+}
+
+// Replacing the plain and aligned forms is enough, the nothrow, array and sized forms of the standard library call them
+
+void *operator new(std::size_t size) {
+    return voxlife::memory::allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void *operator new[](std::size_t size) {
+    return voxlife::memory::allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return voxlife::memory::allocate(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return voxlife::memory::allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *pointer) noexcept {
+    voxlife::memory::deallocate(pointer, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete[](void *pointer) noexcept {
+    voxlife::memory::deallocate(pointer, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    voxlife::memory::deallocate(pointer, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept {
+    voxlife::memory::deallocate(pointer, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void *pointer, std::align_val_t alignment) noexcept {
+    voxlife::memory::deallocate(pointer, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *pointer, std::align_val_t alignment) noexcept {
+    voxlife::memory::deallocate(pointer, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *pointer, std::size_t, std::align_val_t alignment) noexcept {
+    voxlife::memory::deallocate(pointer, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *pointer, std::size_t, std::align_val_t alignment) noexcept {
+    voxlife::memory::deallocate(pointer, static_cast<size_t>(alignment));
+}
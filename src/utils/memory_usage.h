@@ -0,0 +1,86 @@
+
+#ifndef VOXLIFE_UTILS_MEMORY_USAGE_H
+#define VOXLIFE_UTILS_MEMORY_USAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Every global operator new and delete of the program is counted, together with the bytes of memory mapped files.
+// Levels and the stages inside them record the peak of the process while they ran, when levels are converted
+// concurrently the numbers of a level include whatever the other levels allocated at the same time. Up to 64 levels
+// and stages can run at once, further ones report the higher of their start and end usage.
+namespace voxlife::memory {
+
+    struct stage_usage {
+        std::string name;
+        uint32_t depth;         // nesting level below the level itself
+        size_t start_bytes;     // allocated and mapped bytes when the stage started
+        size_t end_bytes;
+        size_t peak_bytes;
+        size_t mapped_bytes;    // mapped bytes when the stage ended
+    };
+
+    struct level_usage {
+        std::vector<stage_usage> stages;    // in the order they started
+        size_t start_bytes = 0;
+        size_t peak_bytes = 0;
+    };
+
+    size_t get_allocated_bytes();
+    size_t get_mapped_bytes();
+
+    // Called by the file readers for every mapping they create and remove
+    void add_mapped_bytes(size_t size);
+    void remove_mapped_bytes(size_t size);
+
+    // Allocated plus mapped bytes above the budget make the next check_budget of the level throw, zero disables the
+    // budget. Allocations on the thread of a level count against that level, those on threads outside of any level,
+    // like OpenMP workers, against every level running at the time. A single allocation of at least a megabyte that
+    // would cross the budget fails right away with std::bad_alloc, unless it happens inside an OpenMP parallel region.
+    void set_budget(size_t bytes);
+
+    // Throws std::runtime_error if the budget was exceeded since the last check, by the level of this thread or
+    // outside of any level. Context ends the message.
+    void check_budget(std::string_view context);
+
+    // Collects the stages of one level converted on this thread
+    class level_scope {
+    public:
+        explicit level_scope(level_usage &usage);
+        ~level_scope();
+
+        level_scope(const level_scope &) = delete;
+        level_scope &operator=(const level_scope &) = delete;
+
+    private:
+        level_usage &usage;
+        level_usage *outer_usage;
+        uint32_t outer_level_window;
+        uint32_t window;
+    };
+
+    // Checks the budget, then records the peak of everything allocated until the scope ends. Does nothing
+    // besides the check outside of a level_scope.
+    class stage_scope {
+    public:
+        explicit stage_scope(std::string_view name);
+        ~stage_scope();
+
+        stage_scope(const stage_scope &) = delete;
+        stage_scope &operator=(const stage_scope &) = delete;
+
+    private:
+        level_usage *usage;
+        size_t stage_index = 0;
+        uint32_t window = 0;
+    };
+
+    // One line for the level and one per stage, indented by depth
+    std::string format_level_usage(std::string_view level_name, const level_usage &usage);
+
+}
+
+#endif //VOXLIFE_UTILS_MEMORY_USAGE_H
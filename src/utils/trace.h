@@ -0,0 +1,201 @@
+#ifndef VOXLIFE_TRACE_H
+#define VOXLIFE_TRACE_H
+
+// Scoped zones and counters, exported as Chrome trace JSON that chrome://tracing and ui.perfetto.dev open directly.
+// Only compiled in with VOXLIFE_ENABLE_TRACING, otherwise the macros expand to nothing and their arguments are not
+// evaluated. Even when compiled in, nothing is recorded until start_tracing is called.
+
+#if defined(VOXLIFE_ENABLE_TRACING)
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+namespace voxlife::trace {
+
+    struct event {
+        const char *name;
+        char phase;                 // 'X' for a complete zone, 'C' for a counter
+        uint32_t thread_id;
+        int64_t start_us;
+        int64_t duration_us;
+        std::string detail;
+        std::vector<std::pair<const char *, int64_t>> counters;
+    };
+
+    struct trace_state {
+        std::atomic<bool> enabled = false;
+        std::chrono::steady_clock::time_point start_time;
+        std::atomic<uint32_t> next_thread_id = 0;
+        std::mutex mutex;
+        std::vector<event> events;
+    };
+
+    inline trace_state state;
+
+    class scoped_zone;
+
+    // Innermost open zone of the calling thread, counters recorded on this thread are attached to it
+    inline thread_local scoped_zone *current_zone = nullptr;
+
+    inline void start_tracing() {
+        state.start_time = std::chrono::steady_clock::now();
+        state.enabled = true;
+    }
+
+    inline bool is_tracing() {
+        return state.enabled.load(std::memory_order_relaxed);
+    }
+
+    inline int64_t now_us() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - state.start_time).count();
+    }
+
+    // Small sequential ids read better in the trace viewer than hashed std::thread::id values
+    inline uint32_t get_thread_id() {
+        thread_local uint32_t id = state.next_thread_id.fetch_add(1);
+        return id;
+    }
+
+    inline void record(event &&e) {
+        std::lock_guard lock(state.mutex);
+        state.events.push_back(std::move(e));
+    }
+
+    class scoped_zone {
+    public:
+        explicit scoped_zone(const char *name, std::string_view detail = {}) {
+            if (!is_tracing())
+                return;
+
+            active = true;
+            parent = current_zone;
+            current_zone = this;
+            zone.name = name;
+            zone.phase = 'X';
+            zone.thread_id = get_thread_id();
+            zone.detail = detail;
+            zone.start_us = now_us();
+        }
+
+        ~scoped_zone() {
+            if (!active)
+                return;
+
+            zone.duration_us = now_us() - zone.start_us;
+            current_zone = parent;
+            record(std::move(zone));
+        }
+
+        scoped_zone(const scoped_zone &) = delete;
+        scoped_zone &operator=(const scoped_zone &) = delete;
+
+        void add_counter(const char *name, int64_t value) {
+            for (auto &[counter_name, counter_value] : zone.counters) {
+                if (std::string_view(counter_name) == name) {
+                    counter_value += value;
+                    return;
+                }
+            }
+            zone.counters.emplace_back(name, value);
+        }
+
+    private:
+        bool active = false;
+        scoped_zone *parent = nullptr;
+        event zone{};
+    };
+
+    // Counters are summed into the args of the innermost zone and also emitted as a counter track
+    inline void add_counter(const char *name, int64_t value) {
+        if (!is_tracing())
+            return;
+
+        if (current_zone != nullptr)
+            current_zone->add_counter(name, value);
+
+        record(event{
+            .name = name,
+            .phase = 'C',
+            .thread_id = get_thread_id(),
+            .start_us = now_us(),
+            .duration_us = 0,
+            .counters = {{"value", value}},
+        });
+    }
+
+    inline void write_json_string(std::ofstream &file, std::string_view s) {
+        file << '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\')
+                file << '\\' << c;
+            else if (static_cast<unsigned char>(c) < 0x20)
+                file << ' ';
+            else
+                file << c;
+        }
+        file << '"';
+    }
+
+    // Writes every event recorded so far, returns false if the file could not be written
+    inline bool write_chrome_trace(const std::string &path) {
+        std::ofstream file(path, std::ios::trunc);
+        if (!file)
+            return false;
+
+        std::lock_guard lock(state.mutex);
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (size_t i = 0; i < state.events.size(); ++i) {
+            auto &e = state.events[i];
+            file << "{\"name\":";
+            write_json_string(file, e.name);
+            file << ",\"ph\":\"" << e.phase << "\",\"pid\":1,\"tid\":" << e.thread_id << ",\"ts\":" << e.start_us;
+            if (e.phase == 'X')
+                file << ",\"dur\":" << e.duration_us;
+
+            file << ",\"args\":{";
+            bool first = true;
+            if (!e.detail.empty()) {
+                file << "\"detail\":";
+                write_json_string(file, e.detail);
+                first = false;
+            }
+            for (auto &[name, value] : e.counters) {
+                if (!first)
+                    file << ',';
+                write_json_string(file, name);
+                file << ':' << value;
+                first = false;
+            }
+            file << "}}" << (i + 1 < state.events.size() ? ",\n" : "\n");
+        }
+        file << "]}\n";
+
+        return static_cast<bool>(file);
+    }
+
+}
+
+#define VOXLIFE_TRACE_CONCAT_IMPL(a, b) a##b
+#define VOXLIFE_TRACE_CONCAT(a, b) VOXLIFE_TRACE_CONCAT_IMPL(a, b)
+#define VOXLIFE_TRACE_ZONE(name) ::voxlife::trace::scoped_zone VOXLIFE_TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define VOXLIFE_TRACE_ZONE_DETAIL(name, detail) ::voxlife::trace::scoped_zone VOXLIFE_TRACE_CONCAT(trace_zone_, __LINE__)(name, detail)
+#define VOXLIFE_TRACE_COUNTER(name, value) ::voxlife::trace::add_counter(name, static_cast<int64_t>(value))
+
+#else
+
+#define VOXLIFE_TRACE_ZONE(name)
+#define VOXLIFE_TRACE_ZONE_DETAIL(name, detail)
+#define VOXLIFE_TRACE_COUNTER(name, value)
+
+#endif
+
+
+#endif //VOXLIFE_TRACE_H
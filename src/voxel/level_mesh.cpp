@@ -0,0 +1,174 @@
+#include <voxel/level_mesh.h>
+#include <voxel/cooridnates.h>
+#include <utils/trace.h>
+
+#include <glm/geometric.hpp>
+#include <glm/vector_relational.hpp>
+
+#include <algorithm>
+#include <array>
+#include <map>
+
+
+namespace {
+
+    using tile_key = std::array<int32_t, 3>;
+
+    // Keeps the part of a convex polygon on one side of an axis aligned plane
+    void clip_polygon(std::vector<glm::vec3> &polygon, std::vector<glm::vec3> &scratch, int axis, float limit, bool keep_below) {
+        scratch.clear();
+
+        auto inside = [&](const glm::vec3 &v) {
+            return keep_below ? v[axis] <= limit : v[axis] >= limit;
+        };
+
+        for (size_t i = 0; i < polygon.size(); ++i) {
+            const glm::vec3 &a = polygon[i];
+            const glm::vec3 &b = polygon[(i + 1) % polygon.size()];
+
+            if (inside(a))
+                scratch.push_back(a);
+
+            if (inside(a) != inside(b)) {
+                float t = (limit - a[axis]) / (b[axis] - a[axis]);
+                glm::vec3 v = a + (b - a) * t;
+                v[axis] = limit;
+                scratch.push_back(v);
+            }
+        }
+
+        std::swap(polygon, scratch);
+    }
+
+}
+
+LevelMesh build_level_mesh(voxlife::bsp::bsp_handle bsp_handle) {
+    VOXLIFE_TRACE_ZONE("build_level_mesh");
+    auto faces = voxlife::bsp::get_model_faces(bsp_handle, 0);
+    VOXLIFE_TRACE_COUNTER("faces", faces.size());
+    LevelMesh mesh;
+
+    // A face of n vertices becomes n - 2 triangles
+    mesh.vertices.reserve((faces.vertices.size() - std::min(faces.vertices.size(), faces.size() * 2)) * 3);
+
+    auto to_voxel_space = [](glm::vec3 v) {
+        return glm::vec3(v.x, v.y, v.z) * voxlife::voxel::hammer_to_teardown_scale;
+    };
+
+    // Model that the faces of a tile are currently appended to
+    std::map<tile_key, uint32_t> tile_models;
+
+    std::vector<glm::vec3> face_polygon;
+    std::vector<glm::vec3> polygon;
+    std::vector<glm::vec3> scratch;
+
+    auto add_polygon = [&](uint32_t face_id, uint32_t texture_id, glm::ivec3 tile) {
+        glm::vec3 tile_min = glm::vec3(tile) * static_cast<float>(level_tile_size);
+        glm::vec3 tile_max = tile_min + static_cast<float>(level_tile_size);
+
+        // Vertices on the upper tile border would otherwise grow the volume by one voxel past the tile
+        glm::vec3 face_aabb_min = glm::floor(polygon[0]);
+        glm::vec3 face_aabb_max = glm::floor(polygon[0]) + 1.0f;
+        for (auto const &v : polygon) {
+            face_aabb_min = glm::min(face_aabb_min, glm::floor(v));
+            face_aabb_max = glm::max(face_aabb_max, glm::floor(v) + 1.0f);
+        }
+        face_aabb_min = glm::clamp(face_aabb_min, tile_min, tile_max - 1.0f);
+        face_aabb_max = glm::clamp(face_aabb_max, face_aabb_min + 1.0f, tile_max);
+
+        auto [it, inserted] = tile_models.try_emplace({tile.x, tile.y, tile.z}, static_cast<uint32_t>(mesh.models.size()));
+        if (inserted || mesh.models[it->second].texture_id != texture_id) {
+            it->second = static_cast<uint32_t>(mesh.models.size());
+            mesh.models.push_back({
+                .aabb_min = face_aabb_min,
+                .aabb_max = face_aabb_max,
+                .texture_id = texture_id,
+            });
+        }
+
+        auto model_id = it->second;
+        auto &model = mesh.models[model_id];
+        model.aabb_min = glm::min(face_aabb_min, model.aabb_min);
+        model.aabb_max = glm::max(face_aabb_max, model.aabb_max);
+
+        auto uv_at = [&](glm::vec3 v) {
+            return faces.get_uv(face_id, v * voxlife::voxel::teardown_to_hammer_scale);
+        };
+
+        auto triangle_count = polygon.size() - 2;
+        glm::vec3 v0 = polygon[0];
+        glm::vec3 v1 = polygon[1];
+        glm::vec2 uv0 = uv_at(v0);
+        glm::vec2 uv1 = uv_at(v1);
+
+        for (size_t i = 0; i < triangle_count; ++i) {
+            glm::vec3 v2 = polygon[i + 2];
+            glm::vec2 uv2 = uv_at(v2);
+
+            mesh.vertices.push_back({v0, uv0, model_id, texture_id});
+            mesh.vertices.push_back({v1, uv1, model_id, texture_id});
+            mesh.vertices.push_back({v2, uv2, model_id, texture_id});
+
+            v1 = v2;
+            uv1 = uv2;
+        }
+    };
+
+    for (uint32_t face_id = 0; face_id < faces.size(); ++face_id) {
+        auto texture_id = faces.texture_ids[face_id];
+        auto vertices = faces.get_vertices(face_id);
+
+        if (voxlife::bsp::get_texture_flags(bsp_handle, texture_id) & voxlife::bsp::TEXTURE_SKY)
+            continue;
+
+        if (vertices.size() < 3)
+            continue;
+
+        face_polygon.clear();
+        for (auto const &v : vertices)
+            face_polygon.push_back(to_voxel_space(v));
+
+        glm::vec3 face_min = face_polygon[0];
+        glm::vec3 face_max = face_polygon[0];
+        for (auto const &v : face_polygon) {
+            face_min = glm::min(face_min, v);
+            face_max = glm::max(face_max, v);
+        }
+
+        auto tile_min = glm::ivec3(glm::floor(face_min / static_cast<float>(level_tile_size)));
+        auto tile_max = glm::ivec3(glm::floor(face_max / static_cast<float>(level_tile_size)));
+
+        // Most faces lie in a single tile and keep their original polygon
+        if (tile_min == tile_max) {
+            polygon = face_polygon;
+            add_polygon(face_id, texture_id, tile_min);
+            continue;
+        }
+
+        for (int32_t z = tile_min.z; z <= tile_max.z; ++z) {
+            for (int32_t y = tile_min.y; y <= tile_max.y; ++y) {
+                for (int32_t x = tile_min.x; x <= tile_max.x; ++x) {
+                    glm::ivec3 tile(x, y, z);
+                    glm::vec3 bounds_min = glm::vec3(tile) * static_cast<float>(level_tile_size);
+                    glm::vec3 bounds_max = bounds_min + static_cast<float>(level_tile_size);
+
+                    // The last tile along an axis already ends with the face, so it is not clipped from above
+                    polygon = face_polygon;
+                    for (int axis = 0; axis < 3 && polygon.size() >= 3; ++axis) {
+                        clip_polygon(polygon, scratch, axis, bounds_min[axis], false);
+                        if (polygon.size() >= 3 && tile[axis] != tile_max[axis])
+                            clip_polygon(polygon, scratch, axis, bounds_max[axis], true);
+                    }
+
+                    if (polygon.size() >= 3)
+                        add_polygon(face_id, texture_id, tile);
+                }
+            }
+        }
+    }
+
+    VOXLIFE_TRACE_COUNTER("triangles", mesh.vertices.size() / 3);
+    VOXLIFE_TRACE_COUNTER("models", mesh.models.size());
+
+    return mesh;
+}
@@ -0,0 +1,48 @@
+#ifndef VOXLIFE_VOXEL_LEVEL_MESH_H
+#define VOXLIFE_VOXEL_LEVEL_MESH_H
+
+#include <bsp/read_file.h>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/common.hpp>
+
+#include <vector>
+#include <cstdint>
+
+// Triangle soup of a level in voxel space, shared by all voxelizer backends
+struct MeshVertex {
+    glm::vec3 pos;          // voxel space
+    glm::vec2 uv;           // normalized texture coordinates
+    uint32_t model_id;      // index into LevelMesh::models
+    uint32_t texture_id;    // bsp texture id
+};
+
+struct MeshModel {
+    glm::vec3 aabb_min{};
+    glm::vec3 aabb_max{};
+    uint32_t texture_id{};
+
+    auto get_extent() const {
+        return glm::round(aabb_max - aabb_min);
+    }
+
+    // Extent of the backing voxel volume, never zero on any axis
+    glm::uvec3 get_volume_extent() const {
+        return glm::max(glm::vec3(1), glm::round(aabb_max - aabb_min));
+    }
+};
+
+struct LevelMesh {
+    std::vector<MeshVertex> vertices;   // triangle list, three vertices per triangle
+    std::vector<MeshModel> models;
+};
+
+// Edge length in voxels of the aligned tiles a level is cut into, the largest model Teardown accepts
+constexpr int32_t level_tile_size = 256;
+
+// Triangulates the world model and cuts it into aligned tiles, faces crossing a tile border are clipped.
+// Every tile starts a new model whenever the texture changes, and each model is shrunk to the voxels it covers.
+LevelMesh build_level_mesh(voxlife::bsp::bsp_handle handle);
+
+#endif //VOXLIFE_VOXEL_LEVEL_MESH_H
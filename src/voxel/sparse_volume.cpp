@@ -0,0 +1,106 @@
+#include <voxel/sparse_volume.h>
+
+#include <glm/common.hpp>
+#include <glm/vector_relational.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace {
+
+    // Spreads the lower 10 bits of v so that two zero bits follow every bit
+    uint32_t part_1_by_2(uint32_t v) {
+        v &= 0x000003ff;
+        v = (v ^ (v << 16)) & 0xff0000ff;
+        v = (v ^ (v << 8))  & 0x0300f00f;
+        v = (v ^ (v << 4))  & 0x030c30c3;
+        v = (v ^ (v << 2))  & 0x09249249;
+        return v;
+    }
+
+    uint32_t compact_1_by_2(uint32_t v) {
+        v &= 0x09249249;
+        v = (v ^ (v >> 2))  & 0x030c30c3;
+        v = (v ^ (v >> 4))  & 0x0300f00f;
+        v = (v ^ (v >> 8))  & 0xff0000ff;
+        v = (v ^ (v >> 16)) & 0x000003ff;
+        return v;
+    }
+
+}
+
+SparseVolume::SparseVolume(glm::uvec3 extent) : extent(extent) {
+    grid = (extent + glm::uvec3(brick_size - 1)) / glm::uvec3(brick_size);
+
+    if (std::max({grid.x, grid.y, grid.z}) > 1024)
+        throw std::length_error("Sparse volume extent exceeds the Morton code range");
+
+    brick_table.resize(static_cast<size_t>(grid.x) * grid.y * grid.z, 0);
+}
+
+SparseVolume SparseVolume::from_dense(std::span<const Voxel> voxels, glm::uvec3 extent) {
+    SparseVolume result(extent);
+
+    for (uint32_t z = 0; z < extent.z; ++z) {
+        for (uint32_t y = 0; y < extent.y; ++y) {
+            for (uint32_t x = 0; x < extent.x; ++x) {
+                auto &voxel = voxels[x + static_cast<size_t>(y) * extent.x + static_cast<size_t>(z) * extent.x * extent.y];
+                if (voxel.material != MaterialType::AIR)
+                    result.set(glm::ivec3(x, y, z), voxel);
+            }
+        }
+    }
+
+    return result;
+}
+
+Voxel SparseVolume::get(glm::ivec3 pos) const {
+    if (glm::any(glm::lessThan(pos, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(glm::uvec3(pos), extent)))
+        return {};
+
+    auto brick_index = brick_table[get_table_index(glm::uvec3(pos) / glm::uvec3(brick_size))];
+    if (brick_index == 0)
+        return {};
+
+    glm::ivec3 local = pos % brick_size;
+    return bricks[brick_index - 1].voxels[local.x + local.y * brick_size + local.z * brick_size * brick_size];
+}
+
+void SparseVolume::set(glm::ivec3 pos, Voxel voxel) {
+    if (glm::any(glm::lessThan(pos, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(glm::uvec3(pos), extent)))
+        throw std::out_of_range("Voxel position outside of the sparse volume");
+
+    glm::uvec3 brick_pos = glm::uvec3(pos) / glm::uvec3(brick_size);
+    auto &brick_index = brick_table[get_table_index(brick_pos)];
+    if (brick_index == 0) {
+        if (voxel.material == MaterialType::AIR)
+            return;
+
+        bricks.emplace_back();
+        brick_codes.push_back(encode_morton(brick_pos));
+        brick_index = static_cast<uint32_t>(bricks.size());
+    }
+
+    auto &brick = bricks[brick_index - 1];
+    glm::ivec3 local = pos % brick_size;
+    auto index = static_cast<uint32_t>(local.x + local.y * brick_size + local.z * brick_size * brick_size);
+
+    brick.voxels[index] = voxel;
+    if (voxel.material != MaterialType::AIR)
+        brick.occupancy[index / 64] |= uint64_t(1) << (index % 64);
+    else
+        brick.occupancy[index / 64] &= ~(uint64_t(1) << (index % 64));
+}
+
+uint32_t SparseVolume::encode_morton(glm::uvec3 brick) {
+    return part_1_by_2(brick.x) | (part_1_by_2(brick.y) << 1) | (part_1_by_2(brick.z) << 2);
+}
+
+glm::ivec3 SparseVolume::decode_morton(uint32_t code) {
+    return {
+        static_cast<int32_t>(compact_1_by_2(code)),
+        static_cast<int32_t>(compact_1_by_2(code >> 1)),
+        static_cast<int32_t>(compact_1_by_2(code >> 2)),
+    };
+}
@@ -0,0 +1,110 @@
+#ifndef VOXLIFE_VOXEL_SPARSE_VOLUME_H
+#define VOXLIFE_VOXEL_SPARSE_VOLUME_H
+
+#include <glm/vec3.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+enum MaterialType : uint8_t {
+    AIR,
+    UN_PHYSICAL,
+    HARD_MASONRY,
+    HARD_METAL,
+    PLASTIC,
+    HEAVY_METAL,
+    WEAK_METAL,
+    PLASTER,
+    BRICK,
+    CONCRETE,
+    WOOD,
+    ROCK,
+    DIRT,
+    GRASS,
+    GLASS,
+    MATERIAL_ALL_TYPES,
+    MATERIAL_TYPE_MAX,
+};
+
+struct Voxel {
+    glm::u8vec3 color;
+    MaterialType material = MaterialType::AIR;
+};
+
+// Volume of voxels stored as 8^3 bricks, only bricks holding at least one voxel are allocated.
+// Memory and iteration time scale with the number of occupied bricks instead of the extent, apart from a table
+// of one index per brick of the extent.
+class SparseVolume {
+public:
+    static constexpr int32_t brick_size = 8;
+    static constexpr uint32_t brick_voxel_count = brick_size * brick_size * brick_size;
+
+    struct Brick {
+        std::array<uint64_t, brick_voxel_count / 64> occupancy{};   // one bit per voxel that is not air
+        std::array<Voxel, brick_voxel_count> voxels{};              // x fastest, then y, then z
+    };
+
+    SparseVolume() = default;
+    explicit SparseVolume(glm::uvec3 extent);
+
+    // Copies the voxels that are not air out of a dense x-major buffer of the given extent
+    static SparseVolume from_dense(std::span<const Voxel> voxels, glm::uvec3 extent);
+
+    glm::uvec3 get_extent() const {
+        return extent;
+    }
+
+    size_t get_brick_count() const {
+        return bricks.size();
+    }
+
+    // Positions outside of the extent read as air
+    Voxel get(glm::ivec3 pos) const;
+
+    // Writing air clears the voxel, its brick stays allocated
+    void set(glm::ivec3 pos, Voxel voxel);
+
+    // Calls f(glm::ivec3 pos, const Voxel &voxel) for every voxel that is not air, bricks are visited in Morton order
+    template<typename F>
+    void for_each_voxel(F &&f) const {
+        // Bricks are stored in the order they were first written, which depends on the thread schedule of the
+        // voxelizer, so the visit order comes from their Morton codes. Code in the upper half, brick in the lower.
+        std::vector<uint64_t> order(bricks.size());
+        for (uint32_t i = 0; i < bricks.size(); ++i)
+            order[i] = (static_cast<uint64_t>(brick_codes[i]) << 32) | i;
+        std::sort(order.begin(), order.end());
+
+        for (uint64_t key : order) {
+            auto &brick = bricks[static_cast<uint32_t>(key)];
+            glm::ivec3 brick_min = decode_morton(static_cast<uint32_t>(key >> 32)) * brick_size;
+
+            for (uint32_t word = 0; word < brick.occupancy.size(); ++word) {
+                for (uint64_t bits = brick.occupancy[word]; bits != 0; bits &= bits - 1) {
+                    auto index = word * 64 + static_cast<uint32_t>(std::countr_zero(bits));
+                    glm::ivec3 local(index % brick_size, (index / brick_size) % brick_size, index / (brick_size * brick_size));
+                    f(brick_min + local, brick.voxels[index]);
+                }
+            }
+        }
+    }
+
+private:
+    static uint32_t encode_morton(glm::uvec3 brick);
+    static glm::ivec3 decode_morton(uint32_t code);
+
+    size_t get_table_index(glm::uvec3 brick) const {
+        return brick.x + grid.x * (brick.y + static_cast<size_t>(grid.y) * brick.z);
+    }
+
+    glm::uvec3 extent{};
+    glm::uvec3 grid{};                  // extent in bricks
+    std::vector<uint32_t> brick_table;  // one entry per brick of the grid, x fastest, index into bricks plus one or zero
+    std::vector<Brick> bricks;
+    std::vector<uint32_t> brick_codes;  // Morton code of every brick, parallel to bricks
+};
+
+#endif //VOXLIFE_VOXEL_SPARSE_VOLUME_H
@@ -1,6 +1,7 @@
 #include "voxelize_bsp.h"
 
 #include <chrono>
+#include <cstring>
 #include <daxa/daxa.hpp>
 
 #include <daxa/pipeline.hpp>
@@ -16,7 +17,11 @@
 
 #include "test/application.h"
 #include <thread>
+#include <mutex>
 #include "write_file.h"
+#include "level_mesh.h"
+#include <utils/trace.h>
+#include <utils/memory_usage.h>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/vec_swizzle.hpp>
@@ -57,19 +62,11 @@ void upload_frame_constants_task(daxa::TaskGraph &tg, daxa::TaskBufferView frame
 struct TextureManifest {
     daxa::ImageId image;
 };
-struct CpuModelManifest {
+struct CpuModelManifest : MeshModel {
     daxa::BufferId voxel_buffer;
 
-    glm::vec3 aabb_min{};
-    glm::vec3 aabb_max{};
-    uint32_t texture_id{};
-
-    auto get_extent() const {
-        return glm::round(aabb_max - aabb_min);
-    }
-
     void finalize(daxa::Device &device) {
-        glm::uvec3 volume_extent = glm::max(glm::vec3(1), glm::round(aabb_max - aabb_min));
+        glm::uvec3 volume_extent = get_volume_extent();
         voxel_buffer = device.create_buffer({
             .size = volume_extent.x * volume_extent.y * volume_extent.z * sizeof(GpuVoxel),
             .name = "model voxels",
@@ -155,112 +152,43 @@ void deinit(VoxelizeApp *self) {
 }
 
 void init_bsp_data(VoxelizeApp *self, voxlife::bsp::bsp_handle bsp_handle) {
-    auto faces = voxlife::bsp::get_model_faces(bsp_handle, 0);
+    VOXLIFE_TRACE_ZONE("init_bsp_data");
+    auto mesh = build_level_mesh(bsp_handle);
     self->vertices.clear();
     self->texture_manifests.clear();
     self->model_manifests.clear();
 
-    bool aabb_set = false;
-    uint32_t model_id = 0;
-
-    auto to_voxel_space = [](glm::vec3 v) {
-        return glm::vec3(v.x, v.y, v.z) * (0.0254f / 0.1f);
-    };
-
-    for (auto &face : faces) {
-        auto texture_name = voxlife::bsp::get_texture_name(bsp_handle, face.texture_id);
-        auto texture = voxlife::bsp::get_texture_data(bsp_handle, face.texture_id);
-
-        if (texture_name == "SKY" || texture_name == "sky")
-            continue;
-
-        glm::vec3 face_aabb_min = glm::floor(to_voxel_space(face.vertices[0]));
-        glm::vec3 face_aabb_max = glm::floor(to_voxel_space(face.vertices[0]) + 1.0f);
-        for (auto const &v : face.vertices) {
-            face_aabb_min = glm::min(face_aabb_min, glm::floor(to_voxel_space(v)));
-            face_aabb_max = glm::max(face_aabb_max, glm::floor(to_voxel_space(v) + 1.0f));
-        }
-
-        if (self->model_manifests.empty()) {
-            CpuModelManifest model;
-            model.aabb_min = face_aabb_min;
-            model.aabb_max = face_aabb_max;
-            model.texture_id = face.texture_id;
-            self->model_manifests.push_back(model);
-        }
-        auto *model = &self->model_manifests.back();
-
-        auto new_aabb_min = glm::min(face_aabb_min, model->aabb_min);
-        auto new_aabb_max = glm::max(face_aabb_max, model->aabb_max);
-
-        bool has_new_texture = face.texture_id != model->texture_id;
-        bool new_model_very_big = glm::any(glm::greaterThan(new_aabb_max - new_aabb_min, glm::vec3(250.0f)));
-        bool would_double_size = glm::any(glm::greaterThan(new_aabb_max - new_aabb_min, 2.0f * (model->aabb_max - model->aabb_min)));
-        bool curr_model_very_small = glm::any(glm::lessThan(model->aabb_max - model->aabb_min, glm::vec3(20.0f)));
-
-        if (has_new_texture || new_model_very_big) {
-            self->model_manifests.back().finalize(self->device);
-
-            {
-                self->model_manifests.push_back({});
-                model = &self->model_manifests.back();
-                model->aabb_min = face_aabb_min;
-                model->aabb_max = face_aabb_max;
-                model->texture_id = face.texture_id;
-            }
-        }
-        model->aabb_min = glm::min(face_aabb_min, model->aabb_min);
-        model->aabb_max = glm::max(face_aabb_max, model->aabb_max);
+    self->model_manifests.reserve(mesh.models.size());
+    for (auto const &mesh_model : mesh.models) {
+        CpuModelManifest model;
+        static_cast<MeshModel &>(model) = mesh_model;
+        model.finalize(self->device);
+        self->model_manifests.push_back(model);
+    }
 
+    self->vertices.reserve(mesh.vertices.size());
+    for (auto const &mesh_vertex : mesh.vertices) {
         auto tex = TextureManifest{};
-        if (!self->texture_manifests.contains(face.texture_id)) {
+        if (!self->texture_manifests.contains(mesh_vertex.texture_id)) {
+            auto texture = voxlife::bsp::get_texture_data(bsp_handle, mesh_vertex.texture_id);
             tex.image = self->device.create_image({
                 .format = daxa::Format::R8G8B8A8_SRGB,
                 .size = {texture.size.x, texture.size.y, 1},
                 .usage = daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_SRC | daxa::ImageUsageFlagBits::TRANSFER_DST,
                 .name = "image",
             });
-            self->texture_manifests[face.texture_id] = tex;
+            self->texture_manifests[mesh_vertex.texture_id] = tex;
         } else {
-            tex = self->texture_manifests[face.texture_id];
+            tex = self->texture_manifests[mesh_vertex.texture_id];
         }
 
-        auto triangle_count = face.vertices.size() - 2;
-        glm::vec3 v0, v1, v2;
-        v0 = to_voxel_space(face.vertices[0]);
-        v1 = to_voxel_space(face.vertices[1]);
-
-        glm::vec2 uv0, uv1, uv2;
-        uv0.x = (glm::dot(face.texture_coords.x.axis, face.vertices[0]) + face.texture_coords.x.shift) / float(texture.size.x);
-        uv0.y = (glm::dot(face.texture_coords.y.axis, face.vertices[0]) + face.texture_coords.y.shift) / float(texture.size.y);
-        uv1.x = (glm::dot(face.texture_coords.x.axis, face.vertices[1]) + face.texture_coords.x.shift) / float(texture.size.x);
-        uv1.y = (glm::dot(face.texture_coords.y.axis, face.vertices[1]) + face.texture_coords.y.shift) / float(texture.size.y);
-
-        for (int i = 0; i < triangle_count; ++i) {
-            v2 = to_voxel_space(face.vertices[i + 2]);
-            uv2.x = (glm::dot(face.texture_coords.x.axis, face.vertices[i + 2]) + face.texture_coords.x.shift) / float(texture.size.x);
-            uv2.y = (glm::dot(face.texture_coords.y.axis, face.vertices[i + 2]) + face.texture_coords.y.shift) / float(texture.size.y);
-            auto v = MyVertex{};
-            v.tex_id = daxa_ImageViewIndex(tex.image.default_view().index);
-            v.model_id = self->model_manifests.size() - 1;
-
-            v.pos = {v0.x, v0.y, v0.z};
-            v.uv = {uv0.x, uv0.y};
-            self->vertices.push_back(v);
-
-            v.pos = {v1.x, v1.y, v1.z};
-            v.uv = {uv1.x, uv1.y};
-            self->vertices.push_back(v);
-
-            v.pos = {v2.x, v2.y, v2.z};
-            v.uv = {uv2.x, uv2.y};
-            self->vertices.push_back(v);
-
-            v1 = v2;
-            uv1 = uv2;
-        }
+        auto v = MyVertex{};
+        v.tex_id = daxa_ImageViewIndex(tex.image.default_view().index);
+        v.model_id = mesh_vertex.model_id;
+        v.pos = {mesh_vertex.pos.x, mesh_vertex.pos.y, mesh_vertex.pos.z};
+        v.uv = {mesh_vertex.uv.x, mesh_vertex.uv.y};
+        self->vertices.push_back(v);
     }
-    self->model_manifests.back().finalize(self->device);
 
     auto model_manifests_buffer_id = self->device.create_buffer({
         .size = sizeof(GpuModelManifest) * self->model_manifests.size(),
@@ -693,6 +621,7 @@ void record_frame(VoxelizeApp *self) {
 auto t0 = Clock::now();
 
 void upload_data(VoxelizeApp *self, voxlife::bsp::bsp_handle bsp_handle) {
+    VOXLIFE_TRACE_ZONE("upload_data");
     auto task_graph = daxa::TaskGraph({
         .device = self->device,
         .name = "upload",
@@ -732,12 +661,7 @@ void upload_data(VoxelizeApp *self, voxlife::bsp::bsp_handle bsp_handle) {
                 });
                 ti.recorder.destroy_buffer_deferred(staging_buffer_id);
                 auto *buffer_ptr = ti.device.buffer_host_address_as<unsigned char>(staging_buffer_id).value();
-                for (uint32_t i = 0; i < bsp_tex.size.x * bsp_tex.size.y; ++i) {
-                    buffer_ptr[i * 4 + 0] = bsp_tex.data[i].r;
-                    buffer_ptr[i * 4 + 1] = bsp_tex.data[i].g;
-                    buffer_ptr[i * 4 + 2] = bsp_tex.data[i].b;
-                    buffer_ptr[i * 4 + 3] = 255;
-                }
+                std::memcpy(buffer_ptr, bsp_tex.data.data(), size);
                 ti.recorder.copy_buffer_to_image({
                     .buffer = staging_buffer_id,
                     .image = tex.image,
@@ -755,7 +679,8 @@ void upload_data(VoxelizeApp *self, voxlife::bsp::bsp_handle bsp_handle) {
     task_graph.execute({});
 }
 
-void download_data(VoxelizeApp *self, std::string_view level_name, std::vector<struct Model> &models) {
+void download_data(VoxelizeApp *self, std::string_view level_name, const voxlife::voxel::voxelize_options &options, std::vector<struct Model> &models) {
+    VOXLIFE_TRACE_ZONE("download_data");
     auto task_graph = daxa::TaskGraph({
         .device = self->device,
         .name = "download",
@@ -764,9 +689,6 @@ void download_data(VoxelizeApp *self, std::string_view level_name, std::vector<s
 
     auto model_buffers = std::vector<daxa::BufferId>{};
     model_buffers.reserve(self->model_manifests.size());
-    models.reserve(self->model_manifests.size());
-
-    auto voxel_models = std::unordered_map<uint32_t, std::vector<VoxelModel>>{};
 
     task_graph.add_task({
         .attachments = {
@@ -786,14 +708,6 @@ void download_data(VoxelizeApp *self, std::string_view level_name, std::vector<s
                     .dst_buffer = staging_buffer_id,
                     .size = buffer_size,
                 });
-
-                auto voxel_model = VoxelModel{
-                    .voxels = std::span(ti.device.buffer_host_address_as<Voxel>(staging_buffer_id).value(), buffer_size / sizeof(Voxel)),
-                    .pos = glm::i32vec3(glm::floor((model.aabb_min + model.aabb_max) * 0.5f)),
-                    .size = model.get_extent(),
-                };
-                if (all(lessThanEqual(voxel_model.size, glm::uvec3(256))))
-                    voxel_models[model.texture_id].push_back(voxel_model);
             }
         },
         .name = "download data",
@@ -805,21 +719,30 @@ void download_data(VoxelizeApp *self, std::string_view level_name, std::vector<s
 
     self->device.wait_idle();
 
-    std::filesystem::create_directories(std::format("brush/{}", level_name));
-
-    for (int model_index = 0; model_index < voxel_models.size(); ++model_index) {
-        auto it = voxel_models.begin();
-        std::advance(it, model_index);
-        auto const &[texture_id, voxel_model_list] = *it;
-        write_magicavoxel_model(std::format("brush/{}/{}.vox", level_name, model_index), std::span(voxel_model_list));
-
-        models.emplace_back();
-        auto &out_model = models.back();
-        out_model.name = std::format("{}", model_index);
-        out_model.size = {};
-        out_model.pos = {};
+    // The gpu writes dense buffers, only their occupied bricks are kept for the writer
+    auto volumes = std::vector<SparseVolume>{};
+    auto voxel_models = std::vector<VoxelModel>{};
+    auto texture_ids = std::vector<uint32_t>{};
+    volumes.reserve(self->model_manifests.size());
+    voxel_models.reserve(self->model_manifests.size());
+    texture_ids.reserve(self->model_manifests.size());
+
+    for (size_t i = 0; i < self->model_manifests.size(); ++i) {
+        auto const &model = self->model_manifests[i];
+        auto buffer_size = self->device.buffer_info(model_buffers[i]).value().size;
+        auto dense_voxels = std::span(self->device.buffer_host_address_as<Voxel>(model_buffers[i]).value(), buffer_size / sizeof(Voxel));
+        volumes.push_back(SparseVolume::from_dense(dense_voxels, model.get_volume_extent()));
+
+        voxel_models.push_back(VoxelModel{
+            .volume = &volumes[i],
+            .pos = glm::i32vec3(glm::floor((model.aabb_min + model.aabb_max) * 0.5f)),
+            .size = model.get_extent(),
+        });
+        texture_ids.push_back(model.texture_id);
     }
 
+    write_brush_models(level_name, voxel_models, texture_ids, options.level_palette, models);
+
     for (auto &buffer : model_buffers)
         self->device.destroy_buffer(buffer);
 }
@@ -889,14 +812,29 @@ void voxelization_gui(voxlife::bsp::bsp_handle bsp_handle) {
     deinit(&app);
 }
 
-void voxelize_gpu(voxlife::bsp::bsp_handle bsp_handle, std::string_view level_name, std::vector<struct Model> &models) {
+void voxelize_gpu(voxlife::bsp::bsp_handle bsp_handle, std::string_view level_name, const voxlife::voxel::voxelize_options &options, std::vector<struct Model> &models) {
+    // There is only one device and window, concurrent levels take turns on it
+    static std::mutex app_mutex;
+    std::lock_guard lock(app_mutex);
+
+    // Constructed by the first call, so runs with the cpu backend never reach Vulkan. The instance, device and
+    // pipelines are still created anew for every level by init and init_pipelines.
     static auto app = VoxelizeApp();
     init(&app);
-    init_bsp_data(&app, bsp_handle);
-    init_pipelines(&app);
-    upload_data(&app, bsp_handle);
-    record_frame(&app);
-    update(&app);
-    download_data(&app, level_name, models);
+    {
+        voxlife::memory::stage_scope stage("upload");
+        init_bsp_data(&app, bsp_handle);
+        init_pipelines(&app);
+        upload_data(&app, bsp_handle);
+    }
+    {
+        VOXLIFE_TRACE_ZONE("gpu voxelize");
+        record_frame(&app);
+        update(&app);
+    }
+    {
+        voxlife::memory::stage_scope stage("download");
+        download_data(&app, level_name, options, models);
+    }
     deinit(&app);
 }
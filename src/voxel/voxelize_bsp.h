@@ -1,6 +1,7 @@
 #pragma once
 
 #include <bsp/read_file.h>
+#include <voxel/voxelizer.h>
 
 void voxelization_gui(voxlife::bsp::bsp_handle handle);
-void voxelize_gpu(voxlife::bsp::bsp_handle handle, std::string_view level_name, std::vector<struct Model> &models);
+void voxelize_gpu(voxlife::bsp::bsp_handle handle, std::string_view level_name, const voxlife::voxel::voxelize_options &options, std::vector<struct Model> &models);
@@ -0,0 +1,527 @@
+#include "voxelize_cpu.h"
+
+#include <bsp/primitives.h>
+#include <voxel/cooridnates.h>
+#include <utils/trace.h>
+#include <utils/memory_usage.h>
+
+#include <glm/geometric.hpp>
+#include <glm/vector_relational.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <span>
+
+
+namespace {
+
+    constexpr int32_t bin_size = 32;        // edge length of a binning tile in voxels
+    constexpr int32_t raster_size = 256;    // size of the gpu voxelization viewport
+    constexpr float raster_depth = 256.0f;  // depth range covered by the gpu viewport
+
+    // Standard 8x sample locations, matching the msaa voxelization pipeline
+    constexpr std::array<glm::vec2, 8> msaa_sample_positions = {{
+        {0.5625f, 0.3125f},
+        {0.4375f, 0.6875f},
+        {0.8125f, 0.5625f},
+        {0.3125f, 0.1875f},
+        {0.1875f, 0.8125f},
+        {0.0625f, 0.4375f},
+        {0.6875f, 0.9375f},
+        {0.9375f, 0.0625f},
+    }};
+
+    struct TriangleSetup {
+        glm::vec3 pos[3];       // raster space: x, y and depth
+        glm::vec2 uv[3];
+        glm::ivec3 voxel_min;   // conservative voxel bounds in model space
+        glm::ivec3 voxel_max;
+        uint32_t side;          // dominant axis, selects the projection swizzle
+        float inv_area;
+        bool valid;
+    };
+
+    struct SampledTexture {
+        const glm::u8vec4 *data = nullptr;
+        glm::u32vec2 size{};
+    };
+
+    // Swaps the dominant axis into depth, the same swizzles as the voxelize preprocess shader.
+    // Every swizzle is its own inverse, so this also maps raster space back to model space.
+    glm::vec3 swizzle(glm::vec3 v, uint32_t side) {
+        switch (side) {
+            case 0: return {v.z, v.y, v.x};
+            case 1: return {v.x, v.z, v.y};
+            default: return v;
+        }
+    }
+
+    glm::ivec3 swizzle(glm::ivec3 v, uint32_t side) {
+        switch (side) {
+            case 0: return {v.z, v.y, v.x};
+            case 1: return {v.x, v.z, v.y};
+            default: return v;
+        }
+    }
+
+    float edge_function(glm::vec2 a, glm::vec2 b, glm::vec2 p) {
+        return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+    }
+
+    float srgb_eotf(float a) {
+        return .04045f < a ? std::pow((a + .055f) / 1.055f, 2.4f) : a / 12.92f;
+    }
+
+    float srgb_oetf(float a) {
+        return .0031308f >= a ? 12.92f * a : 1.055f * std::pow(a, .4166666666666667f) - .055f;
+    }
+
+    auto create_srgb_to_linear_table() {
+        std::array<float, 256> result{};
+        for (uint32_t i = 0; i < 256; ++i)
+            result[i] = srgb_eotf(static_cast<float>(i) / 255.0f);
+
+        return result;
+    }
+
+    const auto srgb_to_linear = create_srgb_to_linear_table();
+
+    int32_t wrap(int32_t i, uint32_t n) {
+        i %= static_cast<int32_t>(n);
+        return i < 0 ? i + static_cast<int32_t>(n) : i;
+    }
+
+    // Emulates sampling an R8G8B8A8_SRGB image with a repeating sampler and packing the result like pack_color
+    glm::u8vec3 sample_texture(const SampledTexture &texture, glm::vec2 uv, bool nearest) {
+        if (texture.data == nullptr || texture.size.x == 0 || texture.size.y == 0)
+            return {};
+
+        auto fetch = [&](int32_t x, int32_t y) {
+            auto texel = texture.data[wrap(y, texture.size.y) * texture.size.x + wrap(x, texture.size.x)];
+            return glm::vec3(srgb_to_linear[texel.r], srgb_to_linear[texel.g], srgb_to_linear[texel.b]);
+        };
+
+        glm::vec2 texel_pos = uv * glm::vec2(texture.size);
+        glm::vec3 color;
+
+        if (nearest) {
+            color = fetch(static_cast<int32_t>(std::floor(texel_pos.x)), static_cast<int32_t>(std::floor(texel_pos.y)));
+        } else {
+            texel_pos -= 0.5f;
+            glm::vec2 base = glm::floor(texel_pos);
+            glm::vec2 f = texel_pos - base;
+            auto x = static_cast<int32_t>(base.x);
+            auto y = static_cast<int32_t>(base.y);
+
+            glm::vec3 top    = fetch(x, y)     * (1.0f - f.x) + fetch(x + 1, y)     * f.x;
+            glm::vec3 bottom = fetch(x, y + 1) * (1.0f - f.x) + fetch(x + 1, y + 1) * f.x;
+            color = top * (1.0f - f.y) + bottom * f.y;
+        }
+
+        return {
+            static_cast<uint8_t>(srgb_oetf(color.r) * 255.0f),
+            static_cast<uint8_t>(srgb_oetf(color.g) * 255.0f),
+            static_cast<uint8_t>(srgb_oetf(color.b) * 255.0f),
+        };
+    }
+
+    // Mean color of a texture, interior voxels have no texture coordinates to sample with
+    glm::u8vec3 average_texture_color(const SampledTexture &texture) {
+        if (texture.data == nullptr || texture.size.x == 0 || texture.size.y == 0)
+            return {};
+
+        glm::vec3 sum(0.0f);
+        const size_t texel_count = static_cast<size_t>(texture.size.x) * texture.size.y;
+        for (size_t i = 0; i < texel_count; ++i)
+            sum += glm::vec3(srgb_to_linear[texture.data[i].r], srgb_to_linear[texture.data[i].g], srgb_to_linear[texture.data[i].b]);
+
+        glm::vec3 color = sum / static_cast<float>(texel_count);
+        return {
+            static_cast<uint8_t>(srgb_oetf(color.r) * 255.0f),
+            static_cast<uint8_t>(srgb_oetf(color.g) * 255.0f),
+            static_cast<uint8_t>(srgb_oetf(color.b) * 255.0f),
+        };
+    }
+
+    TriangleSetup setup_triangle(const MeshVertex *vertices, const MeshModel &model) {
+        TriangleSetup result{};
+
+        glm::vec3 local[3];
+        for (int i = 0; i < 3; ++i)
+            local[i] = vertices[i].pos - model.aabb_min;
+
+        glm::vec3 normal = glm::cross(local[1] - local[0], local[2] - local[0]);
+        float dx = std::abs(normal.x);
+        float dy = std::abs(normal.y);
+        float dz = std::abs(normal.z);
+
+        if (dx > dy)
+            result.side = dx > dz ? 0 : 2;
+        else
+            result.side = dy > dz ? 1 : 2;
+
+        for (int i = 0; i < 3; ++i) {
+            result.pos[i] = swizzle(local[i], result.side);
+            result.uv[i] = vertices[i].uv;
+        }
+
+        float area = edge_function(glm::vec2(result.pos[0]), glm::vec2(result.pos[1]), glm::vec2(result.pos[2]));
+        if (area < 0.0f) {
+            std::swap(result.pos[1], result.pos[2]);
+            std::swap(result.uv[1], result.uv[2]);
+            area = -area;
+        }
+
+        result.valid = area > 0.0f && std::isfinite(area);
+        result.inv_area = result.valid ? 1.0f / area : 0.0f;
+
+        // Sub-samples and depth extrapolated from the pixel center may land up to two voxels outside
+        // of the triangle bounds, the dominant axis guarantees a depth slope of at most one per pixel
+        glm::vec3 local_min = glm::min(glm::min(local[0], local[1]), local[2]);
+        glm::vec3 local_max = glm::max(glm::max(local[0], local[1]), local[2]);
+        glm::ivec3 volume_max = glm::ivec3(model.get_volume_extent()) - 1;
+
+        result.voxel_min = glm::clamp(glm::ivec3(glm::floor(local_min)) - 2, glm::ivec3(0), volume_max);
+        result.voxel_max = glm::clamp(glm::ivec3(glm::floor(local_max)) + 2, glm::ivec3(0), volume_max);
+
+        return result;
+    }
+
+    // Rasterizes one triangle into the dense voxels of a bin, only writing voxels inside of [bin_min, bin_max)
+    void rasterize_triangle(const TriangleSetup &tri, const SampledTexture &texture, const CpuVoxelizeSettings &settings,
+                            glm::ivec3 bin_min, glm::ivec3 bin_max, glm::ivec3 volume_extent, std::span<Voxel> bin_voxels) {
+        // Fragments outside of the volume are clamped onto its border, so border bins own everything beyond
+        glm::ivec3 raster_min = swizzle(bin_min, tri.side);
+        glm::ivec3 raster_max = swizzle(glm::ivec3(
+            bin_max.x == volume_extent.x ? raster_size : bin_max.x,
+            bin_max.y == volume_extent.y ? raster_size : bin_max.y,
+            bin_max.z == volume_extent.z ? raster_size : bin_max.z), tri.side);
+
+        glm::vec2 p0 = glm::vec2(tri.pos[0]);
+        glm::vec2 p1 = glm::vec2(tri.pos[1]);
+        glm::vec2 p2 = glm::vec2(tri.pos[2]);
+
+        glm::vec2 tri_min = glm::min(glm::min(p0, p1), p2);
+        glm::vec2 tri_max = glm::max(glm::max(p0, p1), p2);
+
+        int32_t x_begin = std::max({0, static_cast<int32_t>(std::floor(tri_min.x)) - 1, raster_min.x});
+        int32_t y_begin = std::max({0, static_cast<int32_t>(std::floor(tri_min.y)) - 1, raster_min.y});
+        int32_t x_end = std::min({raster_size, static_cast<int32_t>(std::floor(tri_max.x)) + 2, raster_max.x});
+        int32_t y_end = std::min({raster_size, static_cast<int32_t>(std::floor(tri_max.y)) + 2, raster_max.y});
+
+        auto is_inside = [&](glm::vec2 p) {
+            return edge_function(p1, p2, p) >= 0.0f && edge_function(p2, p0, p) >= 0.0f && edge_function(p0, p1, p) >= 0.0f;
+        };
+
+        glm::vec3 volume_limit = glm::vec3(volume_extent - 1);
+
+        for (int32_t y = y_begin; y < y_end; ++y) {
+            for (int32_t x = x_begin; x < x_end; ++x) {
+                glm::vec2 center = glm::vec2(static_cast<float>(x), static_cast<float>(y)) + 0.5f;
+
+                bool covered = false;
+                if (settings.use_msaa) {
+                    for (auto &sample : msaa_sample_positions) {
+                        if (is_inside(glm::vec2(static_cast<float>(x), static_cast<float>(y)) + sample)) {
+                            covered = true;
+                            break;
+                        }
+                    }
+                } else {
+                    covered = is_inside(center);
+                }
+
+                if (!covered)
+                    continue;
+
+                // Attributes are evaluated at the pixel center, even if only a sub-sample was covered
+                float l0 = edge_function(p1, p2, center) * tri.inv_area;
+                float l1 = edge_function(p2, p0, center) * tri.inv_area;
+                float l2 = 1.0f - l0 - l1;
+
+                float depth = l0 * tri.pos[0].z + l1 * tri.pos[1].z + l2 * tri.pos[2].z;
+                if (depth < 0.0f || depth > raster_depth)
+                    continue;
+
+                glm::vec3 p = swizzle(glm::vec3(center, depth), tri.side);
+                glm::ivec3 vp = glm::ivec3(glm::clamp(glm::floor(p), glm::vec3(0.0f), volume_limit));
+
+                if (glm::any(glm::lessThan(vp, bin_min)) || glm::any(glm::greaterThanEqual(vp, bin_max)))
+                    continue;
+
+                glm::vec2 uv = l0 * tri.uv[0] + l1 * tri.uv[1] + l2 * tri.uv[2];
+
+                glm::ivec3 bin_pos = vp - bin_min;
+                size_t index = static_cast<size_t>(bin_pos.x) +
+                               static_cast<size_t>(bin_pos.y) * bin_size +
+                               static_cast<size_t>(bin_pos.z) * bin_size * bin_size;
+
+                bin_voxels[index] = Voxel{
+                    .color = sample_texture(texture, uv, settings.use_nearest),
+                    .material = MaterialType::WEAK_METAL,
+                };
+            }
+        }
+    }
+
+    // Finds the empty voxels of one z slice of a model whose centers lie in solid space, as x + y * extent.x. Voxels held
+    // by the volume of an earlier model, or by a surface voxel of a later one, are skipped. Only reads the volumes.
+    void fill_solid_slice(voxlife::bsp::bsp_handle handle, const LevelMesh &mesh, std::span<const uint32_t> overlaps,
+                          uint32_t model_id, int32_t z, const std::vector<SparseVolume> &volumes, std::vector<uint32_t> &filled) {
+        auto &model = mesh.models[model_id];
+        glm::ivec3 extent = glm::ivec3(model.get_volume_extent());
+        glm::ivec3 origin = glm::ivec3(model.aabb_min);
+        int32_t world_z = origin.z + z;
+
+        std::vector<uint8_t> blocked(static_cast<size_t>(extent.x) * extent.y, 0);
+        for (auto other_id : overlaps) {
+            auto &other = mesh.models[other_id];
+            glm::ivec3 other_extent = glm::ivec3(other.get_volume_extent());
+            glm::ivec3 other_origin = glm::ivec3(other.aabb_min);
+
+            if (world_z < other_origin.z || world_z >= other_origin.z + other_extent.z)
+                continue;
+
+            glm::ivec2 begin = glm::max(glm::ivec2(origin), glm::ivec2(other_origin));
+            glm::ivec2 end = glm::min(glm::ivec2(origin + extent), glm::ivec2(other_origin + other_extent));
+            auto &other_volume = volumes[other_id];
+
+            for (int32_t y = begin.y; y < end.y; ++y) {
+                for (int32_t x = begin.x; x < end.x; ++x) {
+                    size_t local = static_cast<size_t>(x - origin.x) + static_cast<size_t>(y - origin.y) * extent.x;
+
+                    if (other_id < model_id || other_volume.get(glm::ivec3(x, y, world_z) - other_origin).material != MaterialType::AIR)
+                        blocked[local] = 1;
+                }
+            }
+        }
+
+        auto &volume = volumes[model_id];
+
+        std::vector<glm::vec3> points;
+        std::vector<uint32_t> indices;
+        for (int32_t y = 0; y < extent.y; ++y) {
+            for (int32_t x = 0; x < extent.x; ++x) {
+                auto local = static_cast<uint32_t>(x + y * extent.x);
+                if (blocked[local] || volume.get(glm::ivec3(x, y, z)).material != MaterialType::AIR)
+                    continue;
+
+                glm::vec3 center = glm::vec3(origin + glm::ivec3(x, y, z)) + 0.5f;
+                points.push_back(center * voxlife::voxel::teardown_to_hammer_scale);
+                indices.push_back(local);
+            }
+        }
+
+        std::vector<int32_t> contents(points.size());
+        voxlife::bsp::get_point_contents(handle, points, contents);
+
+        for (size_t i = 0; i < indices.size(); ++i) {
+            if (contents[i] == voxlife::bsp::lump_leaf::CONTENTS_SOLID)
+                filled.push_back(indices[i]);
+        }
+    }
+
+}
+
+void voxelize_mesh_cpu(voxlife::bsp::bsp_handle handle, const LevelMesh &mesh, std::vector<SparseVolume> &volumes, const CpuVoxelizeSettings &settings) {
+    VOXLIFE_TRACE_ZONE("voxelize_mesh_cpu");
+    const auto model_count = mesh.models.size();
+    const auto triangle_count = static_cast<int64_t>(mesh.vertices.size() / 3);
+
+    volumes.clear();
+    volumes.reserve(model_count);
+
+    // Bins are tiles of bin_size^3 voxels, each model owns a contiguous range of bins
+    std::vector<glm::ivec3> bin_grids(model_count);
+    std::vector<uint32_t> bin_offsets(model_count + 1, 0);
+    for (size_t i = 0; i < model_count; ++i) {
+        auto extent = mesh.models[i].get_volume_extent();
+        volumes.emplace_back(extent);
+
+        bin_grids[i] = (glm::ivec3(extent) + bin_size - 1) / bin_size;
+        bin_offsets[i + 1] = bin_offsets[i] + bin_grids[i].x * bin_grids[i].y * bin_grids[i].z;
+    }
+
+    std::vector<TriangleSetup> triangles(triangle_count);
+
+#pragma omp parallel for schedule(static)
+    for (int64_t i = 0; i < triangle_count; ++i) {
+        const MeshVertex *vertices = &mesh.vertices[i * 3];
+        triangles[i] = setup_triangle(vertices, mesh.models[vertices[0].model_id]);
+    }
+
+    auto for_each_bin = [&](int64_t triangle_index, auto &&f) {
+        auto &tri = triangles[triangle_index];
+        if (!tri.valid)
+            return;
+
+        auto model_id = mesh.vertices[triangle_index * 3].model_id;
+        auto &grid = bin_grids[model_id];
+        glm::ivec3 bin_min = tri.voxel_min / bin_size;
+        glm::ivec3 bin_max = tri.voxel_max / bin_size;
+
+        for (int32_t z = bin_min.z; z <= bin_max.z; ++z)
+            for (int32_t y = bin_min.y; y <= bin_max.y; ++y)
+                for (int32_t x = bin_min.x; x <= bin_max.x; ++x)
+                    f(bin_offsets[model_id] + x + y * grid.x + z * grid.x * grid.y);
+    };
+
+    // Build the bin lists in triangle order, so every bin replays its triangles in stream order
+    const auto bin_count = bin_offsets.back();
+    std::vector<uint32_t> bin_starts(bin_count + 1, 0);
+    for (int64_t i = 0; i < triangle_count; ++i)
+        for_each_bin(i, [&](uint32_t bin) { bin_starts[bin + 1]++; });
+
+    for (uint32_t i = 0; i < bin_count; ++i)
+        bin_starts[i + 1] += bin_starts[i];
+
+    std::vector<uint32_t> bin_triangles(bin_starts.back());
+    std::vector<uint32_t> bin_fill(bin_starts.begin(), bin_starts.end() - 1);
+    for (int64_t i = 0; i < triangle_count; ++i)
+        for_each_bin(i, [&](uint32_t bin) { bin_triangles[bin_fill[bin]++] = static_cast<uint32_t>(i); });
+
+    // Only the textures referenced by the mesh are decoded
+    std::vector<uint32_t> texture_ids;
+    for (auto &model : mesh.models)
+        texture_ids.push_back(model.texture_id);
+
+    std::sort(texture_ids.begin(), texture_ids.end());
+    texture_ids.erase(std::unique(texture_ids.begin(), texture_ids.end()), texture_ids.end());
+    voxlife::bsp::prefetch_textures(handle, texture_ids);
+
+    std::vector<SampledTexture> textures(texture_ids.empty() ? 0 : texture_ids.back() + 1);
+    for (auto texture_id : texture_ids) {
+        auto texture = voxlife::bsp::get_texture_data(handle, texture_id);
+        textures[texture_id] = {texture.data.data(), texture.size};
+    }
+
+    // Bins own disjoint voxels and are rasterized concurrently into dense scratch voxels. Bin edges are multiples
+    // of the brick size, so copying the result into the sparse volume only has to guard the brick allocation.
+    std::vector<std::mutex> volume_mutexes(model_count);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int64_t bin = 0; bin < static_cast<int64_t>(bin_count); ++bin) {
+        if (bin_starts[bin] == bin_starts[bin + 1])
+            continue;
+
+        thread_local std::vector<Voxel> bin_voxels;
+        bin_voxels.assign(bin_size * bin_size * bin_size, Voxel{});
+
+        auto model_id = static_cast<uint32_t>(std::upper_bound(bin_offsets.begin(), bin_offsets.end(), static_cast<uint32_t>(bin)) - bin_offsets.begin() - 1);
+        auto &grid = bin_grids[model_id];
+        auto local_bin = static_cast<int32_t>(bin - bin_offsets[model_id]);
+        glm::ivec3 bin_coord = glm::ivec3(local_bin % grid.x, (local_bin / grid.x) % grid.y, local_bin / (grid.x * grid.y));
+
+        glm::ivec3 volume_extent = glm::ivec3(mesh.models[model_id].get_volume_extent());
+        glm::ivec3 bin_min = bin_coord * bin_size;
+        glm::ivec3 bin_max = glm::min(bin_min + bin_size, volume_extent);
+
+        for (uint32_t i = bin_starts[bin]; i < bin_starts[bin + 1]; ++i) {
+            auto triangle_index = bin_triangles[i];
+            auto &texture = textures[mesh.vertices[triangle_index * 3].texture_id];
+            rasterize_triangle(triangles[triangle_index], texture, settings, bin_min, bin_max, volume_extent, bin_voxels);
+        }
+
+        std::lock_guard lock(volume_mutexes[model_id]);
+        for (int32_t z = bin_min.z; z < bin_max.z; ++z) {
+            for (int32_t y = bin_min.y; y < bin_max.y; ++y) {
+                for (int32_t x = bin_min.x; x < bin_max.x; ++x) {
+                    auto &voxel = bin_voxels[(x - bin_min.x) + (y - bin_min.y) * bin_size + (z - bin_min.z) * bin_size * bin_size];
+                    if (voxel.material != MaterialType::AIR)
+                        volumes[model_id].set(glm::ivec3(x, y, z), voxel);
+                }
+            }
+        }
+    }
+
+    if (!settings.fill_solid)
+        return;
+
+    VOXLIFE_TRACE_ZONE("fill solid");
+
+    // Other models whose volumes share voxels with a model, these decide who owns the interior of the shared region
+    std::vector<std::vector<uint32_t>> overlaps(model_count);
+    for (uint32_t i = 0; i < model_count; ++i) {
+        for (uint32_t j = i + 1; j < model_count; ++j) {
+            auto &a = mesh.models[i];
+            auto &b = mesh.models[j];
+            glm::vec3 a_max = a.aabb_min + glm::vec3(a.get_volume_extent());
+            glm::vec3 b_max = b.aabb_min + glm::vec3(b.get_volume_extent());
+
+            if (glm::all(glm::lessThan(a.aabb_min, b_max)) && glm::all(glm::lessThan(b.aabb_min, a_max))) {
+                overlaps[i].push_back(j);
+                overlaps[j].push_back(i);
+            }
+        }
+    }
+
+    std::vector<glm::u8vec3> fill_colors(textures.size());
+    for (auto texture_id : texture_ids)
+        fill_colors[texture_id] = average_texture_color(textures[texture_id]);
+
+    // Every model owns a contiguous range of z slices. Slices are classified concurrently while the volumes are
+    // only read, afterwards every model applies the voxels found in its own slices.
+    std::vector<uint32_t> slice_offsets(model_count + 1, 0);
+    for (size_t i = 0; i < model_count; ++i)
+        slice_offsets[i + 1] = slice_offsets[i] + mesh.models[i].get_volume_extent().z;
+
+    std::vector<std::vector<uint32_t>> filled_slices(slice_offsets.back());
+
+#pragma omp parallel for schedule(dynamic)
+    for (int64_t slice = 0; slice < static_cast<int64_t>(slice_offsets.back()); ++slice) {
+        auto model_id = static_cast<uint32_t>(std::upper_bound(slice_offsets.begin(), slice_offsets.end(), static_cast<uint32_t>(slice)) - slice_offsets.begin() - 1);
+        auto z = static_cast<int32_t>(slice - slice_offsets[model_id]);
+
+        fill_solid_slice(handle, mesh, overlaps[model_id], model_id, z, volumes, filled_slices[slice]);
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (int64_t model_id = 0; model_id < static_cast<int64_t>(model_count); ++model_id) {
+        auto extent_x = static_cast<uint32_t>(mesh.models[model_id].get_volume_extent().x);
+        Voxel fill{
+            .color = fill_colors[mesh.models[model_id].texture_id],
+            .material = MaterialType::WEAK_METAL,
+        };
+
+        for (uint32_t slice = slice_offsets[model_id]; slice < slice_offsets[model_id + 1]; ++slice) {
+            auto z = static_cast<int32_t>(slice - slice_offsets[model_id]);
+            for (auto local : filled_slices[slice])
+                volumes[model_id].set(glm::ivec3(local % extent_x, local / extent_x, z), fill);
+        }
+    }
+}
+
+void voxelize_cpu(voxlife::bsp::bsp_handle handle, std::string_view level_name, const voxlife::voxel::voxelize_options &options, std::vector<struct Model> &models) {
+    LevelMesh mesh;
+    {
+        voxlife::memory::stage_scope stage("mesh");
+        mesh = build_level_mesh(handle);
+    }
+
+    std::vector<SparseVolume> volumes;
+    {
+        voxlife::memory::stage_scope stage("rasterize");
+        voxelize_mesh_cpu(handle, mesh, volumes, {.fill_solid = options.fill_solid});
+    }
+
+    std::vector<VoxelModel> voxel_models;
+    std::vector<uint32_t> texture_ids;
+    voxel_models.reserve(mesh.models.size());
+    texture_ids.reserve(mesh.models.size());
+
+    for (size_t i = 0; i < mesh.models.size(); ++i) {
+        auto &model = mesh.models[i];
+        voxel_models.push_back(VoxelModel{
+            .volume = &volumes[i],
+            .pos = glm::i32vec3(glm::floor((model.aabb_min + model.aabb_max) * 0.5f)),
+            .size = model.get_extent(),
+        });
+        texture_ids.push_back(model.texture_id);
+    }
+
+    voxlife::memory::stage_scope stage("brush models");
+    write_brush_models(level_name, voxel_models, texture_ids, options.level_palette, models);
+}
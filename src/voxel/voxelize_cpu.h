@@ -0,0 +1,22 @@
+#pragma once
+
+#include <bsp/read_file.h>
+#include <voxel/level_mesh.h>
+#include <voxel/sparse_volume.h>
+#include <voxel/voxelizer.h>
+#include <voxel/write_file.h>
+
+#include <vector>
+
+struct CpuVoxelizeSettings {
+    bool use_msaa = true;       // cover a voxel if any of 8 sub-samples hits, like the msaa raster pipeline
+    bool use_nearest = false;   // nearest instead of bilinear texture filtering
+    bool fill_solid = false;    // also fill voxels whose center lies in a solid leaf of the world hull
+};
+
+// Rasterizes the mesh into one sparse volume per model, covering the same voxels as the gpu voxel buffers.
+// Overlapping writes resolve in triangle order, the last triangle of the stream always wins.
+// Solid fill never overwrites surface voxels, an interior voxel belongs to the first model whose volume holds it.
+void voxelize_mesh_cpu(voxlife::bsp::bsp_handle handle, const LevelMesh &mesh, std::vector<SparseVolume> &volumes, const CpuVoxelizeSettings &settings = {});
+
+void voxelize_cpu(voxlife::bsp::bsp_handle handle, std::string_view level_name, const voxlife::voxel::voxelize_options &options, std::vector<struct Model> &models);
@@ -0,0 +1,48 @@
+#ifndef VOXLIFE_VOXEL_VOXELIZER_H
+#define VOXLIFE_VOXEL_VOXELIZER_H
+
+#include <bsp/read_file.h>
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+struct Model;
+
+
+namespace voxlife::voxel {
+
+    enum class backend_type : uint32_t {
+        cpu,
+        gpu,
+        BACKEND_TYPE_MAX
+    };
+
+    constexpr const char* backend_names[] = {
+            /* [backend_type::cpu] = */ "cpu",
+            /* [backend_type::gpu] = */ "gpu",
+    };
+
+    // Options that change how a level is voxelized, the same for every level of a run
+    struct voxelize_options {
+        bool fill_solid = false;    // also fill voxels whose center lies in a solid leaf of the world hull, cpu only
+        bool level_palette = false; // one palette clustered from all voxels of the level for every brush file
+    };
+
+    // Voxelizes the world model of a level, writes its brush .vox files and appends them to models
+    using voxelize_fn = void (*)(bsp::bsp_handle handle, std::string_view level_name, const voxelize_options &options, std::vector<Model> &models);
+
+    inline std::optional<backend_type> parse_backend_type(std::string_view name) {
+        for (uint32_t i = 0; i < static_cast<uint32_t>(backend_type::BACKEND_TYPE_MAX); ++i) {
+            if (name == backend_names[i])
+                return static_cast<backend_type>(i);
+        }
+
+        return std::nullopt;
+    }
+
+}
+
+
+#endif //VOXLIFE_VOXEL_VOXELIZER_H
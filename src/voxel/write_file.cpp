@@ -1,8 +1,8 @@
 #include <numeric>
-#define OGT_VOX_IMPLEMENTATION
-#include <ogt_vox.h>
+#include <cstring>
 
 #include <voxel/write_file.h>
+#include <utils/trace.h>
 
 #include <vector>
 #include <cstdio>
@@ -12,13 +12,21 @@
 #include <array>
 #include <algorithm>
 #include <random>
+#include <glm/vec4.hpp>
 #include <glm/geometric.hpp>
+#include <glm/vector_relational.hpp>
 #include <iostream>
 #include <filesystem>
 #include <cmath>
 #include <set>
 #include <fstream>
 #include <unordered_set>
+#include <unordered_map>
+#include <optional>
+#include <bit>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
 
 auto rgb_to_oklab(glm::vec3 rgb) -> glm::vec3 {
     // Normalize the RGB values to the range [0, 1]
@@ -63,6 +71,19 @@ auto oklab_to_rgb(glm::vec3 oklab) -> glm::vec3 {
     return rgb;
 }
 
+// Batched conversions, both are linear maps so the loops vectorize once the scalar versions are inlined
+void rgb_to_oklab(std::span<const glm::vec3> rgb, std::span<glm::vec3> oklab) {
+#pragma omp simd
+    for (size_t i = 0; i < rgb.size(); ++i)
+        oklab[i] = rgb_to_oklab(rgb[i]);
+}
+
+void oklab_to_rgb(std::span<const glm::vec3> oklab, std::span<glm::vec3> rgb) {
+#pragma omp simd
+    for (size_t i = 0; i < oklab.size(); ++i)
+        rgb[i] = oklab_to_rgb(oklab[i]);
+}
+
 struct MaterialTypeSlot {
     uint32_t slot_count;
     uint32_t slot_offset;
@@ -88,25 +109,86 @@ constexpr std::array<MaterialTypeSlot, MATERIAL_TYPE_MAX> material_type_slots{{
 }};
 
 struct MaterialData {
-    std::unordered_map<uint32_t, size_t> color_to_index;  // Packed RGB color to unique color index
-    std::vector<glm::u8vec3> unique_colors;               // Unique RGB colors
-    std::vector<std::pair<size_t, size_t>> voxel_indices; // Pairs of (model index, voxel index)
-    std::vector<size_t> voxel_color_indices;              // Unique color index per voxel
+    std::vector<uint32_t> packed_colors;                  // Packed RGB colors of the voxels until color_bits is allocated
+    std::vector<uint64_t> color_bits;                     // One presence bit per packed RGB color, for materials with many voxels
+    std::vector<glm::u8vec3> unique_colors;               // Unique RGB colors, in packed order
     std::vector<glm::vec3> unique_oklab_colors;           // Oklab colors
     std::vector<int> cluster_assignments;                 // Cluster index per unique color
     std::vector<glm::vec3> cluster_centers;               // Centroids in Oklab space
     std::vector<glm::u8vec3> palette_entries;             // Final palette entries in RGB
 };
 
+// Materials collect their packed colors and sort them at the end, after this many they switch to a 2 MiB presence bitmap
+constexpr size_t color_bitmap_threshold = 1u << 16;
+
+// Quantization tables have lut_size^3 cells over RGB, indexed by the upper lut_bits bits of every channel
+constexpr uint32_t lut_bits = 5;
+constexpr uint32_t lut_size = 1u << lut_bits;
+
+inline uint32_t lut_index(const glm::u8vec3 &color) {
+    return (static_cast<uint32_t>(color.r >> (8 - lut_bits)) << (2 * lut_bits)) |
+           (static_cast<uint32_t>(color.g >> (8 - lut_bits)) << lut_bits) |
+           static_cast<uint32_t>(color.b >> (8 - lut_bits));
+}
+
+uint8_t VoxelPalette::get_index(const Voxel &voxel) const {
+    auto &lookup_table = lookup_tables[voxel.material];
+    return lookup_table.empty() ? 0 : lookup_table[lut_index(voxel.color)];
+}
+
 inline uint32_t pack_rgb(const glm::u8vec3 &color) {
     return (static_cast<uint32_t>(color.r) << 16) |
            (static_cast<uint32_t>(color.g) << 8) |
            static_cast<uint32_t>(color.b);
 }
 
+// Closest and second closest centroid of a point, the centroids are stored as separate x, y and z arrays
+struct NearestCentroids {
+    int best;
+    float best_distance;
+    float second_distance;
+};
+
+NearestCentroids find_nearest_centroids(const glm::vec3 &point, const float *cx, const float *cy, const float *cz, size_t k) {
+    constexpr size_t lane_count = 8;
+    float distances[lane_count];
+    NearestCentroids result{0, std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+
+    for (size_t base = 0; base < k; base += lane_count) {
+        const size_t count = std::min(lane_count, k - base);
+
+#pragma omp simd
+        for (size_t lane = 0; lane < lane_count; ++lane) {
+            const size_t j = base + std::min(lane, count - 1);
+            const float dx = point.x - cx[j];
+            const float dy = point.y - cy[j];
+            const float dz = point.z - cz[j];
+            distances[lane] = dx * dx + dy * dy + dz * dz;
+        }
+
+        for (size_t lane = 0; lane < count; ++lane) {
+            if (distances[lane] < result.best_distance) {
+                result.second_distance = result.best_distance;
+                result.best_distance = distances[lane];
+                result.best = static_cast<int>(base + lane);
+            } else if (distances[lane] < result.second_distance) {
+                result.second_distance = distances[lane];
+            }
+        }
+    }
+
+    result.best_distance = std::sqrt(result.best_distance);
+    result.second_distance = std::sqrt(result.second_distance);
+    return result;
+}
+
+// Lloyd iterations with Hamerly bounds, seeded with k-means++. Every point keeps an upper bound on the distance to its
+// centroid and a lower bound on the distance to every other one, points whose bounds do not overlap keep their cluster
+// without evaluating any distance. The random numbers only come from a fixed seed and all sums are taken in point
+// order, so the result does not depend on the run or the thread count.
 void kmeans(const std::vector<glm::vec3> &data_points, size_t k,
             std::vector<int> &assignments, std::vector<glm::vec3> &centroids,
-            int max_iterations = 100) {
+            int max_iterations) {
     size_t n = data_points.size();
     assignments.resize(n);
     centroids.resize(k);
@@ -119,16 +201,67 @@ void kmeans(const std::vector<glm::vec3> &data_points, size_t k,
         return;
     }
 
-    std::vector<size_t> indices(n);
-    std::iota(indices.begin(), indices.end(), 0);
-    std::mt19937 rng(std::random_device{}());
-    std::shuffle(indices.begin(), indices.end(), rng);
+    // Fixed seed, so the palette and therefore the written files only depend on the input
+    std::mt19937 rng(5489u);
+    auto random_unit = [&rng]() {
+        return static_cast<double>(rng()) / 4294967296.0;
+    };
+
+    // k-means++ seeding, every next centroid is picked with a probability proportional to its squared distance
+    std::vector<float> seed_distances(n, std::numeric_limits<float>::max());
+    centroids[0] = data_points[rng() % n];
+    for (size_t j = 1; j < k; ++j) {
+        const glm::vec3 last = centroids[j - 1];
+
+#pragma omp parallel for simd schedule(static)
+        for (int64_t i = 0; i < static_cast<int64_t>(n); ++i) {
+            const glm::vec3 d = data_points[i] - last;
+            seed_distances[i] = std::min(seed_distances[i], d.x * d.x + d.y * d.y + d.z * d.z);
+        }
+
+        // Summed in order, a parallel reduction would make the pick depend on the thread count
+        double total = 0.0;
+        for (size_t i = 0; i < n; ++i)
+            total += seed_distances[i];
+
+        size_t pick = n - 1;
+        double target = random_unit() * total;
+        for (size_t i = 0; i < n; ++i) {
+            target -= seed_distances[i];
+            if (target < 0.0) {
+                pick = i;
+                break;
+            }
+        }
+
+        centroids[j] = data_points[pick];
+    }
 
-    for (int i = 0; i < k; ++i)
-        centroids[i] = data_points[indices[i]];
+    std::vector<float> cx(k), cy(k), cz(k);
+    auto store_centroids = [&]() {
+        for (size_t j = 0; j < k; ++j) {
+            cx[j] = centroids[j].x;
+            cy[j] = centroids[j].y;
+            cz[j] = centroids[j].z;
+        }
+    };
+    store_centroids();
+
+    std::vector<float> upper_bounds(n);
+    std::vector<float> lower_bounds(n);
+
+#pragma omp parallel for schedule(static)
+    for (int64_t i = 0; i < static_cast<int64_t>(n); ++i) {
+        auto nearest = find_nearest_centroids(data_points[i], cx.data(), cy.data(), cz.data(), k);
+        assignments[i] = nearest.best;
+        upper_bounds[i] = nearest.best_distance;
+        lower_bounds[i] = nearest.second_distance;
+    }
 
     std::vector<glm::vec3> new_centroids(k);
     std::vector<int> counts(k);
+    std::vector<float> half_separations(k);
+    std::vector<float> movements(k);
     bool changed = true;
     int iterations = 0;
 
@@ -136,78 +269,113 @@ void kmeans(const std::vector<glm::vec3> &data_points, size_t k,
         changed = false;
         ++iterations;
 
-        for (int i = 0; i < n; ++i) {
-            const glm::vec3 &point = data_points[i];
-            float min_distance = std::numeric_limits<float>::max();
-            int best_cluster = -1;
-            for (int j = 0; j < k; ++j) {
-                float distance = glm::dot(point - centroids[j], point - centroids[j]);
-                if (distance < min_distance) {
-                    min_distance = distance;
-                    best_cluster = j;
-                }
-            }
-            if (assignments[i] != best_cluster) {
-                assignments[i] = best_cluster;
-                changed = true;
-            }
-        }
-
         std::fill(new_centroids.begin(), new_centroids.end(), glm::vec3(0.0f));
         std::fill(counts.begin(), counts.end(), 0);
 
-        for (int i = 0; i < n; ++i) {
+        for (size_t i = 0; i < n; ++i) {
             int cluster = assignments[i];
             counts[cluster] += 1;
             new_centroids[cluster] += data_points[i];
         }
 
-        for (int j = 0; j < k; ++j) {
-            if (counts[j] > 0)
-                centroids[j] = new_centroids[j] / static_cast<float>(counts[j]);
-            else
-                centroids[j] = data_points[rng() % n];
+        float max_movement = 0.0f;
+        for (size_t j = 0; j < k; ++j) {
+            glm::vec3 centroid = counts[j] > 0 ? new_centroids[j] / static_cast<float>(counts[j]) : data_points[rng() % n];
+            movements[j] = glm::distance(centroid, centroids[j]);
+            max_movement = std::max(max_movement, movements[j]);
+            centroids[j] = centroid;
+        }
+        store_centroids();
+
+        // Half the distance from a centroid to the closest other one, a point closer than that cannot switch
+        for (size_t j = 0; j < k; ++j) {
+            auto nearest = find_nearest_centroids(centroids[j], cx.data(), cy.data(), cz.data(), k);
+            half_separations[j] = 0.5f * nearest.second_distance;
+        }
+
+#pragma omp parallel for schedule(static) reduction(|:changed)
+        for (int64_t i = 0; i < static_cast<int64_t>(n); ++i) {
+            const int cluster = assignments[i];
+            upper_bounds[i] += movements[cluster];
+            lower_bounds[i] -= max_movement;
+
+            const float bound = std::max(half_separations[cluster], lower_bounds[i]);
+            if (upper_bounds[i] <= bound)
+                continue;
+
+            upper_bounds[i] = glm::distance(data_points[i], centroids[cluster]);
+            if (upper_bounds[i] <= bound)
+                continue;
+
+            auto nearest = find_nearest_centroids(data_points[i], cx.data(), cy.data(), cz.data(), k);
+            upper_bounds[i] = nearest.best_distance;
+            lower_bounds[i] = nearest.second_distance;
+
+            if (nearest.best != cluster) {
+                assignments[i] = nearest.best;
+                changed = true;
+            }
         }
     }
+
+    VOXLIFE_TRACE_COUNTER("kmeans iterations", iterations);
 }
 
-auto generate_palette(std::span<const VoxelModel> models) -> std::pair<ogt_vox_palette, std::vector<std::vector<uint8_t>>> {
+auto generate_palette(std::span<const VoxelModel> models) -> VoxelPalette {
+    VOXLIFE_TRACE_ZONE("generate_palette");
     std::array<MaterialData, MaterialType::MATERIAL_TYPE_MAX> materials_data;
 
-    for (size_t model_idx = 0; model_idx < models.size(); ++model_idx) {
-        const VoxelModel &model = models[model_idx];
-        for (size_t voxel_idx = 0; voxel_idx < model.voxels.size(); ++voxel_idx) {
-            const Voxel &voxel = model.voxels[voxel_idx];
-            MaterialType material = voxel.material;
-            if (material == MaterialType::AIR)
-                continue;
+    // Only occupied bricks are visited, every color is clustered once no matter how many voxels use it
+    for (const VoxelModel &model : models) {
+        model.volume->for_each_voxel([&](glm::ivec3 pos, const Voxel &voxel) {
+            if (glm::any(glm::greaterThanEqual(glm::uvec3(pos), model.size)))
+                return;
 
-            auto &mat_data = materials_data[material];
+            auto &mat_data = materials_data[voxel.material];
+            const uint32_t packed_color = pack_rgb(voxel.color);
 
-            mat_data.voxel_indices.emplace_back(model_idx, voxel_idx);
+            if (!mat_data.color_bits.empty()) {
+                mat_data.color_bits[packed_color / 64] |= uint64_t(1) << (packed_color % 64);
+                return;
+            }
 
-            const uint32_t packed_color = pack_rgb(voxel.color);
+            // Neighbouring voxels often share their color
+            if (!mat_data.packed_colors.empty() && mat_data.packed_colors.back() == packed_color)
+                return;
 
-            auto it = mat_data.color_to_index.find(packed_color);
-            size_t color_index;
-            if (it == mat_data.color_to_index.end()) {
-                color_index = mat_data.unique_colors.size();
-                mat_data.unique_colors.push_back(voxel.color);
-                mat_data.color_to_index[packed_color] = color_index;
-            } else
-                color_index = it->second;
+            mat_data.packed_colors.push_back(packed_color);
+            if (mat_data.packed_colors.size() < color_bitmap_threshold)
+                return;
 
-            mat_data.voxel_color_indices.push_back(color_index);
+            mat_data.color_bits.resize((1u << 24) / 64, 0);
+            for (uint32_t color : mat_data.packed_colors)
+                mat_data.color_bits[color / 64] |= uint64_t(1) << (color % 64);
+            mat_data.packed_colors = std::vector<uint32_t>{};
+        });
+    }
+
+    // Both ways give the unique colors in packed order
+    for (auto &mat_data : materials_data) {
+        std::sort(mat_data.packed_colors.begin(), mat_data.packed_colors.end());
+        mat_data.packed_colors.erase(std::unique(mat_data.packed_colors.begin(), mat_data.packed_colors.end()), mat_data.packed_colors.end());
+
+        for (uint32_t word = 0; word < mat_data.color_bits.size(); ++word) {
+            for (uint64_t bits = mat_data.color_bits[word]; bits != 0; bits &= bits - 1)
+                mat_data.packed_colors.push_back(word * 64 + static_cast<uint32_t>(std::countr_zero(bits)));
         }
+
+        for (uint32_t packed_color : mat_data.packed_colors)
+            mat_data.unique_colors.emplace_back(packed_color >> 16, (packed_color >> 8) & 0xff, packed_color & 0xff);
+
+        mat_data.packed_colors = std::vector<uint32_t>{};
+        mat_data.color_bits = std::vector<uint64_t>{};
     }
 
-    std::pair<ogt_vox_palette, std::vector<std::vector<uint8_t>>> model_data;
-    auto &color_palette = model_data.first;
-    auto &model_indices = model_data.second;
+    VOXLIFE_TRACE_COUNTER("unique colors", std::accumulate(materials_data.begin(), materials_data.end(), size_t{0}, [](size_t sum, const MaterialData &mat_data) {
+        return sum + mat_data.unique_colors.size();
+    }));
 
-    model_indices.resize(models.size());
-    for (size_t i = 0; i < models.size(); ++i)
-        model_indices[i].resize(models[i].voxels.size());
+    VoxelPalette palette{};
 
     for (int material = 0; material < MaterialType::MATERIAL_TYPE_MAX; ++material) {
         auto &mat_data = materials_data[material];
@@ -218,119 +386,433 @@ auto generate_palette(std::span<const VoxelModel> models) -> std::pair<ogt_vox_p
 
         const size_t num_unique_colors = mat_data.unique_colors.size();
 
+        std::vector<glm::vec3> unique_rgb_colors(num_unique_colors);
+        for (size_t i = 0; i < num_unique_colors; ++i)
+            unique_rgb_colors[i] = glm::vec3(mat_data.unique_colors[i]) / 255.0f;
+
         mat_data.unique_oklab_colors.resize(num_unique_colors);
-        for (size_t i = 0; i < num_unique_colors; ++i) {
-            glm::vec3 rgb = glm::vec3(mat_data.unique_colors[i]) / 255.0f;
-            mat_data.unique_oklab_colors[i] = rgb_to_oklab(rgb);
-        }
+        rgb_to_oklab(unique_rgb_colors, mat_data.unique_oklab_colors);
 
         int k = static_cast<int>(mat_info.slot_count);
         kmeans(mat_data.unique_oklab_colors, k, mat_data.cluster_assignments, mat_data.cluster_centers);
 
+        std::vector<glm::vec3> center_rgb_colors(k);
+        oklab_to_rgb(mat_data.cluster_centers, center_rgb_colors);
+
         mat_data.palette_entries.resize(k);
         for (int i = 0; i < k; ++i) {
-            glm::vec3 rgb = oklab_to_rgb(mat_data.cluster_centers[i]);
-            rgb = glm::clamp(rgb * 255.0f, 0.0f, 255.0f);
+            glm::vec3 rgb = glm::clamp(center_rgb_colors[i] * 255.0f, 0.0f, 255.0f);
             mat_data.palette_entries[i] = glm::u8vec3(rgb);
         }
 
-        for (size_t i = 0; i < mat_data.voxel_indices.size(); ++i) {
-            const auto &voxel_idx_pair = mat_data.voxel_indices[i];
-            const size_t model_idx = voxel_idx_pair.first;
-            const size_t voxel_idx = voxel_idx_pair.second;
-            const size_t color_idx = mat_data.voxel_color_indices[i];
-            const int cluster_idx = mat_data.cluster_assignments[color_idx];
+        // With fewer colors than slots only the first centroids are set
+        const size_t used_centroids = std::min(num_unique_colors, static_cast<size_t>(k));
+        std::vector<float> cx(used_centroids), cy(used_centroids), cz(used_centroids);
+        for (size_t i = 0; i < used_centroids; ++i) {
+            cx[i] = mat_data.cluster_centers[i].x;
+            cy[i] = mat_data.cluster_centers[i].y;
+            cz[i] = mat_data.cluster_centers[i].z;
+        }
+
+        // Cell centers go through the same conversion as the clustered colors, one row of blue cells at a time
+        auto &lookup_table = palette.lookup_tables[material];
+        lookup_table.resize(lut_size * lut_size * lut_size);
+
+#pragma omp parallel for schedule(static)
+        for (int64_t row = 0; row < static_cast<int64_t>(lut_size * lut_size); ++row) {
+            std::array<glm::vec3, lut_size> cell_rgb;
+            std::array<glm::vec3, lut_size> cell_oklab;
+            const auto r = static_cast<uint32_t>(row) >> lut_bits;
+            const auto g = static_cast<uint32_t>(row) & (lut_size - 1);
+
+            for (uint32_t b = 0; b < lut_size; ++b)
+                cell_rgb[b] = (glm::vec3(r, g, b) * static_cast<float>(256 / lut_size) + static_cast<float>(128 / lut_size)) / 255.0f;
 
-            uint32_t palette_index = mat_info.slot_offset + cluster_idx;
-            model_indices[model_idx][voxel_idx] = palette_index;
+            rgb_to_oklab(cell_rgb, cell_oklab);
+
+            for (uint32_t b = 0; b < lut_size; ++b) {
+                auto nearest = find_nearest_centroids(cell_oklab[b], cx.data(), cy.data(), cz.data(), used_centroids);
+                lookup_table[row * lut_size + b] = static_cast<uint8_t>(mat_info.slot_offset + nearest.best);
+            }
         }
 
         for (int i = 0; i < k; ++i) {
-            color_palette.color[mat_info.slot_offset + i].r = mat_data.palette_entries[i].r;
-            color_palette.color[mat_info.slot_offset + i].g = mat_data.palette_entries[i].g;
-            color_palette.color[mat_info.slot_offset + i].b = mat_data.palette_entries[i].b;
-            color_palette.color[mat_info.slot_offset + i].a = 255;
+            palette.colors[mat_info.slot_offset + i].r = mat_data.palette_entries[i].r;
+            palette.colors[mat_info.slot_offset + i].g = mat_data.palette_entries[i].g;
+            palette.colors[mat_info.slot_offset + i].b = mat_data.palette_entries[i].b;
+            palette.colors[mat_info.slot_offset + i].a = 255;
         }
     }
 
-    return model_data;
+    return palette;
 }
 
-void write_magicavoxel_model(std::string_view filename, std::span<const VoxelModel> in_models) {
-    ogt_vox_scene scene{};
+bool files_are_equal(const std::filesystem::path &a, const std::filesystem::path &b) {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(a, ec);
+    if (ec || size != std::filesystem::file_size(b, ec) || ec)
+        return false;
+
+    std::ifstream file_a(a, std::ios::binary);
+    std::ifstream file_b(b, std::ios::binary);
+    if (!file_a || !file_b)
+        return false;
+
+    std::array<char, 64 * 1024> buffer_a;
+    std::array<char, 64 * 1024> buffer_b;
+    while (file_a && file_b) {
+        file_a.read(buffer_a.data(), buffer_a.size());
+        file_b.read(buffer_b.data(), buffer_b.size());
+        if (file_a.gcount() != file_b.gcount() || std::memcmp(buffer_a.data(), buffer_b.data(), static_cast<size_t>(file_a.gcount())) != 0)
+            return false;
+    }
 
-    ogt_vox_group group{};
-    group.name = "test";
-    group.parent_group_index = k_invalid_group_index;
-    group.layer_index = 0;
-    group.hidden = false;
-    group.transform = ogt_vox_transform_get_identity();
+    return true;
+}
 
-    ogt_vox_layer layer{};
-    layer.name = "testlayer";
-    layer.hidden = false;
-    layer.color = {.r = 255, .g = 0, .b = 255, .a = 255};
+// Moves a finished temp file over its target, unless the target already holds the same bytes. Unchanged outputs
+// keep their modification time, so Teardown and file syncing tools do not see them as new. Throws if the target
+// could not be replaced, the temp file is removed either way.
+void replace_if_changed(const std::filesystem::path &temp_path, const std::filesystem::path &path) {
+    std::error_code ec;
+    if (files_are_equal(temp_path, path)) {
+        std::filesystem::remove(temp_path, ec);
+        return;
+    }
 
-    scene.groups = &group;
-    scene.num_groups = 1;
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec) {
+        auto message = ec.message();
+        std::filesystem::remove(temp_path, ec);
+        throw std::runtime_error(std::format("Could not replace '{}': {}", path.string(), message));
+    }
+}
 
-    scene.layers = &layer;
-    scene.num_layers = 1;
+// Writes a .vox file through a fixed size buffer. Chunk sizes are patched in place once a chunk is complete, so
+// neither the file nor a dense copy of any model is ever held in memory. The file is written next to its target and
+// only replaces it in commit, a writer destroyed without a successful commit removes its temp file instead.
+class VoxStreamWriter {
+public:
+    explicit VoxStreamWriter(const std::string &filename)
+        : filename(filename), temp_filename(filename + ".tmp"), file(fopen(temp_filename.c_str(), "wb")) {}
+
+    ~VoxStreamWriter() {
+        if (file) {
+            fclose(file);
+            std::error_code ec;
+            std::filesystem::remove(temp_filename, ec);
+        }
+    }
 
-    std::vector<ogt_vox_instance> instances;
-    std::vector<ogt_vox_model const *> models;
+    VoxStreamWriter(const VoxStreamWriter &) = delete;
+    VoxStreamWriter &operator=(const VoxStreamWriter &) = delete;
 
-    auto [palette, voxels] = generate_palette(in_models);
+    bool is_open() const {
+        return file != nullptr;
+    }
 
-    models.resize(in_models.size());
-    instances.reserve(in_models.size());
+    uint64_t offset() const {
+        return flushed + used;
+    }
 
-    for (int i = 0; i < in_models.size(); ++i) {
-        auto *model = new ogt_vox_model{};
-        model->size_x = in_models[i].size.x;
-        model->size_y = in_models[i].size.y;
-        model->size_z = in_models[i].size.z;
-        model->voxel_data = voxels[i].data();
-        models[i] = model;
+    void write(const void *data, size_t size) {
+        auto *bytes = static_cast<const uint8_t *>(data);
+        while (size > 0) {
+            if (used == buffer.size())
+                flush();
+
+            size_t count = std::min(size, buffer.size() - used);
+            std::memcpy(buffer.data() + used, bytes, count);
+            used += count;
+            bytes += count;
+            size -= count;
+        }
+    }
 
-        auto instance = ogt_vox_instance{};
-        instance.name = "testinst";
-        instance.transform = ogt_vox_transform_get_identity();
-        instance.transform.m30 = static_cast<float>(in_models[i].pos.x);
-        instance.transform.m31 = static_cast<float>(in_models[i].pos.y);
-        instance.transform.m32 = static_cast<float>(in_models[i].pos.z);
-        instance.model_index = i;
-        instance.layer_index = 0;
-        instance.group_index = 0;
-        instance.hidden = false;
+    void write_u32(uint32_t value) {
+        write(&value, sizeof(value));
+    }
 
-        instances.emplace_back(instance);
+    void write_id(std::string_view id) {
+        write(id.data(), 4);
     }
 
-    scene.models = models.data();
-    scene.num_models = models.size();
-    scene.instances = instances.data();
-    scene.num_instances = instances.size();
+    // Dictionary strings are stored as their length followed by the characters, without a terminator
+    void write_string(std::string_view value) {
+        write_u32(static_cast<uint32_t>(value.size()));
+        write(value.data(), value.size());
+    }
 
-    scene.palette = palette;
+    void patch_u32(uint64_t at, uint32_t value) {
+        if (at >= flushed) {
+            std::memcpy(buffer.data() + (at - flushed), &value, sizeof(value));
+            return;
+        }
+
+        flush();
+        if (fseek(file, static_cast<long>(at), SEEK_SET) != 0 || fwrite(&value, sizeof(value), 1, file) != 1 || fseek(file, 0, SEEK_END) != 0)
+            failed = true;
+    }
+
+    // Returns the offset of the chunk header, which end_chunk or end_parent_chunk take to patch in the size
+    uint64_t begin_chunk(std::string_view id) {
+        uint64_t header = offset();
+        write_id(id);
+        write_u32(0);   // content size, patched by end_chunk
+        write_u32(0);   // children size, patched by end_parent_chunk
+        return header;
+    }
+
+    // Everything written since begin_chunk is the content of the chunk
+    void end_chunk(uint64_t header) {
+        patch_u32(header + 4, static_cast<uint32_t>(offset() - header - 12));
+    }
+
+    // Everything written since begin_chunk are child chunks, the chunk itself has no content
+    void end_parent_chunk(uint64_t header) {
+        patch_u32(header + 8, static_cast<uint32_t>(offset() - header - 12));
+    }
+
+    // Closes the file and moves it over the target. Throws if any write failed, the target is left untouched then.
+    void commit() {
+        flush();
+        if (ferror(file) != 0)
+            failed = true;
+        if (fclose(file) != 0)
+            failed = true;
+        file = nullptr;
+
+        if (failed) {
+            std::error_code ec;
+            std::filesystem::remove(temp_filename, ec);
+            throw std::runtime_error(std::format("Could not write vox file '{}'", temp_filename));
+        }
 
-    uint32_t buffer_size;
-    auto *buffer_data = ogt_vox_write_scene(&scene, &buffer_size);
+        replace_if_changed(temp_filename, filename);
+    }
 
-    auto *write_ptr = fopen(filename.data(), "wb");
-    if (write_ptr) {
-        fwrite(buffer_data, buffer_size, 1, write_ptr);
-        fclose(write_ptr);
-    } else {
-        std::cout << "Failed to open " << filename << " for writing. skipping..." << std::endl;
+private:
+    void flush() {
+        if (fwrite(buffer.data(), 1, used, file) != used)
+            failed = true;
+        flushed += used;
+        used = 0;
     }
-    ogt_vox_free(buffer_data);
 
-    for (auto const *model : models)
-        delete model;
+    std::string filename;
+    std::string temp_filename;
+    FILE *file;
+    bool failed = false;    // set by the first write or seek that did not go through
+    std::array<uint8_t, 64 * 1024> buffer{};
+    size_t used = 0;
+    uint64_t flushed = 0;
+};
+
+// Node transform with the identity rotation, which MagicaVoxel packs as 4
+void write_transform_node(VoxStreamWriter &writer, uint32_t node_id, uint32_t child_node_id, std::string_view name, glm::i32vec3 translation) {
+    auto chunk = writer.begin_chunk("nTRN");
+    writer.write_u32(node_id);
+    writer.write_u32(1);
+    writer.write_string("_name");
+    writer.write_string(name);
+    writer.write_u32(child_node_id);
+    writer.write_u32(UINT32_MAX);   // reserved id
+    writer.write_u32(0);            // layer id
+    writer.write_u32(1);            // frame count
+    writer.write_u32(2);
+    writer.write_string("_r");
+    writer.write_string("4");
+    writer.write_string("_t");
+    writer.write_string(std::format("{} {} {}", translation.x, translation.y, translation.z));
+    writer.end_chunk(chunk);
+}
+
+void write_magicavoxel_model(std::string_view filename, std::span<const VoxelModel> in_models, const VoxelPalette &palette) {
+    VOXLIFE_TRACE_ZONE_DETAIL("write vox", filename);
+    VoxStreamWriter writer{std::string(filename)};
+    if (!writer.is_open())
+        throw std::runtime_error(std::format("Could not create vox file '{}.tmp'", filename));
+
+    writer.write_id("VOX ");
+    writer.write_u32(150);
+
+    auto main_chunk = writer.begin_chunk("MAIN");
+
+    for (auto const &model : in_models) {
+        auto size_chunk = writer.begin_chunk("SIZE");
+        writer.write_u32(model.size.x);
+        writer.write_u32(model.size.y);
+        writer.write_u32(model.size.z);
+        writer.end_chunk(size_chunk);
+
+        // Voxels are emitted brick by brick, empty space is skipped by the occupancy masks and never visited
+        auto xyzi_chunk = writer.begin_chunk("XYZI");
+        auto count_offset = writer.offset();
+        writer.write_u32(0);
+
+        uint32_t voxel_count = 0;
+        model.volume->for_each_voxel([&](glm::ivec3 pos, const Voxel &voxel) {
+            if (glm::any(glm::greaterThanEqual(glm::uvec3(pos), model.size)))
+                return;
+
+            auto index = palette.get_index(voxel);
+            if (index == 0)
+                return;
+
+            const uint8_t xyzi[4] = {
+                static_cast<uint8_t>(pos.x),
+                static_cast<uint8_t>(pos.y),
+                static_cast<uint8_t>(pos.z),
+                index,
+            };
+            writer.write(xyzi, sizeof(xyzi));
+            ++voxel_count;
+        });
+
+        writer.patch_u32(count_offset, voxel_count);
+        VOXLIFE_TRACE_COUNTER("voxels written", voxel_count);
+        writer.end_chunk(xyzi_chunk);
+    }
+
+    // Scene graph of a single group holding one instance per model, node ids follow the layout of ogt_vox
+    const auto model_count = static_cast<uint32_t>(in_models.size());
+    const uint32_t group_transform_node = 0;
+    const uint32_t group_node = 1;
+    const uint32_t first_shape_node = 2;
+    const uint32_t first_instance_transform_node = first_shape_node + model_count;
+
+    write_transform_node(writer, group_transform_node, group_node, "test", {});
+
+    auto group_chunk = writer.begin_chunk("nGRP");
+    writer.write_u32(group_node);
+    writer.write_u32(0);
+    writer.write_u32(model_count);
+    for (uint32_t i = 0; i < model_count; ++i)
+        writer.write_u32(first_instance_transform_node + i);
+    writer.end_chunk(group_chunk);
+
+    for (uint32_t i = 0; i < model_count; ++i) {
+        auto shape_chunk = writer.begin_chunk("nSHP");
+        writer.write_u32(first_shape_node + i);
+        writer.write_u32(0);
+        writer.write_u32(1);    // model count
+        writer.write_u32(i);
+        writer.write_u32(0);
+        writer.end_chunk(shape_chunk);
+    }
+
+    for (uint32_t i = 0; i < model_count; ++i)
+        write_transform_node(writer, first_instance_transform_node + i, first_shape_node + i, "testinst", in_models[i].pos);
+
+    // The file stores the palette rotated by one entry
+    auto palette_chunk = writer.begin_chunk("RGBA");
+    for (uint32_t i = 0; i < 256; ++i)
+        writer.write(&palette.colors[(i + 1) & 255], 4);
+    writer.end_chunk(palette_chunk);
+
+    auto layer_chunk = writer.begin_chunk("LAYR");
+    writer.write_u32(0);
+    writer.write_u32(2);
+    writer.write_string("_name");
+    writer.write_string("testlayer");
+    writer.write_string("_color");
+    writer.write_string("255 0 255");
+    writer.write_u32(UINT32_MAX);   // reserved id
+    writer.end_chunk(layer_chunk);
+
+    writer.end_parent_chunk(main_chunk);
+    VOXLIFE_TRACE_COUNTER("bytes written", writer.offset());
+    writer.commit();
+}
+
+void write_magicavoxel_model(std::string_view filename, std::span<const VoxelModel> in_models) {
+    write_magicavoxel_model(filename, in_models, generate_palette(in_models));
+}
+
+// Without a level palette every file clusters the colors of its own group
+void write_brush_model_files(std::string_view level_name, std::span<const VoxelModel> voxel_models, std::span<const uint32_t> texture_ids, const VoxelPalette *level_palette, std::vector<Model> &models) {
+    auto grouped_models = std::unordered_map<uint32_t, std::vector<VoxelModel>>{};
+
+    for (size_t i = 0; i < voxel_models.size(); ++i) {
+        if (glm::all(glm::lessThanEqual(voxel_models[i].size, glm::uvec3(256))))
+            grouped_models[texture_ids[i]].push_back(voxel_models[i]);
+        else
+            std::cout << "Brush model " << i << " of " << level_name << " is larger than 256 voxels. skipping..." << std::endl;
+    }
+
+    std::filesystem::create_directories(std::format("brush/{}", level_name));
+
+    auto groups = std::vector<std::span<const VoxelModel>>{};
+    auto group_costs = std::vector<size_t>{};
+    groups.reserve(grouped_models.size());
+    for (auto const &[texture_id, voxel_model_list] : grouped_models) {
+        size_t cost = 0;
+        for (auto const &voxel_model : voxel_model_list)
+            cost += voxel_model.volume->get_brick_count();
+
+        groups.emplace_back(voxel_model_list);
+        group_costs.push_back(cost);
+    }
+
+    // Files keep their index, but the largest groups are written first so the threads finish at about the same time
+    auto write_order = std::vector<int64_t>(groups.size());
+    std::iota(write_order.begin(), write_order.end(), 0);
+    std::stable_sort(write_order.begin(), write_order.end(), [&](int64_t a, int64_t b) {
+        return group_costs[a] > group_costs[b];
+    });
+
+    std::exception_ptr write_error;
+    std::mutex write_error_mutex;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int64_t i = 0; i < static_cast<int64_t>(write_order.size()); ++i) {
+        auto model_index = write_order[i];
+        auto filename = std::format("brush/{}/{}.vox", level_name, model_index);
+
+        try {
+            if (level_palette)
+                write_magicavoxel_model(filename, groups[model_index], *level_palette);
+            else
+                write_magicavoxel_model(filename, groups[model_index]);
+        } catch (...) {
+            std::lock_guard lock(write_error_mutex);
+            if (!write_error)
+                write_error = std::current_exception();
+        }
+    }
+
+    if (write_error)
+        std::rethrow_exception(write_error);
+
+    models.reserve(models.size() + groups.size());
+
+    for (size_t model_index = 0; model_index < groups.size(); ++model_index) {
+        models.emplace_back();
+        auto &out_model = models.back();
+        out_model.name = std::format("{}", model_index);
+        out_model.size = {};
+        out_model.pos = {};
+    }
+}
+
+void write_brush_models(std::string_view level_name, std::span<const VoxelModel> voxel_models, std::span<const uint32_t> texture_ids, bool level_palette, std::vector<Model> &models) {
+    VOXLIFE_TRACE_ZONE("write_brush_models");
+    // Clustering every color of the level at once costs about as much as a single group, and the same
+    // material gets the same palette entries in every file of the level
+    std::optional<VoxelPalette> palette;
+    if (level_palette)
+        palette = generate_palette(voxel_models);
+
+    write_brush_model_files(level_name, voxel_models, texture_ids, palette ? &*palette : nullptr, models);
+}
+
+void write_brush_models(std::string_view level_name, std::span<const VoxelModel> voxel_models, std::span<const uint32_t> texture_ids, const VoxelPalette &level_palette, std::vector<Model> &models) {
+    VOXLIFE_TRACE_ZONE("write_brush_models");
+    write_brush_model_files(level_name, voxel_models, texture_ids, &level_palette, models);
 }
 
 void write_teardown_level(const LevelInfo &info) {
+    VOXLIFE_TRACE_ZONE("write_teardown_level");
     auto xml_str = std::string{};
 
     auto level_rot = std::array<float, 3>{0, 0, 0};
@@ -439,9 +921,19 @@ void write_teardown_level(const LevelInfo &info) {
     std::filesystem::create_directories("levels");
 
     auto level_filepath = std::format("levels/{}.xml", info.name);
-    auto *write_ptr = fopen(level_filepath.data(), "wb");
-    if (write_ptr) {
-        fwrite(xml_str.data(), xml_str.size(), 1, write_ptr);
-        fclose(write_ptr);
+    auto temp_filepath = level_filepath + ".tmp";
+    auto *write_ptr = fopen(temp_filepath.data(), "wb");
+    if (!write_ptr)
+        throw std::runtime_error(std::format("Could not create level file '{}'", temp_filepath));
+
+    bool written = fwrite(xml_str.data(), xml_str.size(), 1, write_ptr) == 1;
+    written = fclose(write_ptr) == 0 && written;
+    if (!written) {
+        std::error_code ec;
+        std::filesystem::remove(temp_filepath, ec);
+        throw std::runtime_error(std::format("Could not write level file '{}'", temp_filepath));
     }
+    VOXLIFE_TRACE_COUNTER("bytes written", xml_str.size());
+
+    replace_if_changed(temp_filepath, level_filepath);
 }
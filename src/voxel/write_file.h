@@ -5,36 +5,15 @@
 #include <string_view>
 #include <span>
 #include <array>
+#include <vector>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 #include <string>
 
-enum MaterialType : uint8_t {
-    AIR,
-    UN_PHYSICAL,
-    HARD_MASONRY,
-    HARD_METAL,
-    PLASTIC,
-    HEAVY_METAL,
-    WEAK_METAL,
-    PLASTER,
-    BRICK,
-    CONCRETE,
-    WOOD,
-    ROCK,
-    DIRT,
-    GRASS,
-    GLASS,
-    MATERIAL_ALL_TYPES,
-    MATERIAL_TYPE_MAX,
-};
-
-struct Voxel {
-    glm::u8vec3 color;
-    MaterialType material = MaterialType::AIR;
-};
+#include <voxel/sparse_volume.h>
 
 struct VoxelModel {
-    std::span<const Voxel> voxels;
+    const SparseVolume *volume;
     glm::i32vec3 pos;
     glm::u32vec3 size;
 };
@@ -91,8 +70,41 @@ struct LevelInfo {
     glm::vec3 spawn_rot;
 };
 
+// Palette shared by one or more .vox files. Every material that occurs has a table mapping each RGB cell to the
+// palette index of the centroid closest to the cell center, within the slots of that material.
+struct VoxelPalette {
+    std::array<glm::u8vec4, 256> colors{};
+    std::array<std::vector<uint8_t>, MaterialType::MATERIAL_TYPE_MAX> lookup_tables;
+
+    // Index a voxel is written with, zero if its material has no table
+    uint8_t get_index(const Voxel &voxel) const;
+};
+
+// Batched color space conversions of the palette clustering, the spans have the same size
+void rgb_to_oklab(std::span<const glm::vec3> rgb, std::span<glm::vec3> oklab);
+void oklab_to_rgb(std::span<const glm::vec3> oklab, std::span<glm::vec3> rgb);
+
+// Clusters the points into k centroids, deterministic for a given input whatever the thread count
+void kmeans(const std::vector<glm::vec3> &data_points, size_t k,
+            std::vector<int> &assignments, std::vector<glm::vec3> &centroids,
+            int max_iterations = 100);
+
+// Clusters the colors of every voxel in the models, per material, into one palette
+VoxelPalette generate_palette(std::span<const VoxelModel> models);
+
+// Throws if the file could not be written, an existing file at filename is kept then
 void write_magicavoxel_model(std::string_view filename, std::span<const VoxelModel> in_models);
+void write_magicavoxel_model(std::string_view filename, std::span<const VoxelModel> in_models, const VoxelPalette &palette);
+
+// Groups the voxel models by texture and writes one .vox file per group to brush/<level_name>/, the files are
+// encoded in parallel. Models must be at most 256 voxels on every axis, like the tiles of build_level_mesh.
+// With level_palette every file uses one palette clustered from all voxels of the level, instead of one per file.
+void write_brush_models(std::string_view level_name, std::span<const VoxelModel> voxel_models, std::span<const uint32_t> texture_ids, bool level_palette, std::vector<Model> &models);
+
+// Same as above with a level palette computed by the caller
+void write_brush_models(std::string_view level_name, std::span<const VoxelModel> voxel_models, std::span<const uint32_t> texture_ids, const VoxelPalette &level_palette, std::vector<Model> &models);
 
+// Writes levels/<name>.xml, throws if the file could not be written
 void write_teardown_level(const LevelInfo &info);
 
 #endif // VOXLIFE_VOXEL_WRITEFILE_H
@@ -0,0 +1,93 @@
+#include <wad/palette.h>
+
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+namespace voxlife::wad {
+
+    palette_table make_palette_table(const uint8_t* palette, bool has_transparency) {
+        palette_table table;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t alpha = has_transparency && i == 255 ? 0 : 255;
+            table[i] = static_cast<uint32_t>(palette[i * 3 + 0])
+                     | static_cast<uint32_t>(palette[i * 3 + 1]) << 8
+                     | static_cast<uint32_t>(palette[i * 3 + 2]) << 16
+                     | alpha << 24;
+        }
+
+        return table;
+    }
+
+    void expand_palette_scalar(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec4* output) {
+        static_assert(sizeof(glm::u8vec4) == sizeof(uint32_t));
+
+        auto* texels = reinterpret_cast<uint8_t*>(output);
+        for (size_t i = 0; i < indices.size(); ++i)
+            std::memcpy(texels + i * 4, &table[indices[i]], 4);
+    }
+
+    void expand_palette_scalar(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec3* output) {
+        static_assert(sizeof(glm::u8vec3) == 3);
+
+        auto* texels = reinterpret_cast<uint8_t*>(output);
+        for (size_t i = 0; i < indices.size(); ++i)
+            std::memcpy(texels + i * 3, &table[indices[i]], 3);
+    }
+
+#if defined(__AVX2__)
+
+    void expand_palette(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec4* output) {
+        auto* table_data = reinterpret_cast<const int*>(table.data());
+        auto* texels = reinterpret_cast<uint8_t*>(output);
+
+        size_t i = 0;
+        for (; i + 8 <= indices.size(); i += 8) {
+            __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices.data() + i));
+            __m256i colors = _mm256_i32gather_epi32(table_data, _mm256_cvtepu8_epi32(packed), 4);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(texels + i * 4), colors);
+        }
+
+        expand_palette_scalar(indices.subspan(i), table, output + i);
+    }
+
+    void expand_palette(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec3* output) {
+        auto* table_data = reinterpret_cast<const int*>(table.data());
+        auto* texels = reinterpret_cast<uint8_t*>(output);
+
+        // Drops the alpha byte of every texel, each 128 bit lane ends up with 12 bytes of RGB
+        const __m256i pack_rgb = _mm256_setr_epi8(
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+        // Every lane is stored with 16 bytes, the 4 bytes past the last texel must belong to the output.
+        // Keeping two texels of slack guarantees that, they are written again afterwards.
+        size_t i = 0;
+        for (; i + 10 <= indices.size(); i += 8) {
+            __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices.data() + i));
+            __m256i colors = _mm256_i32gather_epi32(table_data, _mm256_cvtepu8_epi32(packed), 4);
+            __m256i rgb = _mm256_shuffle_epi8(colors, pack_rgb);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(texels + i * 3), _mm256_castsi256_si128(rgb));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(texels + i * 3 + 12), _mm256_extracti128_si256(rgb, 1));
+        }
+
+        expand_palette_scalar(indices.subspan(i), table, output + i);
+    }
+
+#else
+
+    void expand_palette(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec4* output) {
+        expand_palette_scalar(indices, table, output);
+    }
+
+    void expand_palette(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec3* output) {
+        expand_palette_scalar(indices, table, output);
+    }
+
+#endif
+
+}
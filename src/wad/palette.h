@@ -0,0 +1,30 @@
+#ifndef VOXLIFE_WAD_PALETTE_H
+#define VOXLIFE_WAD_PALETTE_H
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+namespace voxlife::wad {
+
+    // Packed RGBA8 colors of a 256 entry palette, red in the lowest byte, so a texel is a single load
+    using palette_table = std::array<uint32_t, 256>;
+
+    // Builds the table from the 768 byte RGB palette stored after the last mip level.
+    // With transparency the last entry gets zero alpha, all others are opaque.
+    palette_table make_palette_table(const uint8_t* palette, bool has_transparency);
+
+    // Expands palette indices to colors, uses AVX2 gathers when the target supports them
+    void expand_palette(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec4* output);
+    void expand_palette(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec3* output);
+
+    // Portable table lookup, used on targets without AVX2 and as the benchmark reference
+    void expand_palette_scalar(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec4* output);
+    void expand_palette_scalar(std::span<const uint8_t> indices, const palette_table &table, glm::u8vec3* output);
+
+}
+
+#endif //VOXLIFE_WAD_PALETTE_H
@@ -16,6 +16,7 @@ namespace voxlife::wad {
 
   struct entry {
       constexpr static uint32_t max_entry_name = 16;
+      constexpr static uint8_t type_mip_texture = 0x43;
 
       uint32_t offset;
       uint32_t disk_size;
@@ -26,6 +27,38 @@ namespace voxlife::wad {
       char name[max_entry_name];
   };
 
+  // Entry type 0x43, same layout as a texture embedded in a bsp
+  struct mip_texture {
+      constexpr static uint32_t max_texture_name = 16;
+      constexpr static uint32_t mip_levels = 4;
+
+      char name[max_texture_name];
+      uint32_t width, height;
+      uint32_t offsets[mip_levels];
+  };
+
+  // Decoded textures of one wad, written by voxlife itself and memory mapped by later runs
+  struct texture_cache_header {
+      constexpr static const char* magic_value = "VXTC";
+      constexpr static uint32_t current_version = 1;
+
+      char magic[4];
+      uint32_t version;
+      uint64_t wad_path_hash;
+      uint64_t wad_size;
+      int64_t wad_write_time;
+      uint32_t texture_count;
+      uint32_t _pad;
+  };
+
+  // Follows the header once per texture, texel offsets are in bytes from the start of the file
+  struct texture_cache_entry {
+      char name[mip_texture::max_texture_name];
+      uint32_t width, height;
+      uint64_t texel_offset;
+      uint64_t texel_count;   // all mip levels
+  };
+
 }
 
 #endif //VOXLIFE_WAD_PRIMITIVES_H
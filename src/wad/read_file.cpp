@@ -1,6 +1,9 @@
 
 #include <wad/read_file.h>
 #include <wad/primitives.h>
+#include <wad/palette.h>
+#include <utils/case_insensitive.h>
+#include <utils/memory_usage.h>
 
 #include <stdexcept>
 #include <format>
@@ -8,6 +11,13 @@
 #include <cstring>
 #include <unordered_map>
 #include <span>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <iostream>
+#include <random>
 
 #if defined(_WIN32)
 #include <windows.h>
@@ -21,48 +31,6 @@
 
 namespace voxlife::wad {
 
-    struct case_insensitive_hash {
-        std::size_t operator()(std::string_view s) const noexcept {
-#if SIZE_MAX == UINT64_MAX
-            const std::size_t FNV_offset_basis = 14695981039346656037ULL;
-            const std::size_t FNV_prime = 1099511628211ULL;
-#elif SIZE_MAX == UINT32_MAX
-            const std::size_t FNV_offset_basis = 2166136261U;
-            const std::size_t FNV_prime = 16777619U;
-#else
-#error "Unsupported size_t size"
-#endif
-            std::size_t hash = FNV_offset_basis;
-            for (unsigned char c : s) {
-                c = to_lower_ascii(c);
-                hash ^= c;
-                hash *= FNV_prime;
-            }
-            return hash;
-        }
-
-    protected:
-        static constexpr unsigned char to_lower_ascii(unsigned char c) noexcept {
-            // Convert uppercase ASCII letters to lowercase
-            if (c >= 'A' && c <= 'Z')
-                return c + 32;
-            return c;
-        }
-    };
-
-    struct case_insensitive_equal : case_insensitive_hash {
-        bool operator()(std::string_view lhs, std::string_view rhs) const noexcept {
-            if (lhs.size() != rhs.size())
-                return false;
-
-            for (std::size_t i = 0; i < lhs.size(); ++i) {
-                if (case_insensitive_hash::to_lower_ascii(lhs[i]) != case_insensitive_hash::to_lower_ascii(rhs[i]))
-                    return false;
-            }
-            return true;
-        }
-    };
-
     struct wad_info {
 #if defined(_WIN32)
         HANDLE hFile;
@@ -80,11 +48,99 @@ namespace voxlife::wad {
         struct entry {
             const void* data;
             size_t size;
+            uint8_t type;
         };
 
         std::unordered_map<std::string_view, entry, case_insensitive_hash, case_insensitive_equal> entries;
+
+        // Keyed by entry data, handles may be shared between levels that are converted concurrently
+        std::mutex textures_mutex;
+        std::unordered_map<const void*, std::unique_ptr<decoded_texture>> textures;
+
+        // Memory mapped texture cache, it is immutable after opening the file and needs no locking
+#if defined(_WIN32)
+        HANDLE hCacheFile = INVALID_HANDLE_VALUE;
+        HANDLE hCacheMap = nullptr;
+#else
+        int cache_file = -1;
+#endif
+        size_t cache_size = 0;
+        const uint8_t* cache_data = nullptr;
+
+        std::unordered_map<std::string_view, texture, case_insensitive_hash, case_insensitive_equal> cached_textures;
+
+        bool shared = false;
+    };
+
+    // Opened by the first caller of its path, outside of the registry lock
+    struct shared_file {
+        std::once_flag open_flag;
+        wad_handle handle = nullptr;
+    };
+
+    struct wad_registry {
+        std::mutex mutex;
+        std::unordered_map<std::string, shared_file> files;   // nodes never move, entries stay valid without the lock
     };
 
+    wad_registry& get_registry() {
+        static wad_registry registry;
+        return registry;
+    }
+
+    std::string& get_texture_cache_directory() {
+        static std::string directory;
+        return directory;
+    }
+
+    void set_texture_cache_directory(std::string_view directory) {
+        get_texture_cache_directory() = directory;
+    }
+
+    decoded_texture decode_mip_texture(const void* data, size_t size) {
+        auto* texture_begin = reinterpret_cast<const uint8_t*>(data);
+
+        if (size < sizeof(mip_texture))
+            throw std::runtime_error("Mip texture is smaller than its header");
+
+        auto* mip_texture_handle = reinterpret_cast<const mip_texture*>(texture_begin);
+
+        const uint32_t texture_width  = mip_texture_handle->width;
+        const uint32_t texture_height = mip_texture_handle->height;
+        const uint32_t texel_count = texture_width * texture_height;
+        // make_palette_table reads all 256 RGB entries, checked as offsets so a bad header can not wrap the pointer
+        const size_t color_offset = static_cast<size_t>(mip_texture_handle->offsets[3]) + texel_count / 64 + 2;
+        if (color_offset > size || size - color_offset < 256 * 3)
+            throw std::runtime_error("Color data extends beyond end of texture");
+
+        auto color_data = texture_begin + color_offset;
+
+        // Only the last palette entry of '{' textures is transparent, everything else is opaque
+        auto table = make_palette_table(color_data, mip_texture_handle->name[0] == '{');
+
+        size_t mip_chain_length = 0;
+        for (uint32_t i = 0; i < mip_texture::mip_levels; ++i)
+            mip_chain_length += static_cast<size_t>(texture_width >> i) * (texture_height >> i);
+
+        decoded_texture result;
+        result.data.resize(mip_chain_length);
+        result.size = glm::u32vec2(texture_width, texture_height);
+
+        size_t mip_offset = 0;
+        for (uint32_t i = 0; i < mip_texture::mip_levels; ++i) {
+            const size_t mip_texel_count = static_cast<size_t>(texture_width >> i) * (texture_height >> i);
+            const uint8_t* texture_data = texture_begin + mip_texture_handle->offsets[i];
+
+            if (texture_data + mip_texel_count > color_data)
+                throw std::runtime_error("Texture data extends beyond color data");
+
+            expand_palette(std::span(texture_data, mip_texel_count), table, result.data.data() + mip_offset);
+            mip_offset += mip_texel_count;
+        }
+
+        return result;
+    }
+
     void index_entries(wad_info &info) {
         if (std::memcmp(info.file_data, header::magic_value, 4) != 0)
             throw std::runtime_error("Invalid WAD magic value");
@@ -96,7 +152,251 @@ namespace voxlife::wad {
             if (entry.compressed)
                 throw std::runtime_error("Compressed entries are not supported");
 
-            info.entries[entry.name] = { info.file_data + entry.offset, entry.size };
+            info.entries[entry.name] = { info.file_data + entry.offset, entry.size, entry.type };
+        }
+    }
+
+    bool map_texture_cache(wad_info &info, const std::filesystem::path &cache_path) {
+#if defined(_WIN32)
+
+        info.hCacheFile = CreateFileW(cache_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (info.hCacheFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER liFileSize;
+        if (!GetFileSizeEx(info.hCacheFile, &liFileSize) || liFileSize.QuadPart == 0) {
+            CloseHandle(info.hCacheFile);
+            info.hCacheFile = INVALID_HANDLE_VALUE;
+            return false;
+        }
+
+        info.hCacheMap = CreateFileMapping(info.hCacheFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (info.hCacheMap == 0) {
+            CloseHandle(info.hCacheFile);
+            info.hCacheFile = INVALID_HANDLE_VALUE;
+            return false;
+        }
+
+        LPVOID lpBasePtr = MapViewOfFile(info.hCacheMap, FILE_MAP_READ, 0, 0, 0);
+        if (lpBasePtr == nullptr) {
+            CloseHandle(info.hCacheMap);
+            CloseHandle(info.hCacheFile);
+            info.hCacheMap = nullptr;
+            info.hCacheFile = INVALID_HANDLE_VALUE;
+            return false;
+        }
+
+        info.cache_size = liFileSize.QuadPart;
+        info.cache_data = reinterpret_cast<const uint8_t*>(lpBasePtr);
+
+#else
+
+        info.cache_file = open(cache_path.c_str(), O_RDONLY);
+        if (info.cache_file < 0)
+            return false;
+
+        struct stat st{};
+        if (fstat(info.cache_file, &st) < 0 || st.st_size == 0) {
+            close(info.cache_file);
+            info.cache_file = -1;
+            return false;
+        }
+
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FILE, info.cache_file, 0);
+        if (data == MAP_FAILED) {
+            close(info.cache_file);
+            info.cache_file = -1;
+            return false;
+        }
+
+        info.cache_size = st.st_size;
+        info.cache_data = reinterpret_cast<const uint8_t*>(data);
+
+#endif
+
+        memory::add_mapped_bytes(info.cache_size);
+        return true;
+    }
+
+    void unmap_texture_cache(wad_info &info) {
+        if (info.cache_data == nullptr)
+            return;
+
+#if defined(_WIN32)
+        UnmapViewOfFile(info.cache_data);
+        CloseHandle(info.hCacheMap);
+        CloseHandle(info.hCacheFile);
+        info.hCacheMap = nullptr;
+        info.hCacheFile = INVALID_HANDLE_VALUE;
+#else
+        munmap(const_cast<void*>(reinterpret_cast<const void*>(info.cache_data)), info.cache_size);
+        close(info.cache_file);
+        info.cache_file = -1;
+#endif
+
+        memory::remove_mapped_bytes(info.cache_size);
+        info.cache_data = nullptr;
+        info.cache_size = 0;
+        info.cached_textures.clear();
+    }
+
+    // Hands out textures from the mapped cache, fails if the cache does not belong to this exact file
+    bool read_texture_cache(wad_info &info, const texture_cache_header &expected) {
+        if (info.cache_size < sizeof(texture_cache_header))
+            return false;
+
+        auto& header = *reinterpret_cast<const texture_cache_header*>(info.cache_data);
+        if (std::memcmp(header.magic, texture_cache_header::magic_value, 4) != 0 ||
+            header.version != texture_cache_header::current_version ||
+            header.wad_path_hash != expected.wad_path_hash ||
+            header.wad_size != expected.wad_size ||
+            header.wad_write_time != expected.wad_write_time)
+            return false;
+
+        if (sizeof(texture_cache_header) + header.texture_count * sizeof(texture_cache_entry) > info.cache_size)
+            return false;
+
+        std::span<const texture_cache_entry> entries(reinterpret_cast<const texture_cache_entry*>(info.cache_data + sizeof(texture_cache_header)),
+                                                     header.texture_count);
+
+        for (auto& entry : entries) {
+            // Offset and count come from the file, compared one by one so that no sum or product can wrap
+            const uint64_t texel_count = static_cast<uint64_t>(entry.width) * entry.height;
+            if (entry.texel_offset % alignof(glm::u8vec4) != 0 || entry.texel_count < texel_count ||
+                entry.texel_offset > info.cache_size ||
+                entry.texel_count > (info.cache_size - entry.texel_offset) / sizeof(glm::u8vec4)) {
+                info.cached_textures.clear();
+                return false;
+            }
+
+            auto* texels = reinterpret_cast<const glm::u8vec4*>(info.cache_data + entry.texel_offset);
+            std::string_view name(entry.name, strnlen(entry.name, mip_texture::max_texture_name));
+
+            info.cached_textures[name] = {
+                .data = std::span(texels, texel_count),
+                .mip_chain = std::span(texels, entry.texel_count),
+                .size = glm::u32vec2(entry.width, entry.height),
+            };
+        }
+
+        return true;
+    }
+
+    // Unique across every process sharing the cache directory, not just across the threads of this one
+    std::string get_temp_suffix() {
+#if defined(_WIN32)
+        auto process_id = static_cast<uint64_t>(GetCurrentProcessId());
+#else
+        auto process_id = static_cast<uint64_t>(getpid());
+#endif
+        thread_local std::mt19937_64 rng(std::random_device{}());
+        return std::format(".{}.{:016x}.tmp", process_id, rng());
+    }
+
+    void write_texture_cache(const wad_info &info, const std::filesystem::path &cache_path, const texture_cache_header &header) {
+        std::vector<std::pair<std::string_view, const wad_info::entry*>> texture_entries;
+        for (auto& [name, entry] : info.entries) {
+            if (entry.type == entry::type_mip_texture)
+                texture_entries.emplace_back(name, &entry);
+        }
+
+        std::vector<decoded_texture> decoded_textures(texture_entries.size());
+        std::vector<uint8_t> is_decoded(texture_entries.size(), 0);
+
+#pragma omp parallel for schedule(dynamic)
+        for (int64_t i = 0; i < static_cast<int64_t>(texture_entries.size()); ++i) {
+            auto [name, entry] = texture_entries[i];
+            try {
+                decoded_textures[i] = decode_mip_texture(entry->data, entry->size);
+                is_decoded[i] = 1;
+            } catch (std::exception &e) {
+#pragma omp critical
+                std::cerr << std::format("Could not decode texture '{}': {}", name, e.what()) << std::endl;
+            }
+        }
+
+        std::vector<texture_cache_entry> cache_entries;
+        std::vector<decoded_texture> textures;
+
+        for (size_t i = 0; i < texture_entries.size(); ++i) {
+            if (!is_decoded[i])
+                continue;
+
+            auto name = texture_entries[i].first;
+            textures.push_back(std::move(decoded_textures[i]));
+
+            texture_cache_entry cache_entry{};
+            std::memcpy(cache_entry.name, name.data(), std::min<size_t>(name.size(), mip_texture::max_texture_name - 1));
+            cache_entry.width = textures.back().size.x;
+            cache_entry.height = textures.back().size.y;
+            cache_entry.texel_count = textures.back().data.size();
+            cache_entries.push_back(cache_entry);
+        }
+
+        texture_cache_header cache_header = header;
+        std::memcpy(cache_header.magic, texture_cache_header::magic_value, 4);
+        cache_header.version = texture_cache_header::current_version;
+        cache_header.texture_count = static_cast<uint32_t>(cache_entries.size());
+
+        uint64_t texel_offset = sizeof(texture_cache_header) + cache_entries.size() * sizeof(texture_cache_entry);
+        for (auto& cache_entry : cache_entries) {
+            cache_entry.texel_offset = texel_offset;
+            texel_offset += cache_entry.texel_count * sizeof(glm::u8vec4);
+        }
+
+        // Write next to the final file and swap it in, a reader never sees a partial cache
+        std::filesystem::create_directories(cache_path.parent_path());
+        auto temp_path = cache_path;
+        temp_path += get_temp_suffix();
+
+        {
+            std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+            if (!file)
+                throw std::runtime_error(std::format("Could not create texture cache '{}'", temp_path.string()));
+
+            file.write(reinterpret_cast<const char*>(&cache_header), sizeof(cache_header));
+            file.write(reinterpret_cast<const char*>(cache_entries.data()), cache_entries.size() * sizeof(texture_cache_entry));
+            for (auto& texture : textures)
+                file.write(reinterpret_cast<const char*>(texture.data.data()), texture.data.size() * sizeof(glm::u8vec4));
+
+            if (!file)
+                throw std::runtime_error(std::format("Could not write texture cache '{}'", temp_path.string()));
+        }
+
+        std::filesystem::rename(temp_path, cache_path);
+    }
+
+    void open_texture_cache(wad_info &info, std::string_view filename) {
+        auto& directory = get_texture_cache_directory();
+        if (directory.empty())
+            return;
+
+        std::filesystem::path wad_path(filename);
+
+        texture_cache_header expected{};
+        expected.wad_path_hash = case_insensitive_hash{}(filename);
+        expected.wad_size = info.file_size;
+        expected.wad_write_time = std::filesystem::last_write_time(wad_path).time_since_epoch().count();
+
+        auto cache_path = std::filesystem::path(directory) / std::format("{}_{:016x}.texcache", wad_path.stem().string(), expected.wad_path_hash);
+
+        if (map_texture_cache(info, cache_path)) {
+            if (read_texture_cache(info, expected))
+                return;
+
+            unmap_texture_cache(info);
+        }
+
+        try {
+            write_texture_cache(info, cache_path, expected);
+        } catch (std::exception &e) {
+            std::cerr << "Failed to write texture cache for " << filename << ": " << e.what() << std::endl;
+            return;
+        }
+
+        if (!map_texture_cache(info, cache_path) || !read_texture_cache(info, expected)) {
+            std::cerr << "Failed to read texture cache " << cache_path << std::endl;
+            unmap_texture_cache(info);
         }
     }
 
@@ -170,11 +470,14 @@ namespace voxlife::wad {
 
 #endif
 
+        memory::add_mapped_bytes(info.file_size);
         index_entries(info);
+        open_texture_cache(info, filename);
     }
 
-    void release(wad_handle handle) {
-        auto& info = reinterpret_cast<wad_info&>(*handle);
+    void release_file(wad_info &info) {
+        unmap_texture_cache(info);
+
 #if defined(_WIN32)
         CloseHandle(info.hMap);
         CloseHandle(info.hFile);
@@ -182,7 +485,48 @@ namespace voxlife::wad {
         munmap(const_cast<void*>(reinterpret_cast<const void*>(info.file_data)), info.file_size);
         close(info.wad_file);
 #endif
-        delete reinterpret_cast<wad_info*>(handle);
+        memory::remove_mapped_bytes(info.file_size);
+        delete &info;
+    }
+
+    void release(wad_handle handle) {
+        auto& info = reinterpret_cast<wad_info&>(*handle);
+        if (info.shared)
+            return;
+
+        release_file(info);
+    }
+
+    void open_shared_file(std::string_view filename, wad_handle* handle) {
+        auto& registry = get_registry();
+        shared_file* file;
+        {
+            std::lock_guard lock(registry.mutex);
+            file = &registry.files.try_emplace(std::string(filename)).first->second;
+        }
+
+        // Decoding a wad and writing its texture cache only holds up the levels waiting for the same file. A throw
+        // leaves the flag unset, the next caller tries again.
+        std::call_once(file->open_flag, [&]() {
+            wad_handle opened;
+            open_file(filename, &opened);
+            reinterpret_cast<wad_info&>(*opened).shared = true;
+            file->handle = opened;
+        });
+
+        *handle = file->handle;
+    }
+
+    void release_shared_files() {
+        auto& registry = get_registry();
+        std::lock_guard lock(registry.mutex);
+
+        for (auto& [filename, file] : registry.files) {
+            if (file.handle != nullptr)
+                release_file(reinterpret_cast<wad_info&>(*file.handle));
+        }
+
+        registry.files.clear();
     }
 
     const void* get_entry(wad_handle handle, std::string_view name) {
@@ -205,4 +549,38 @@ namespace voxlife::wad {
         return it->second.size;
     }
 
+    texture get_texture(wad_handle handle, std::string_view name) {
+        auto& info = reinterpret_cast<wad_info&>(*handle);
+
+        auto cached_it = info.cached_textures.find(name);
+        if (cached_it != info.cached_textures.end())
+            return cached_it->second;
+
+        auto it = info.entries.find(name);
+        if (it == info.entries.end())
+            return {};
+
+        auto to_texture = [](const decoded_texture &texture) {
+            return wad::texture{
+                .data = std::span(texture.data).first(static_cast<size_t>(texture.size.x) * texture.size.y),
+                .mip_chain = texture.data,
+                .size = texture.size,
+            };
+        };
+
+        {
+            std::lock_guard lock(info.textures_mutex);
+            auto texture_it = info.textures.find(it->second.data);
+            if (texture_it != info.textures.end())
+                return to_texture(*texture_it->second);
+        }
+
+        // Decode outside of the lock, if another thread was faster its result is kept instead
+        auto decoded = std::make_unique<decoded_texture>(decode_mip_texture(it->second.data, it->second.size));
+
+        std::lock_guard lock(info.textures_mutex);
+        auto& texture = *info.textures.try_emplace(it->second.data, std::move(decoded)).first->second;
+        return to_texture(texture);
+    }
+
 }
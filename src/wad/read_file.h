@@ -3,6 +3,12 @@
 #define VOXLIFE_WAD_READ_FILE_H
 
 #include <string_view>
+#include <span>
+#include <vector>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 
 namespace voxlife::wad {
 
@@ -11,9 +17,39 @@ namespace voxlife::wad {
     void open_file(std::string_view filename, wad_handle* handle);
     void release(wad_handle handle);
 
+    // Opens a file through the process-wide registry, every file is only mapped and indexed once.
+    // Shared handles ignore release and stay open until release_shared_files is called.
+    void open_shared_file(std::string_view filename, wad_handle* handle);
+    void release_shared_files();
+
     const void* get_entry(wad_handle handle, std::string_view name);
     size_t get_entry_size(wad_handle handle, std::string_view name);
 
+    struct texture {
+        std::span<const glm::u8vec4> data;       // mip level 0
+        std::span<const glm::u8vec4> mip_chain;  // every mip level, largest first
+
+        glm::u32vec2 size;
+    };
+
+    struct decoded_texture {
+        std::vector<glm::u8vec4> data;      // every mip level, largest first
+
+        glm::u32vec2 size;
+    };
+
+    // Expands a palette indexed mip texture, as stored in wads and bsps, into RGBA8.
+    // Textures whose name starts with '{' use the last palette entry as transparent.
+    decoded_texture decode_mip_texture(const void* data, size_t size);
+
+    // Decoded textures of every file opened afterwards are stored in this directory and memory
+    // mapped by later runs, as long as the file size and modification time match. Empty disables it.
+    void set_texture_cache_directory(std::string_view directory);
+
+    // Decodes a mip texture entry on first use, the texture stays valid as long as the handle.
+    // Returns an empty texture if there is no entry with that name.
+    texture get_texture(wad_handle handle, std::string_view name);
+
 }
 
 #endif //VOXLIFE_WAD_READ_FILE_H
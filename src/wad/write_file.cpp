@@ -0,0 +1,102 @@
+
+#include <wad/write_file.h>
+#include <wad/primitives.h>
+
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+
+
+namespace voxlife::wad {
+
+    // Header, four mip levels, the palette size and the palette, padded to keep the next entry aligned
+    std::vector<uint8_t> encode_mip_texture(const source_texture &texture) {
+        if (texture.name.empty() || texture.name.size() >= mip_texture::max_texture_name)
+            throw std::runtime_error(std::format("Texture name '{}' must have 1 to {} characters", texture.name, mip_texture::max_texture_name - 1));
+
+        if (texture.size.x == 0 || texture.size.y == 0 || texture.size.x % 16 != 0 || texture.size.y % 16 != 0)
+            throw std::runtime_error(std::format("Texture '{}' is {}x{}, both sides must be multiples of 16", texture.name, texture.size.x, texture.size.y));
+
+        if (texture.indices.size() != static_cast<size_t>(texture.size.x) * texture.size.y)
+            throw std::runtime_error(std::format("Texture '{}' has {} indices instead of {}", texture.name, texture.indices.size(), texture.size.x * texture.size.y));
+
+        mip_texture header{};
+        std::memcpy(header.name, texture.name.data(), texture.name.size());
+        header.width = texture.size.x;
+        header.height = texture.size.y;
+
+        size_t size = sizeof(mip_texture);
+        for (uint32_t i = 0; i < mip_texture::mip_levels; ++i) {
+            header.offsets[i] = static_cast<uint32_t>(size);
+            size += static_cast<size_t>(texture.size.x >> i) * (texture.size.y >> i);
+        }
+
+        const size_t palette_offset = size;
+        size += sizeof(uint16_t) + texture.palette.size() * 3;
+        size = (size + 3) & ~size_t(3);
+
+        std::vector<uint8_t> data(size, 0);
+        std::memcpy(data.data(), &header, sizeof(header));
+
+        // Smaller levels point sample the top level, indices can not be averaged
+        for (uint32_t i = 0; i < mip_texture::mip_levels; ++i) {
+            const uint32_t width = texture.size.x >> i;
+            const uint32_t height = texture.size.y >> i;
+            uint8_t* level = data.data() + header.offsets[i];
+
+            for (uint32_t y = 0; y < height; ++y) {
+                for (uint32_t x = 0; x < width; ++x)
+                    level[x + static_cast<size_t>(y) * width] = texture.indices[(x << i) + (static_cast<size_t>(y) << i) * texture.size.x];
+            }
+        }
+
+        const uint16_t palette_size = static_cast<uint16_t>(texture.palette.size());
+        std::memcpy(data.data() + palette_offset, &palette_size, sizeof(palette_size));
+        for (size_t i = 0; i < texture.palette.size(); ++i) {
+            data[palette_offset + sizeof(palette_size) + i * 3 + 0] = texture.palette[i].r;
+            data[palette_offset + sizeof(palette_size) + i * 3 + 1] = texture.palette[i].g;
+            data[palette_offset + sizeof(palette_size) + i * 3 + 2] = texture.palette[i].b;
+        }
+
+        return data;
+    }
+
+    void write_file(std::string_view filename, std::span<const source_texture> textures) {
+        std::vector<entry> entries(textures.size());
+        std::vector<std::vector<uint8_t>> entry_data(textures.size());
+
+        uint32_t offset = sizeof(header);
+        for (size_t i = 0; i < textures.size(); ++i) {
+            entry_data[i] = encode_mip_texture(textures[i]);
+
+            auto& wad_entry = entries[i];
+            wad_entry.offset = offset;
+            wad_entry.disk_size = static_cast<uint32_t>(entry_data[i].size());
+            wad_entry.size = static_cast<uint32_t>(entry_data[i].size());
+            wad_entry.type = entry::type_mip_texture;
+            wad_entry.compressed = false;
+            std::memcpy(wad_entry.name, textures[i].name.data(), textures[i].name.size());
+
+            offset += wad_entry.disk_size;
+        }
+
+        header wad_header{};
+        std::memcpy(wad_header.magic, header::magic_value, 4);
+        wad_header.entry_count = static_cast<uint32_t>(entries.size());
+        wad_header.entry_offset = offset;
+
+        std::ofstream file(std::string(filename), std::ios::binary | std::ios::trunc);
+        if (!file)
+            throw std::runtime_error(std::format("Could not create wad file '{}'", filename));
+
+        file.write(reinterpret_cast<const char*>(&wad_header), sizeof(wad_header));
+        for (auto& data : entry_data)
+            file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        file.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(entry)));
+
+        if (!file)
+            throw std::runtime_error(std::format("Could not write wad file '{}'", filename));
+    }
+
+}
@@ -0,0 +1,30 @@
+
+#ifndef VOXLIFE_WAD_WRITE_FILE_H
+#define VOXLIFE_WAD_WRITE_FILE_H
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+namespace voxlife::wad {
+
+    // Palette indexed texture as stored in a wad, only mip level 0 is given and the smaller levels are derived from it
+    struct source_texture {
+        std::string name;                       // at most 15 characters, the reader needs a terminator
+        glm::u32vec2 size;                      // multiples of 16, so every mip level has whole texels
+        std::vector<uint8_t> indices;           // size.x * size.y palette indices, row major
+        std::array<glm::u8vec3, 256> palette;
+    };
+
+    // Writes an uncompressed WAD3 file holding one mip texture entry per texture, readable by open_file
+    void write_file(std::string_view filename, std::span<const source_texture> textures);
+
+}
+
+#endif //VOXLIFE_WAD_WRITE_FILE_H